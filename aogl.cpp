@@ -1,15 +1,37 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <assert.h>
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
 #include <iostream>
 
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "glew/glew.h"
 
 #include "GLFW/glfw3.h"
 #include "stb/stb_image.h"
 #include "imgui/imgui.h"
 #include "imgui/imguiRenderGL3.h"
+#include "common/mipmap.h"
+#include "common/texfile.h"
+#include "common/mappedfile.h"
+#include "common/filewatcher.h"
+extern "C" {
+#include "deps/tinycthread.h"
+}
 
 #include "glm/glm.hpp"
 #include "glm/vec3.hpp" // glm::vec3
@@ -36,18 +58,427 @@
 #endif
 #endif
 
+// GL_KHR_parallel_shader_compile, missing from GLEW
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (GLAPIENTRY * MaxShaderCompilerThreadsProc)(GLuint count);
+
 // Font buffers
 extern const unsigned char DroidSans_ttf[];
 extern const unsigned int DroidSans_ttf_len;    
 
 // Shader utils
 int check_link_error(GLuint program);
-int check_compile_error(GLuint shader, const char ** sourceBuffer);
-GLuint compile_shader(GLenum shaderType, const char * sourceBuffer, int bufferSize);
-GLuint compile_shader_from_file(GLenum shaderType, const char * fileName);
+int check_compile_error(GLuint shader, const char ** sourceBuffer, const std::vector<std::string> * files);
+GLuint submit_shader(GLenum shaderType, const char * sourceBuffer);
+bool read_text_file(const char * path, std::string & text);
+
+// Shader preprocessor : resolves #include "file", relative to the including
+// file, and inserts the defines after #version. #line
+// directives number the lines of each file with its index in files, so the
+// compiler logs are mapped back to file names and lines. files also lists
+// what the stage depends on, the stage file first.
+struct ShaderSource
+{
+    std::string text;
+    std::vector<std::string> files;
+};
+bool preprocess_shader(const char * path, const char * defines, ShaderSource & source);
+std::string shader_log_with_files(const char * log, const std::vector<std::string> & files);
+
+// Program binary cache : linked programs are saved with glGetProgramBinary,
+// keyed by a hash of their stages, sources, defines and the driver strings,
+// and restored with glProgramBinary by the next runs. A missing or refused
+// binary falls back to compiling the sources.
+struct ProgramCache
+{
+    static const int MAX_STAGES = 5;
+    std::string directory;
+    std::string driver; // Vendor, renderer and versions
+    std::vector<GLint> formats; // Binary formats of the driver, the cache is off without any
+    int loadedCount; // Programs restored from a binary
+    int compiledCount; // Programs compiled from source
+    double milliseconds; // Spent creating programs
+};
+void program_cache_init(ProgramCache & cache, const char * directory);
+GLuint64 program_cache_key(const ProgramCache & cache, int stageCount, const GLenum * stages, const ShaderSource * sources);
+GLuint program_cache_load(ProgramCache & cache, GLuint64 key);
+void program_cache_store(ProgramCache & cache, GLuint64 key, GLuint program);
+
+// Program reflection : the active uniforms and uniform blocks of a program
+// are enumerated once it is linked. Names are interned in a table shared by
+// every program, so a name has the same slot index in all of them and draws
+// find locations by slot instead of looking strings up.
+struct UniformNames
+{
+    std::vector<std::string> names; // By slot
+    std::map<std::string, int> slots;
+    std::vector<GLint> blockBindings; // By slot, given to the blocks of that name, -1 for none
+};
+// Slot of a name, the next free one the first time it is seen
+int uniform_names_intern(UniformNames & un, const char * name);
+// Binding point of the uniform blocks with that name in the programs reflected from now on
+void uniform_names_bind_block(UniformNames & un, const char * name, GLuint binding);
+
+struct ProgramUniform
+{
+    int slot;
+    GLint location; // -1 in blocks
+    GLenum type;
+    GLint size; // Array length, 1 otherwise
+    GLint block; // Index in ProgramReflection::blocks, -1 out of blocks
+    GLint offset; // In the block
+};
+
+struct ProgramBlock
+{
+    int slot;
+    GLuint index;
+    GLint dataSize;
+    GLint binding;
+};
+
+struct ProgramReflection
+{
+    GLuint program;
+    std::vector<ProgramUniform> uniforms;
+    std::vector<ProgramBlock> blocks;
+    std::vector<GLint> locations; // By slot, -1 for names the program lacks
+    std::vector<int> blockIndices; // Index in blocks by slot, -1 for none
+};
+void program_reflect(ProgramReflection & pr, UniformNames & un, GLuint program);
+inline GLint program_location(const ProgramReflection & pr, int slot)
+{
+    return (size_t) slot < pr.locations.size() ? pr.locations[slot] : -1;
+}
+// The uniform block named by the slot, 0 if the program lacks it
+const ProgramBlock * program_block(const ProgramReflection & pr, int slot);
+
+// Programs are compiled and linked asynchronously : everything is submitted
+// up front and statuses are only queried once the driver reports the link
+// complete (GL_KHR_parallel_shader_compile), or a frame later without the
+// extension, so polling never waits on the compiler. Until it is linked a
+// program resolves to its fallback.
+enum ProgramState
+{
+    PROGRAM_LINKING,
+    PROGRAM_READY,
+    PROGRAM_FAILED
+};
+
+struct Program
+{
+    std::string name; // Stage paths, for messages
+    ProgramState state;
+    GLuint id;
+    GLuint linkingId; // Object being linked, it replaces id once linked, 0 for none
+    int stageCount;
+    GLenum stages[ProgramCache::MAX_STAGES];
+    std::string paths[ProgramCache::MAX_STAGES];
+    std::string defines;
+    GLuint shaders[ProgramCache::MAX_STAGES];
+    ShaderSource sources[ProgramCache::MAX_STAGES]; // Texts are kept for compile logs until linked
+    ProgramReflection reflection; // Of id, once ready
+    GLuint64 key;
+    int fallback; // Program used while this one is not ready, -1 for none
+    int submitFrame;
+    bool stale; // Its files changed while it was linking
+};
+
+// Shader permutations : stages declare feature keywords with
+//     #pragma keyword NAME               toggled on or off
+//     #pragma keyword NAME1 NAME2 ...    exactly one of them, NAME1 by default
+// and each combination draws ask for is compiled on demand as a variant
+// with a #define per keyword, so shaders specialize at compile time instead
+// of branching on uniforms. While they link, variants fall back to the one
+// with the same toggles and the first keyword of each choice, which keeps
+// the vertex layout and sampler types, then to the default one with the
+// toggles off.
+struct ProgramVariants
+{
+    static const int MAX_KEYWORDS = 32;
+    int stageCount;
+    GLenum stages[ProgramCache::MAX_STAGES];
+    std::string paths[ProgramCache::MAX_STAGES];
+    std::vector<std::string> keywords; // Bit i of a keyword mask stands for keywords[i]
+    std::vector<unsigned int> choices; // Masks of the exclusive groups
+    std::map<unsigned int, int> programs; // By keyword mask
+    int defaultProgram;
+};
+
+struct ProgramManager
+{
+    ProgramCache cache;
+    std::vector<Program> programs;
+    std::vector<ProgramVariants> variants;
+    bool parallelCompile; // The driver compiles on its own threads and reports completion
+    int frame;
+    int linkingCount;
+    FileWatcher watcher; // Sources and includes of the programs
+    UniformNames uniformNames;
+    int reloadCount; // Rebuilt programs swapped in, their objects changed
+};
+void program_manager_init(ProgramManager & pm, const char * cacheDirectory);
+int program_manager_add(ProgramManager & pm, int stageCount, const GLenum * stages, const char * const * paths, const char * defines, int fallback);
+// Rebuilds the programs whose files changed and completes the programs the
+// driver is done with, once per frame. A rebuilt program replaces the
+// previous one only once linked, which is kept if it fails.
+void program_manager_update(ProgramManager & pm);
+// Blocks until the program is linked or failed
+void program_manager_wait(ProgramManager & pm, int handle);
+// The program, or the first of its fallbacks that is ready, 0 if none is
+GLuint program_manager_program(const ProgramManager & pm, int handle);
+// Reflection of the same program, 0 if none is ready. Adding programs moves it.
+const ProgramReflection * program_manager_reflection(const ProgramManager & pm, int handle);
+// Programs built from a file, by one of their stages or through an include
+void program_manager_dependents(const ProgramManager & pm, const char * path, std::vector<int> & handles);
+// Reads the keywords of the stages and submits the default variant
+int program_manager_add_variants(ProgramManager & pm, int stageCount, const GLenum * stages, const char * const * paths);
+// Mask bit of a keyword, 0 if the stages do not declare it
+unsigned int program_manager_keyword(const ProgramManager & pm, int variants, const char * keyword);
+// Program handle of a keyword combination, submitted the first time it is asked for
+int program_manager_variant(ProgramManager & pm, int variants, unsigned int keywords);
 
 // OpenGL utils
 bool checkError(const char* title);
+bool checkFramebuffer(const char* title);
+GLuint create_render_texture(GLenum internalFormat, GLenum format, GLenum type, GLenum filter, int width, int height);
+
+// Temporal anti-aliasing utils
+float halton(int index, int base);
+glm::vec2 taa_jitter(int frame);
+
+// Ambient occlusion utils
+void ssao_kernel(glm::vec3 * kernel, int count);
+
+// Culling utils
+struct Frustum
+{
+    glm::vec4 planes[6]; // Facing inside, normalized
+};
+void frustum_from_matrix(Frustum & f, const glm::mat4 & viewProjection);
+bool frustum_test_sphere(const Frustum & f, const glm::vec3 & center, float radius);
+
+// GPU profiling utils
+struct GpuTimer
+{
+    static const int QUERY_COUNT = 4; // Frames in flight before a result is read back
+    GLuint queries[QUERY_COUNT];
+    bool pending[QUERY_COUNT];
+    int current;
+    double milliseconds;
+    const char * name;
+};
+void gpu_timer_init(GpuTimer & timer, const char * name);
+void gpu_timer_begin(GpuTimer & timer);
+void gpu_timer_end(GpuTimer & timer);
+
+// Frame pacing utils
+struct FramePacer
+{
+    static const int MAX_FRAMES = 3;
+    GLsync fences[MAX_FRAMES]; // Placed after each swap
+    GLuint queries[MAX_FRAMES]; // GPU timestamps taken just before the fences
+    double inputTimes[MAX_FRAMES]; // When the input each frame was built from was sampled
+    int submitted; // Frames fenced since init
+    int retired; // Frames the GPU is known to be done with
+    int framesInFlight; // Frames the CPU may queue ahead of the GPU, 1 to MAX_FRAMES
+    bool lateInput; // Poll input after the wait, right before building the frame
+    double inputTime; // Last input sampling, glfwGetTime
+    double clockOffset; // glfwGetTime minus GL_TIMESTAMP, in seconds
+    double waitMilliseconds; // Blocked on fences this frame
+    double latencyMilliseconds; // Input sampling to the end of the frame on the GPU, of the last retired frame
+};
+void frame_pacer_init(FramePacer & fp, int framesInFlight, bool lateInput);
+void frame_pacer_shutdown(FramePacer & fp);
+// Blocks until fewer than framesInFlight frames are queued
+void frame_pacer_wait(FramePacer & fp);
+// Call right after polling events
+void frame_pacer_input(FramePacer & fp);
+// Call right after the swap
+void frame_pacer_end(FramePacer & fp);
+
+// Texture loading utils
+enum TextureState
+{
+    TEXTURE_QUEUED,
+    TEXTURE_UPLOADING,
+    TEXTURE_READY,
+    TEXTURE_FAILED
+};
+
+struct Texture
+{
+    std::string path;
+    int requestedComponents;
+    bool srgb; // Color channels are sRGB encoded, from the .aotex header when there is one
+    TextureState state;
+    GLuint id;
+    int width;
+    int height;
+    int components;
+    int levelCount;
+    int tailLevel; // Levels from here to the smallest are uploaded before the texture is shown
+    int format; // TexFileFormat of a precompressed .aotex file, -1 for images decoded with stb_image
+    unsigned char * data; // Decoded mip chain, freed once level 0 is uploaded
+    MappedFile file; // .aotex mapping, levels are uploaded straight from it
+    size_t levelOffsets[TEXFILE_MAX_LEVELS];
+    int residentLevel; // Most detailed level uploaded, levelCount when none
+    int allocatedLevel; // Most detailed level with storage, residentLevel - 1 while one is uploading
+    int requestedLevel; // Most detailed level wanted, the mip tail is always uploaded
+    int pendingLevel; // Smallest level requested since the last update
+    int lastUsedFrame;
+    bool uploadQueued;
+    bool deferred; // Waiting for room in the budget
+    int uploadedRows; // Of level residentLevel - 1
+    double mipmapMilliseconds;
+    bool packed; // Uploaded into a shared array once its pack group is decoded
+    int array; // TextureManager array, -1 while not packed
+    int layer;
+    int x; // Texels of level 0 in the layer, the padding of an atlas entry excluded
+    int y;
+};
+
+// Packed textures : the textures of a pack group are uploaded into shared
+// GL_TEXTURE_2D_ARRAYs once the whole group is decoded. Textures of the same
+// size and format get a layer each, small power of two ones are packed into
+// atlas layers with a padding filled by their wrapped edges. Layers share
+// their levels, so arrays are allocated and uploaded whole and never evicted.
+const int TEXTURE_ATLAS_SIZE = 512;
+const int TEXTURE_ATLAS_PADDING = 8; // Texels around an entry, halved at each level
+const int TEXTURE_ATLAS_LEVELS = 4; // Levels keeping at least a texel of padding
+const int TEXTURE_ATLAS_MAX_ENTRY = 128;
+
+struct TextureArray
+{
+    GLuint id;
+    int width;
+    int height;
+    int components;
+    int format; // Same as the textures
+    bool srgb;
+    int layerCount;
+    int levelCount;
+    bool atlas;
+    std::vector<int> textures;
+    int residentLevel; // Most detailed level complete in every layer, levelCount when none
+};
+
+struct TextureManager
+{
+    static const int MAX_WORKERS = 8;
+    static const int UPLOAD_BUFFER_COUNT = 3;
+    std::vector<Texture> textures;
+    std::deque<int> decodeQueue;
+    std::deque<int> uploadQueue;
+    mtx_t mutex;
+    cnd_t condition;
+    bool quit;
+    thrd_t workers[MAX_WORKERS];
+    int workerCount;
+    GLuint placeholder;
+    GLuint placeholderArray; // Same checker, sampled in place of packed textures
+    std::vector<TextureArray> arrays;
+    std::vector<std::vector<int> > packGroups; // Waiting for their textures to decode
+    GLuint uploadBuffers[UPLOAD_BUFFER_COUNT];
+    GLsync uploadFences[UPLOAD_BUFFER_COUNT];
+    int uploadBufferSize;
+    int currentUploadBuffer;
+    int uploadedBytes; // During the last update
+    int readyCount;
+    float anisotropy;
+    float maxAnisotropy; // 1 when anisotropic filtering is not supported
+    bool compressedFormats[TEXFILE_FORMAT_COUNT]; // .aotex formats the driver can sample
+    int frame;
+    int budgetBytes; // Texture memory the streamed levels may use
+    int residentBytes; // Allocated levels, mip tails included
+    int wantedBytes; // Needed by the requests of the last frame
+    int evictedBytes; // During the last update
+    int deferredLevels; // Levels not streamed during the last update for lack of budget
+    bool trace; // Print streaming events to stderr
+};
+void texture_manager_init(TextureManager & tm, int workerCount, int uploadBufferSize);
+void texture_manager_shutdown(TextureManager & tm);
+int texture_manager_load(TextureManager & tm, const char * path, int components, bool srgb);
+void texture_manager_set_anisotropy(TextureManager & tm, float anisotropy);
+void texture_manager_update(TextureManager & tm, int byteBudget);
+GLuint texture_manager_texture(const TextureManager & tm, int handle);
+// Packs textures loaded this frame, texture_manager_texture then returns
+// their array and the placement tells where they are in it
+void texture_manager_pack(TextureManager & tm, int count, const int * handles);
+GLenum texture_manager_target(const TextureManager & tm, int handle);
+void texture_manager_placement(const TextureManager & tm, int handle, glm::vec4 & rect, int & layer);
+// Most detailed level a texture should have, packed textures are whole
+int texture_target_level(const Texture & texture);
+// Requests are gathered every frame and applied by the next update, levels of
+// textures not requested anymore become candidates for eviction
+void texture_manager_request_level(TextureManager & tm, int handle, int level);
+void texture_manager_request_footprint(TextureManager & tm, int handle, float uvPerPixel);
+bool open_texfile(MappedFile & file, const char * path, TexFileHeader & header, TexFileLevel * levels);
+
+// Materials : the parameters of all materials live in one uniform buffer, a
+// slice each, written only when they change and bound with
+// glBindBufferRange. A material also owns a texture set bound to units 0 and
+// up, in one call with GL_ARB_multi_bind. Draws sorted by material switch
+// each of them once, and units already holding the right texture are left.
+// Where the textures sit in their arrays is part of the parameters.
+const int MATERIAL_MAX_TEXTURES = 4;
+const GLuint MATERIAL_BLOCK_BINDING = 0;
+
+// std140 layout of the Material block of aogl.frag
+struct MaterialParameters
+{
+    glm::vec4 tint;
+    float specularPower;
+    float specularMix;
+    float padding[2];
+    glm::vec4 textureRects[MATERIAL_MAX_TEXTURES]; // Scale and offset of each texture in its layer
+    glm::vec4 textureLayers;
+};
+
+struct Material
+{
+    std::string name;
+    MaterialParameters parameters;
+    int textureCount;
+    int textures[MATERIAL_MAX_TEXTURES]; // TextureManager handles
+};
+
+struct MaterialManager
+{
+    std::vector<Material> materials;
+    GLuint buffer;
+    int sliceSize; // Parameters rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+    int capacity; // Materials the buffer holds
+    bool dirty; // Parameters to write before drawing
+    bool multiBind;
+    GLuint boundTextures[MATERIAL_MAX_TEXTURES]; // Per unit during the scene pass
+    int boundMaterial;
+    int materialBinds; // During the last frame
+    int textureBinds;
+};
+void material_manager_init(MaterialManager & mm);
+void material_manager_shutdown(MaterialManager & mm);
+int material_manager_add(MaterialManager & mm, const char * name, const MaterialParameters & parameters, int textureCount, const int * textures);
+void material_manager_set(MaterialManager & mm, int material, const MaterialParameters & parameters);
+// Writes the parameters that changed, before the first bind of a frame.
+// Texture units are shared with the other passes, their state is forgotten.
+void material_manager_update(MaterialManager & mm, const TextureManager & tm);
+void material_manager_bind(MaterialManager & mm, const TextureManager & tm, int material);
+// Bit i is set when texture i of the material is sampled from an array
+unsigned int material_manager_array_mask(const MaterialManager & mm, const TextureManager & tm, int material);
+
+// Scene draws, sorted by program then material before being submitted
+struct DrawItem
+{
+    GLuint64 key;
+    int object;
+};
+inline bool draw_item_less(const DrawItem & a, const DrawItem & b)
+{
+    return a.key < b.key;
+}
 
 struct Camera
 {
@@ -156,21 +587,76 @@ int main( int argc, char **argv )
     init_gui_states(guiStates);
     float dummySlider = 0.f;
 
-    // Try to load and compile shaders
-    GLuint vertShaderId = compile_shader_from_file(GL_VERTEX_SHADER, "aogl.vert");
-    GLuint geomShaderId = compile_shader_from_file(GL_GEOMETRY_SHADER, "aogl.geom");
-    GLuint fragShaderId = compile_shader_from_file(GL_FRAGMENT_SHADER, "aogl.frag");
-    GLuint programObject = glCreateProgram();
-    glAttachShader(programObject, vertShaderId);
-    glAttachShader(programObject, geomShaderId);
-    glAttachShader(programObject, fragShaderId);
-    glLinkProgram(programObject);
-    if (check_link_error(programObject) < 0)
+    // Try to load and compile shaders, programs linked by a previous run are
+    // restored from the binary cache while their sources and the driver match
+    ProgramManager programManager;
+    program_manager_init(programManager, "shadercache");
+
+    // Uniforms set by the frame, interned before any program is reflected so
+    // that their slots are these values
+    enum
+    {
+        UNIFORM_MVP, UNIFORM_PREV_MVP, UNIFORM_JITTER, UNIFORM_TIME, UNIFORM_PREV_TIME, UNIFORM_CAMERA_POSITION,
+        UNIFORM_DIFFUSE, UNIFORM_SPECULAIRE, UNIFORM_COLOR, UNIFORM_HISTORY, UNIFORM_VELOCITY, UNIFORM_DEPTH,
+        UNIFORM_LINEAR_DEPTH, UNIFORM_OCCLUSION, UNIFORM_FEEDBACK, UNIFORM_RESET, UNIFORM_SCALE, UNIFORM_NEAR_FAR,
+        UNIFORM_FAR, UNIFORM_PROJECTION, UNIFORM_SAMPLE_COUNT, UNIFORM_RADIUS, UNIFORM_KERNEL, UNIFORM_DIRECTION,
+        UNIFORM_COUNT
+    };
+    const char * uniformNames[UNIFORM_COUNT] =
+    {
+        "MVP", "PrevMVP", "Jitter", "Time", "PrevTime", "CameraPosition",
+        "Diffuse", "Speculaire", "Color", "History", "Velocity", "Depth",
+        "LinearDepth", "Occlusion", "Feedback", "Reset", "Scale", "NearFar",
+        "Far", "Projection", "SampleCount", "Radius", "Kernel", "Direction"
+    };
+    for (int i = 0; i < UNIFORM_COUNT; ++i)
+        uniform_names_intern(programManager.uniformNames, uniformNames[i]);
+    uniform_names_bind_block(programManager.uniformNames, "Material", MATERIAL_BLOCK_BINDING);
+    const GLenum sceneStages[] = { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER };
+    const char * sceneShaders[] = { "aogl.vert", "aogl.geom", "aogl.frag" };
+    int sceneVariants = program_manager_add_variants(programManager, 3, sceneStages, sceneShaders);
+    int sceneProgram = programManager.variants[sceneVariants].defaultProgram;
+
+    // Scene keywords : the cubes spin, the shading model is picked in the UI
+    unsigned int animatedKeyword = program_manager_keyword(programManager, sceneVariants, "ANIMATED");
+    const int SHADING_MODEL_COUNT = 7;
+    const char * shadingModelNames[SHADING_MODEL_COUNT] = { "Specular", "Lambert", "Procedural", "Normal", "Position", "TexCoord", "Red" };
+    const char * shadingModelKeywords[SHADING_MODEL_COUNT] = { "SHADING_SPECULAR", "SHADING_LAMBERT", "SHADING_PROCEDURAL", "SHADING_NORMAL", "SHADING_POSITION", "SHADING_TEXCOORD", "SHADING_RED" };
+    unsigned int shadingKeywords[SHADING_MODEL_COUNT];
+    for (int i = 0; i < SHADING_MODEL_COUNT; ++i)
+        shadingKeywords[i] = program_manager_keyword(programManager, sceneVariants, shadingModelKeywords[i]);
+    float shadingModel = 0.f;
+
+    // Material textures sampled from arrays, per texture unit
+    unsigned int textureArrayKeywords[MATERIAL_MAX_TEXTURES] = {
+        program_manager_keyword(programManager, sceneVariants, "DIFFUSE_ARRAY"),
+        program_manager_keyword(programManager, sceneVariants, "SPECULAIRE_ARRAY"), 0, 0 };
+
+    // Fullscreen pass shaders
+    const GLenum blitStages[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+    const char * taaShaders[] = { "blit.vert", "taa.frag" };
+    const char * ssaoDownsampleShaders[] = { "blit.vert", "ssao_downsample.frag" };
+    const char * ssaoShaders[] = { "blit.vert", "ssao.frag" };
+    const char * ssaoBlurShaders[] = { "blit.vert", "ssao_blur.frag" };
+    const char * ssaoCompositeShaders[] = { "blit.vert", "ssao_composite.frag" };
+    int taaProgram = program_manager_add(programManager, 2, blitStages, taaShaders, 0, -1);
+    int ssaoDownsampleProgram = program_manager_add(programManager, 2, blitStages, ssaoDownsampleShaders, 0, -1);
+    int ssaoProgram = program_manager_add(programManager, 2, blitStages, ssaoShaders, 0, -1);
+    int ssaoBlurProgram = program_manager_add(programManager, 2, blitStages, ssaoBlurShaders, 0, -1);
+    int ssaoCompositeProgram = program_manager_add(programManager, 2, blitStages, ssaoCompositeShaders, 0, -1);
+
+    // All of them compile concurrently, the frame needs them before it starts
+    for (size_t i = 0; i < programManager.programs.size(); ++i)
+        program_manager_wait(programManager, (int) i);
+    GLuint programObject = program_manager_program(programManager, sceneProgram);
+    GLuint taaProgramObject = program_manager_program(programManager, taaProgram);
+    GLuint ssaoDownsampleProgramObject = program_manager_program(programManager, ssaoDownsampleProgram);
+    GLuint ssaoProgramObject = program_manager_program(programManager, ssaoProgram);
+    GLuint ssaoBlurProgramObject = program_manager_program(programManager, ssaoBlurProgram);
+    GLuint ssaoCompositeProgramObject = program_manager_program(programManager, ssaoCompositeProgram);
+    if (!programObject || !taaProgramObject || !ssaoDownsampleProgramObject || !ssaoProgramObject || !ssaoBlurProgramObject || !ssaoCompositeProgramObject)
         exit(1);
     
-    // Upload uniforms
-    GLuint mvpLocation = glGetUniformLocation(programObject, "MVP");
-
     if (!checkError("Uniforms"))
         exit(1);
 
@@ -249,50 +735,240 @@ int main( int argc, char **argv )
     glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*2, (void*)0);
     glBufferData(GL_ARRAY_BUFFER, sizeof(plane_uvs), plane_uvs, GL_STATIC_DRAW);
 
-    // Textures
-    int x;
-    int y;
-    int comp;
-
-    GLuint textures[2];
-    glGenTextures(2, textures);
-
-    // Texture 1
-    unsigned char * diffuse = stbi_load("textures/spnza_bricks_a_diff.tga", &x, &y, &comp, 3);
-
-    glBindTexture(GL_TEXTURE_2D, textures[0]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, x, y, 0, GL_RGB, GL_UNSIGNED_BYTE, diffuse);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    // Texture 2
-    unsigned char* speculaire = stbi_load("textures/spnza_bricks_a_spec.tga", &x, &y, &comp, 3);
+    // Textures are decoded or mapped by worker threads and uploaded a few rows
+    // per frame, a placeholder is bound until their mip tail is resident
+    TextureManager textureManager;
+    texture_manager_init(textureManager, 4, 4 * 1024 * 1024);
+    float textureUploadBudget = 2.f; // MB per frame
+
+    int textures[2];
+    textures[0] = texture_manager_load(textureManager, "textures/spnza_bricks_a_diff.tga", 3, true);
+    textures[1] = texture_manager_load(textureManager, "textures/spnza_bricks_a_spec.tga", 3, false);
+    // Same size and format, both materials bind the one array they end up in
+    texture_manager_pack(textureManager, 2, textures);
+    float textureAnisotropy = textureManager.anisotropy;
+    float textureBudget = 32.f; // MB
+
+    // Materials, the same bricks glossy on the cubes and dull on the floor
+    MaterialManager materialManager;
+    material_manager_init(materialManager);
+    MaterialParameters glossyBricks = { glm::vec4(1.f), 10.f, 0.5f, { 0.f, 0.f }, {}, glm::vec4(0.f) };
+    MaterialParameters dullBricks = { glm::vec4(0.9f, 0.85f, 0.8f, 1.f), 4.f, 0.2f, { 0.f, 0.f }, {}, glm::vec4(0.f) };
+    int cubeMaterial = material_manager_add(materialManager, "Glossy bricks", glossyBricks, 2, textures);
+    int planeMaterial = material_manager_add(materialManager, "Dull bricks", dullBricks, 2, textures);
+
+    // Bounding spheres used for culling and texture streaming, with the span
+    // of texture coordinates over a world unit on each object. The cubes
+    // sphere covers the row of instances, not their wildest stretches.
+    const int OBJECT_COUNT = 2;
+    glm::vec3 objectCenters[OBJECT_COUNT] = { glm::vec3(-0.5f, 0.f, 0.f), glm::vec3(0.f, -2.f, 0.f) };
+    float objectRadii[OBJECT_COUNT] = { 8.f, 28.3f };
+    float objectUvPerUnit[OBJECT_COUNT] = { 1.f, 1.f / 40.f };
+    bool objectVisible[OBJECT_COUNT];
+    unsigned int objectKeywords[OBJECT_COUNT] = { animatedKeyword, 0 };
+    int objectMaterials[OBJECT_COUNT] = { cubeMaterial, planeMaterial };
+    GLuint objectVaos[OBJECT_COUNT] = { vao[0], vao[1] };
+    int objectIndexCounts[OBJECT_COUNT] = { cube_triangleCount * 3, plane_triangleCount * 3 };
+    int objectInstanceCounts[OBJECT_COUNT] = { 10, 1 };
+    std::vector<DrawItem> drawItems;
+
+    // Textures are packed or not from the time they are loaded, the keywords
+    // of the materials are known before drawing. The variants of the objects
+    // are waited on like the other programs: until they link, draws would
+    // fall back to a variant without the animation nor the array samplers.
+    int objectVariants[OBJECT_COUNT];
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+    {
+        unsigned int arrays = material_manager_array_mask(materialManager, textureManager, objectMaterials[i]);
+        for (int j = 0; j < MATERIAL_MAX_TEXTURES; ++j)
+            if (arrays & (1u << j))
+                objectKeywords[i] |= textureArrayKeywords[j];
+        objectVariants[i] = program_manager_variant(programManager, sceneVariants, objectKeywords[i]);
+    }
+    for (int i = 0; i < OBJECT_COUNT; ++i)
+        program_manager_wait(programManager, objectVariants[i]);
+
+    const float nearPlane = 0.1f;
+    const float farPlane = 100.f;
+    const int SSAO_MAX_SAMPLES = 64;
+    glm::vec3 ssaoKernel[SSAO_MAX_SAMPLES];
+    ssao_kernel(ssaoKernel, SSAO_MAX_SAMPLES);
+
+    // Uniform locations of the fullscreen passes, set up on the first frame
+    // and again whenever edited shaders are swapped in
+    int programReloads = -1;
+    GLuint taaFeedbackLocation = 0;
+    GLuint taaResetLocation = 0;
+    GLuint ssaoDownsampleScaleLocation = 0;
+    GLuint ssaoProjectionLocation = 0;
+    GLuint ssaoSampleCountLocation = 0;
+    GLuint ssaoRadiusLocation = 0;
+    GLuint ssaoBlurDirectionLocation = 0;
+
+    // Scene framebuffer : color, screen space velocity and depth
+    GLuint sceneTextures[3];
+    sceneTextures[0] = create_render_texture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST, width, height);
+    sceneTextures[1] = create_render_texture(GL_RG16F, GL_RG, GL_FLOAT, GL_NEAREST, width, height);
+    sceneTextures[2] = create_render_texture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT, GL_NEAREST, width, height);
+
+    GLuint sceneFbo;
+    glGenFramebuffers(1, &sceneFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFbo);
+    GLenum sceneDrawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, sceneDrawBuffers);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneTextures[0], 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, sceneTextures[1], 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, sceneTextures[2], 0);
+    if (!checkFramebuffer("Scene framebuffer"))
+        exit(1);
 
-    glBindTexture(GL_TEXTURE_2D, textures[1]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, x, y, 0, GL_RGB, GL_UNSIGNED_BYTE, speculaire);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // History framebuffers, ping-ponged every frame
+    GLuint historyTextures[2];
+    GLuint historyFbos[2];
+    glGenFramebuffers(2, historyFbos);
+    for (int i = 0; i < 2; ++i)
+    {
+        historyTextures[i] = create_render_texture(GL_RGBA16F, GL_RGBA, GL_FLOAT, GL_LINEAR, width, height);
+        glBindFramebuffer(GL_FRAMEBUFFER, historyFbos[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, historyTextures[i], 0);
+        if (!checkFramebuffer("History framebuffer"))
+            exit(1);
+    }
 
-    // Initialize uniform location
-    GLuint timeLocation = glGetUniformLocation(programObject, "Time");
-    GLuint objectLocation = glGetUniformLocation(programObject, "Object");
-    GLuint diffuseLocation = glGetUniformLocation(programObject, "Diffuse");
-    GLuint speculaireLocation = glGetUniformLocation(programObject, "Speculaire");
-    GLuint cameraPositionLocation = glGetUniformLocation(programObject, "CameraPosition");
+    // Ambient occlusion buffers, at half and quarter resolution : linear depth, occlusion and blur target
+    const int SSAO_RESOLUTION_COUNT = 2;
+    GLuint ssaoTextures[SSAO_RESOLUTION_COUNT][3];
+    GLuint ssaoFbos[SSAO_RESOLUTION_COUNT][3];
+    for (int i = 0; i < SSAO_RESOLUTION_COUNT; ++i)
+    {
+        int scale = 2 << i;
+        ssaoTextures[i][0] = create_render_texture(GL_R32F, GL_RED, GL_FLOAT, GL_NEAREST, width / scale, height / scale);
+        ssaoTextures[i][1] = create_render_texture(GL_R8, GL_RED, GL_UNSIGNED_BYTE, GL_NEAREST, width / scale, height / scale);
+        ssaoTextures[i][2] = create_render_texture(GL_R8, GL_RED, GL_UNSIGNED_BYTE, GL_NEAREST, width / scale, height / scale);
+        glGenFramebuffers(3, ssaoFbos[i]);
+        for (int j = 0; j < 3; ++j)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, ssaoFbos[i][j]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ssaoTextures[i][j], 0);
+            if (!checkFramebuffer("Ambient occlusion framebuffer"))
+                exit(1);
+        }
+    }
 
-    glProgramUniform1i(programObject, diffuseLocation, 0);
-    glProgramUniform1i(programObject, speculaireLocation, 1);
+    // Scene color with ambient occlusion applied
+    GLuint compositeTexture = create_render_texture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST, width, height);
+    GLuint compositeFbo;
+    glGenFramebuffers(1, &compositeFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, compositeFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, compositeTexture, 0);
+    if (!checkFramebuffer("Composite framebuffer"))
+        exit(1);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Fullscreen passes generate their vertices, but core profile needs a bound VAO
+    GLuint blitVao;
+    glGenVertexArrays(1, &blitVao);
+
+    // Temporal anti-aliasing states
+    bool taaEnabled = true;
+    bool taaReset = true;
+    float taaFeedback = 0.9f;
+    int frame = 0;
+    glm::mat4 prevMvp;
+    double prevTime = 0.0;
+
+    // Ambient occlusion states
+    bool ssaoEnabled = true;
+    bool ssaoQuarterResolution = false;
+    float ssaoSampleCount = 16.f;
+    float ssaoRadius = 0.5f;
+
+    // GPU timers, one per pass
+    enum { TIMER_SCENE, TIMER_SSAO_DOWNSAMPLE, TIMER_SSAO, TIMER_SSAO_BLUR, TIMER_SSAO_COMPOSITE, TIMER_TAA, TIMER_UI, TIMER_COUNT };
+    const char * timerNames[TIMER_COUNT] = { "Scene", "SSAO downsample", "SSAO", "SSAO blur", "SSAO composite", "TAA", "UI" };
+    GpuTimer gpuTimers[TIMER_COUNT];
+    for (int i = 0; i < TIMER_COUNT; ++i)
+        gpu_timer_init(gpuTimers[i], timerNames[i]);
+    int profilerScroll = 0;
+
+    // Frame pacing states, one frame in flight favours latency, three throughput
+    FramePacer framePacer;
+    frame_pacer_init(framePacer, 2, true);
+    float framesInFlight = framePacer.framesInFlight;
+    frame_pacer_input(framePacer);
 
     do
     {
         t = glfwGetTime();
 
-        // Upload value
-        glProgramUniform1f(programObject, timeLocation, t);
+        // Do not run ahead of the GPU by more than the frames allowed in flight
+        frame_pacer_wait(framePacer);
+
+        // Upload textures decoded since last frame
+        texture_manager_update(textureManager, (int) (textureUploadBudget * 1024 * 1024));
+
+        // Pick up programs linked since last frame
+        program_manager_update(programManager);
+        if (programReloads != programManager.reloadCount)
+        {
+            // Objects and uniform locations of the programs swapped in
+            programReloads = programManager.reloadCount;
+            taaProgramObject = program_manager_program(programManager, taaProgram);
+            ssaoDownsampleProgramObject = program_manager_program(programManager, ssaoDownsampleProgram);
+            ssaoProgramObject = program_manager_program(programManager, ssaoProgram);
+            ssaoBlurProgramObject = program_manager_program(programManager, ssaoBlurProgram);
+            ssaoCompositeProgramObject = program_manager_program(programManager, ssaoCompositeProgram);
+
+            const ProgramReflection * taaReflection = program_manager_reflection(programManager, taaProgram);
+            assert(taaReflection); // Ready since startup, failed rebuilds keep the previous program
+            const ProgramReflection & taa = *taaReflection;
+            taaFeedbackLocation = program_location(taa, UNIFORM_FEEDBACK);
+            taaResetLocation = program_location(taa, UNIFORM_RESET);
+            glProgramUniform1i(taaProgramObject, program_location(taa, UNIFORM_COLOR), 0);
+            glProgramUniform1i(taaProgramObject, program_location(taa, UNIFORM_HISTORY), 1);
+            glProgramUniform1i(taaProgramObject, program_location(taa, UNIFORM_VELOCITY), 2);
+            glProgramUniform1i(taaProgramObject, program_location(taa, UNIFORM_DEPTH), 3);
+
+            const ProgramReflection * ssaoDownsampleReflection = program_manager_reflection(programManager, ssaoDownsampleProgram);
+            assert(ssaoDownsampleReflection); // Ready since startup, failed rebuilds keep the previous program
+            const ProgramReflection & ssaoDownsample = *ssaoDownsampleReflection;
+            ssaoDownsampleScaleLocation = program_location(ssaoDownsample, UNIFORM_SCALE);
+            glProgramUniform1i(ssaoDownsampleProgramObject, program_location(ssaoDownsample, UNIFORM_DEPTH), 0);
+            glProgramUniform2f(ssaoDownsampleProgramObject, program_location(ssaoDownsample, UNIFORM_NEAR_FAR), nearPlane, farPlane);
+
+            const ProgramReflection * ssaoReflection = program_manager_reflection(programManager, ssaoProgram);
+            assert(ssaoReflection); // Ready since startup, failed rebuilds keep the previous program
+            const ProgramReflection & ssao = *ssaoReflection;
+            ssaoProjectionLocation = program_location(ssao, UNIFORM_PROJECTION);
+            ssaoSampleCountLocation = program_location(ssao, UNIFORM_SAMPLE_COUNT);
+            ssaoRadiusLocation = program_location(ssao, UNIFORM_RADIUS);
+            glProgramUniform1i(ssaoProgramObject, program_location(ssao, UNIFORM_LINEAR_DEPTH), 0);
+            glProgramUniform1f(ssaoProgramObject, program_location(ssao, UNIFORM_FAR), farPlane);
+            glProgramUniform3fv(ssaoProgramObject, program_location(ssao, UNIFORM_KERNEL), SSAO_MAX_SAMPLES, glm::value_ptr(ssaoKernel[0]));
+
+            const ProgramReflection * ssaoBlurReflection = program_manager_reflection(programManager, ssaoBlurProgram);
+            assert(ssaoBlurReflection); // Ready since startup, failed rebuilds keep the previous program
+            const ProgramReflection & ssaoBlur = *ssaoBlurReflection;
+            ssaoBlurDirectionLocation = program_location(ssaoBlur, UNIFORM_DIRECTION);
+            glProgramUniform1i(ssaoBlurProgramObject, program_location(ssaoBlur, UNIFORM_OCCLUSION), 0);
+            glProgramUniform1i(ssaoBlurProgramObject, program_location(ssaoBlur, UNIFORM_LINEAR_DEPTH), 1);
+
+            const ProgramReflection * ssaoCompositeReflection = program_manager_reflection(programManager, ssaoCompositeProgram);
+            assert(ssaoCompositeReflection); // Ready since startup, failed rebuilds keep the previous program
+            const ProgramReflection & ssaoComposite = *ssaoCompositeReflection;
+            glProgramUniform1i(ssaoCompositeProgramObject, program_location(ssaoComposite, UNIFORM_COLOR), 0);
+            glProgramUniform1i(ssaoCompositeProgramObject, program_location(ssaoComposite, UNIFORM_DEPTH), 1);
+            glProgramUniform1i(ssaoCompositeProgramObject, program_location(ssaoComposite, UNIFORM_OCCLUSION), 2);
+            glProgramUniform1i(ssaoCompositeProgramObject, program_location(ssaoComposite, UNIFORM_LINEAR_DEPTH), 3);
+            glProgramUniform2f(ssaoCompositeProgramObject, program_location(ssaoComposite, UNIFORM_NEAR_FAR), nearPlane, farPlane);
+        }
+
+        // Sample input as late as possible, once the wait is over
+        if (framePacer.lateInput)
+        {
+            glfwPollEvents();
+            frame_pacer_input(framePacer);
+        }
 
         // Mouse states
         int leftButton = glfwGetMouseButton( window, GLFW_MOUSE_BUTTON_LEFT );
@@ -356,43 +1032,193 @@ int main( int argc, char **argv )
         // Default states
         glEnable(GL_DEPTH_TEST);
 
-        // Clear the front buffer
+        // Render the scene offscreen
+        gpu_timer_begin(gpuTimers[TIMER_SCENE]);
+        glBindFramebuffer(GL_FRAMEBUFFER, sceneFbo);
+        glViewport(0, 0, width, height);
+
+        // Clear the scene buffers
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         // Get camera matrices
-        glm::mat4 projection = glm::perspective(45.0f, widthf / heightf, 0.1f, 100.f); 
+        glm::mat4 projection = glm::perspective(45.0f, widthf / heightf, nearPlane, farPlane); 
         glm::mat4 worldToView = glm::lookAt(camera.eye, camera.o, camera.up);
         glm::mat4 objectToWorld;
         glm::mat4 mvp = projection * worldToView * objectToWorld;
+        if (frame == 0)
+        {
+            prevMvp = mvp;
+            prevTime = t;
+        }
+
+        // Sub-pixel jitter expressed in clip space, the matrices stay unjittered for motion vectors
+        glm::vec2 jitter(0.f);
+        if (taaEnabled)
+            jitter = taa_jitter(frame) * glm::vec2(2.f / widthf, 2.f / heightf);
+
+        // Cull objects against the view frustum and request the texture levels
+        // matching their size on screen, taken at the closest point of their
+        // bounding sphere
+        Frustum frustum;
+        frustum_from_matrix(frustum, projection * worldToView);
+        float pixelsPerUnit = 0.5f * heightf * projection[1][1]; // At a distance of 1
+        textureManager.budgetBytes = (int) (textureBudget * 1024 * 1024);
+        int visibleCount = 0;
+        drawItems.clear();
+        for (int i = 0; i < OBJECT_COUNT; ++i)
+        {
+            objectVisible[i] = frustum_test_sphere(frustum, objectCenters[i], objectRadii[i]);
+            if (!objectVisible[i])
+                continue;
+            ++visibleCount;
+            float distance = glm::length(camera.eye - objectCenters[i]) - objectRadii[i];
+            float uvPerPixel = objectUvPerUnit[i] * (distance > nearPlane ? distance : nearPlane) / pixelsPerUnit;
+            const Material & material = materialManager.materials[objectMaterials[i]];
+            for (int j = 0; j < material.textureCount; ++j)
+                texture_manager_request_footprint(textureManager, material.textures[j], uvPerPixel);
+
+            // Select the variant of the object keywords and upload its uniforms
+            int variant = program_manager_variant(programManager, sceneVariants, objectKeywords[i] | shadingKeywords[(int) shadingModel]);
+            const ProgramReflection * variantReflection = program_manager_reflection(programManager, variant);
+            if (!variantReflection)
+                continue; // No variant of the chain linked
+            const ProgramReflection & reflection = *variantReflection;
+            GLuint program = reflection.program;
+            glProgramUniformMatrix4fv(program, program_location(reflection, UNIFORM_MVP), 1, 0, glm::value_ptr(mvp));
+            glProgramUniformMatrix4fv(program, program_location(reflection, UNIFORM_PREV_MVP), 1, 0, glm::value_ptr(prevMvp));
+            glProgramUniform2f(program, program_location(reflection, UNIFORM_JITTER), jitter.x, jitter.y);
+            glProgramUniform1f(program, program_location(reflection, UNIFORM_TIME), t);
+            glProgramUniform1f(program, program_location(reflection, UNIFORM_PREV_TIME), prevTime);
+            glProgramUniform3f(program, program_location(reflection, UNIFORM_CAMERA_POSITION), camera.eye.x, camera.eye.y, camera.eye.z);
+            glProgramUniform1i(program, program_location(reflection, UNIFORM_DIFFUSE), 0);
+            glProgramUniform1i(program, program_location(reflection, UNIFORM_SPECULAIRE), 1);
+
+            DrawItem item;
+            item.key = ((GLuint64) program << 32) | (GLuint64) objectMaterials[i];
+            item.object = i;
+            drawItems.push_back(item);
+        }
+        std::sort(drawItems.begin(), drawItems.end(), draw_item_less);
 
-        // Send camera position
-        glProgramUniform3f(programObject, cameraPositionLocation, camera.eye.x, camera.eye.y, camera.eye.z);
+        // Render the sorted draws, programs and materials only change between groups
+        material_manager_update(materialManager, textureManager);
+        GLuint currentProgram = 0;
+        for (size_t i = 0; i < drawItems.size(); ++i)
+        {
+            GLuint program = (GLuint) (drawItems[i].key >> 32);
+            int object = drawItems[i].object;
+            if (program != currentProgram)
+            {
+                glUseProgram(program);
+                currentProgram = program;
+            }
+            material_manager_bind(materialManager, textureManager, objectMaterials[object]);
+            glBindVertexArray(objectVaos[object]);
+            glDrawElementsInstanced(GL_TRIANGLES, objectIndexCounts[object], GL_UNSIGNED_INT, (void*)0, objectInstanceCounts[object]);
+        }
 
-        // Select shader
-        glUseProgram(programObject);
+        gpu_timer_end(gpuTimers[TIMER_SCENE]);
 
-        // Upload uniforms
-        glProgramUniformMatrix4fv(programObject, mvpLocation, 1, 0, glm::value_ptr(mvp));
+        glDisable(GL_DEPTH_TEST);
+        glBindVertexArray(blitVao);
 
-        // Bind texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, textures[0]);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, textures[1]);
-
-        // Render vaos
-            // Upload value
-            glProgramUniform1i(programObject, objectLocation, 0);
-        glBindVertexArray(vao[0]);
-        glDrawElementsInstanced(GL_TRIANGLES, cube_triangleCount * 3, GL_UNSIGNED_INT, (void*)0, 10);
-            // Upload value
-            glProgramUniform1i(programObject, objectLocation, 1);
-        glBindVertexArray(vao[1]);
-        glDrawElements(GL_TRIANGLES, plane_triangleCount * 3, GL_UNSIGNED_INT, (void*)0);
+        // Ambient occlusion at reduced resolution, then upsampled onto the scene color
+        GLuint litTexture = sceneTextures[0];
+        GLuint litFbo = sceneFbo;
+        if (ssaoEnabled)
+        {
+            int ssaoResolution = ssaoQuarterResolution ? 1 : 0;
+            int ssaoScale = 2 << ssaoResolution;
+            glViewport(0, 0, width / ssaoScale, height / ssaoScale);
+
+            gpu_timer_begin(gpuTimers[TIMER_SSAO_DOWNSAMPLE]);
+            glBindFramebuffer(GL_FRAMEBUFFER, ssaoFbos[ssaoResolution][0]);
+            glUseProgram(ssaoDownsampleProgramObject);
+            glProgramUniform1i(ssaoDownsampleProgramObject, ssaoDownsampleScaleLocation, ssaoScale);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, sceneTextures[2]);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            gpu_timer_end(gpuTimers[TIMER_SSAO_DOWNSAMPLE]);
+
+            gpu_timer_begin(gpuTimers[TIMER_SSAO]);
+            glBindFramebuffer(GL_FRAMEBUFFER, ssaoFbos[ssaoResolution][1]);
+            glUseProgram(ssaoProgramObject);
+            glProgramUniformMatrix4fv(ssaoProgramObject, ssaoProjectionLocation, 1, 0, glm::value_ptr(projection));
+            glProgramUniform1i(ssaoProgramObject, ssaoSampleCountLocation, (int) ssaoSampleCount);
+            glProgramUniform1f(ssaoProgramObject, ssaoRadiusLocation, ssaoRadius);
+            glBindTexture(GL_TEXTURE_2D, ssaoTextures[ssaoResolution][0]);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            gpu_timer_end(gpuTimers[TIMER_SSAO]);
+
+            // Horizontal then vertical bilateral blur, ending back in the occlusion texture
+            gpu_timer_begin(gpuTimers[TIMER_SSAO_BLUR]);
+            glUseProgram(ssaoBlurProgramObject);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, ssaoTextures[ssaoResolution][0]);
+            for (int i = 0; i < 2; ++i)
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, ssaoFbos[ssaoResolution][2 - i]);
+                glProgramUniform2i(ssaoBlurProgramObject, ssaoBlurDirectionLocation, 1 - i, i);
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, ssaoTextures[ssaoResolution][1 + i]);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+            }
+            gpu_timer_end(gpuTimers[TIMER_SSAO_BLUR]);
+
+            gpu_timer_begin(gpuTimers[TIMER_SSAO_COMPOSITE]);
+            glViewport(0, 0, width, height);
+            glBindFramebuffer(GL_FRAMEBUFFER, compositeFbo);
+            glUseProgram(ssaoCompositeProgramObject);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, sceneTextures[0]);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, sceneTextures[2]);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, ssaoTextures[ssaoResolution][1]);
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D, ssaoTextures[ssaoResolution][0]);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            gpu_timer_end(gpuTimers[TIMER_SSAO_COMPOSITE]);
+
+            litTexture = compositeTexture;
+            litFbo = compositeFbo;
+        }
+
+        // Temporal anti-aliasing resolve into the current history buffer
+        int historyIndex = frame % 2;
+        if (taaEnabled)
+        {
+            gpu_timer_begin(gpuTimers[TIMER_TAA]);
+            glBindFramebuffer(GL_FRAMEBUFFER, historyFbos[historyIndex]);
+            glUseProgram(taaProgramObject);
+            glProgramUniform1f(taaProgramObject, taaFeedbackLocation, taaFeedback);
+            glProgramUniform1i(taaProgramObject, taaResetLocation, taaReset ? 1 : 0);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, litTexture);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, historyTextures[1 - historyIndex]);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, sceneTextures[1]);
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D, sceneTextures[2]);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            taaReset = false;
+            gpu_timer_end(gpuTimers[TIMER_TAA]);
+        }
+
+        // Copy the result to the default framebuffer
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, taaEnabled ? historyFbos[historyIndex] : litFbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        prevMvp = mvp;
+        prevTime = t;
+        ++frame;
 
 #if 1
         // Draw UI
-        glDisable(GL_DEPTH_TEST);
+        gpu_timer_begin(gpuTimers[TIMER_UI]);
         glEnable(GL_BLEND);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
         glViewport(0, 0, width, height);
@@ -415,18 +1241,95 @@ int main( int argc, char **argv )
         sprintf(lineBuffer, "FPS %f", fps);
         imguiLabel(lineBuffer);
         imguiSlider("Dummy", &dummySlider, 0.0, 3.0, 0.1);
+        imguiSlider("Shading model", &shadingModel, 0.0, SHADING_MODEL_COUNT - 1, 1.0);
+        imguiLabel(shadingModelNames[(int) shadingModel]);
+        if (imguiCheck("TAA", taaEnabled))
+        {
+            taaEnabled = !taaEnabled;
+            taaReset = true;
+        }
+        imguiSlider("TAA feedback", &taaFeedback, 0.5, 0.98, 0.01, taaEnabled);
+        if (imguiCheck("SSAO", ssaoEnabled))
+            ssaoEnabled = !ssaoEnabled;
+        if (imguiCheck("SSAO quarter resolution", ssaoQuarterResolution, ssaoEnabled))
+            ssaoQuarterResolution = !ssaoQuarterResolution;
+        imguiSlider("SSAO samples", &ssaoSampleCount, 4.0, SSAO_MAX_SAMPLES, 4.0, ssaoEnabled);
+        imguiSlider("SSAO radius", &ssaoRadius, 0.05, 2.0, 0.05, ssaoEnabled);
+        imguiSlider("Texture upload MB", &textureUploadBudget, 0.25, 16.0, 0.25);
+        if (imguiSlider("Anisotropy", &textureAnisotropy, 1.0, textureManager.maxAnisotropy, 1.0, textureManager.maxAnisotropy > 1.f))
+            texture_manager_set_anisotropy(textureManager, textureAnisotropy);
+        imguiSlider("Texture budget MB", &textureBudget, 1.0, 64.0, 1.0);
+        if (imguiCheck("Texture trace", textureManager.trace))
+            textureManager.trace = !textureManager.trace;
+        if (imguiSlider("Frames in flight", &framesInFlight, 1.0, FramePacer::MAX_FRAMES, 1.0))
+            framePacer.framesInFlight = (int) framesInFlight;
+        if (imguiCheck("Late input", framePacer.lateInput))
+            framePacer.lateInput = !framePacer.lateInput;
 
         imguiEndScrollArea();
+
+        imguiBeginScrollArea("Profiler", 10, height - 310, 200, 300, &profilerScroll);
+        for (int i = 0; i < TIMER_COUNT; ++i)
+        {
+            sprintf(lineBuffer, "%s %.3f ms", gpuTimers[i].name, gpuTimers[i].milliseconds);
+            imguiLabel(lineBuffer);
+        }
+        sprintf(lineBuffer, "Latency %.2f ms, wait %.2f ms", framePacer.latencyMilliseconds, framePacer.waitMilliseconds);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Frames queued %d/%d", framePacer.submitted - framePacer.retired, framePacer.framesInFlight);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Textures %d/%d ready", textureManager.readyCount, (int) textureManager.textures.size());
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Texture upload %d KB", textureManager.uploadedBytes / 1024);
+        imguiLabel(lineBuffer);
+        double mipmapMilliseconds = 0.0;
+        for (size_t i = 0; i < textureManager.textures.size(); ++i)
+            mipmapMilliseconds += textureManager.textures[i].mipmapMilliseconds;
+        sprintf(lineBuffer, "Mipmaps (CPU) %.3f ms", mipmapMilliseconds);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Programs %d cached, %d compiled", programManager.cache.loadedCount, programManager.cache.compiledCount);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Programs linking %d%s, %d reloaded", programManager.linkingCount, programManager.parallelCompile ? " (parallel)" : "", programManager.reloadCount);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Program creation %.1f ms", programManager.cache.milliseconds);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Objects %d/%d visible", visibleCount, OBJECT_COUNT);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Texture memory %d/%d KB", textureManager.residentBytes / 1024, textureManager.budgetBytes / 1024);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Texture wanted %d KB", textureManager.wantedBytes / 1024);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Materials %d, %d binds, %d texture binds", (int) materialManager.materials.size(), materialManager.materialBinds, materialManager.textureBinds);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Evicted %d KB, deferred %d", textureManager.evictedBytes / 1024, textureManager.deferredLevels);
+        imguiLabel(lineBuffer);
+        for (size_t i = 0; i < textureManager.textures.size(); ++i)
+        {
+            const Texture & texture = textureManager.textures[i];
+            if (texture.state != TEXTURE_READY)
+                continue;
+            sprintf(lineBuffer, "%s L%d (wants L%d)", texture.path.c_str() + texture.path.rfind('/') + 1,
+                    texture.residentLevel, texture_target_level(texture));
+            imguiLabel(lineBuffer);
+        }
+        imguiEndScrollArea();
+
         imguiEndFrame();
         imguiRenderGLDraw(width, height);
 
         glDisable(GL_BLEND);
+        gpu_timer_end(gpuTimers[TIMER_UI]);
 #endif
         // Check for errors
         checkError("End loop");
 
         glfwSwapBuffers(window);
-        glfwPollEvents();
+        frame_pacer_end(framePacer);
+        if (!framePacer.lateInput)
+        {
+            glfwPollEvents();
+            frame_pacer_input(framePacer);
+        }
 
         double newTime = glfwGetTime();
         fps = 1.f/ (newTime - t);
@@ -438,6 +1341,12 @@ int main( int argc, char **argv )
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
+    frame_pacer_shutdown(framePacer);
+
+    // Stop texture workers and release CPU copies still in flight
+    material_manager_shutdown(materialManager);
+    texture_manager_shutdown(textureManager);
+
     // Close OpenGL window and terminate GLFW
     glfwTerminate();
 
@@ -470,12 +1379,20 @@ char * strsep_custom(char **stringp, const char *delim)
     return 0;
 }
 
-int check_compile_error(GLuint shader, const char ** sourceBuffer)
+int check_compile_error(GLuint shader, const char ** sourceBuffer, const std::vector<std::string> * files)
 {
     // Get error log size and print it eventually
     int logLength;
     glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
-    if (logLength > 1)
+    if (logLength > 1 && files)
+    {
+        // Preprocessed sources, the log locates the lines in their files
+        char * log = new char[logLength];
+        glGetShaderInfoLog(shader, logLength, &logLength, log);
+        fprintf(stderr, "Compile : %s", shader_log_with_files(log, *files).c_str());
+        delete[] log;
+    }
+    else if (logLength > 1)
     {
         char * log = new char[logLength];
         glGetShaderInfoLog(shader, logLength, &logLength, log);
@@ -517,7 +1434,8 @@ int check_link_error(GLuint program)
 }
 
 
-GLuint compile_shader(GLenum shaderType, const char * sourceBuffer, int bufferSize)
+// Starts compiling without querying the result, which would wait for it
+GLuint submit_shader(GLenum shaderType, const char * sourceBuffer)
 {
     GLuint shaderObject = glCreateShader(shaderType);
     const char * sc[1] = { sourceBuffer };
@@ -526,115 +1444,2038 @@ GLuint compile_shader(GLenum shaderType, const char * sourceBuffer, int bufferSi
                    sc,
                    NULL);
     glCompileShader(shaderObject);
-    check_compile_error(shaderObject, sc);
     return shaderObject;
 }
 
-GLuint compile_shader_from_file(GLenum shaderType, const char * path)
+bool read_text_file(const char * path, std::string & text)
 {
-    FILE * shaderFileDesc = fopen( path, "rb" );
-    if (!shaderFileDesc)
-        return 0;
-    fseek ( shaderFileDesc , 0 , SEEK_END );
-    long fileSize = ftell ( shaderFileDesc );
-    rewind ( shaderFileDesc );
-    char * buffer = new char[fileSize + 1];
-    fread( buffer, 1, fileSize, shaderFileDesc );
-    buffer[fileSize] = '\0';
-    GLuint shaderObject = compile_shader(shaderType, buffer, fileSize );
-    delete[] buffer;
-    return shaderObject;
+    FILE * fileDesc = fopen( path, "rb" );
+    if (!fileDesc)
+        return false;
+    fseek ( fileDesc , 0 , SEEK_END );
+    long fileSize = ftell ( fileDesc );
+    rewind ( fileDesc );
+    text.resize(fileSize);
+    bool ok = fileSize == 0 || fread( &text[0], 1, fileSize, fileDesc ) == (size_t) fileSize;
+    fclose(fileDesc);
+    return ok;
 }
 
-
-bool checkError(const char* title)
+// Appends the lines of a file, and of the files it includes, to the source.
+// includeChain holds the files being included, to catch cycles.
+bool preprocess_shader_file(const std::string & path, const char * defines, ShaderSource & source, std::vector<std::string> & includeChain)
 {
-    int error;
-    if((error = glGetError()) != GL_NO_ERROR)
+    if (std::find(includeChain.begin(), includeChain.end(), path) != includeChain.end())
     {
-        std::string errorString;
-        switch(error)
+        fprintf(stderr, "%s includes itself\n", path.c_str());
+        return false;
+    }
+    int fileIndex = (int) (std::find(source.files.begin(), source.files.end(), path) - source.files.begin());
+    if (fileIndex == (int) source.files.size())
+        source.files.push_back(path);
+    std::string text;
+    if (!read_text_file(path.c_str(), text))
+    {
+        fprintf(stderr, "Can't read shader %s\n", path.c_str());
+        return false;
+    }
+    includeChain.push_back(path);
+    std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+    char directive[64];
+    bool root = fileIndex == 0;
+    if (!root)
+    {
+        // Included files number their lines from 1
+        sprintf(directive, "#line 1 %d\n", fileIndex);
+        source.text += directive;
+    }
+    else if (text.find("#version") == std::string::npos)
+    {
+        // No #version to follow, the defines come first
+        source.text += defines ? defines : "";
+        source.text += "#line 1 0\n";
+        root = false;
+    }
+
+    int lineNumber = 0;
+    for (size_t lineStart = 0; lineStart < text.size(); )
+    {
+        size_t lineEnd = text.find('\n', lineStart);
+        lineEnd = lineEnd == std::string::npos ? text.size() : lineEnd + 1;
+        std::string line = text.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd;
+        ++lineNumber;
+
+        size_t hash = line.find_first_not_of(" \t");
+        if (hash != std::string::npos && line.compare(hash, 8, "#include") == 0)
         {
-        case GL_INVALID_ENUM:
-            errorString = "GL_INVALID_ENUM";
-            break;
-        case GL_INVALID_VALUE:
-            errorString = "GL_INVALID_VALUE";
-            break;
-        case GL_INVALID_OPERATION:
-            errorString = "GL_INVALID_OPERATION";
-            break;
-        case GL_INVALID_FRAMEBUFFER_OPERATION:
-            errorString = "GL_INVALID_FRAMEBUFFER_OPERATION";
-            break;
-        case GL_OUT_OF_MEMORY:
-            errorString = "GL_OUT_OF_MEMORY";
-            break;
-        default:
-            errorString = "UNKNOWN";
-            break;
+            size_t nameStart = line.find('"', hash + 8);
+            size_t nameEnd = nameStart == std::string::npos ? nameStart : line.find('"', nameStart + 1);
+            if (nameEnd == std::string::npos)
+            {
+                fprintf(stderr, "%s:%d : #include expects \"file\"\n", path.c_str(), lineNumber);
+                return false;
+            }
+            std::string includePath = directory + line.substr(nameStart + 1, nameEnd - nameStart - 1);
+            if (!preprocess_shader_file(includePath, 0, source, includeChain))
+            {
+                fprintf(stderr, "%s:%d : included from here\n", path.c_str(), lineNumber);
+                return false;
+            }
+            if (source.text[source.text.size() - 1] != '\n')
+                source.text += '\n';
+            // Back to the including file
+            sprintf(directive, "#line %d %d\n", lineNumber + 1, fileIndex);
+            source.text += directive;
+            continue;
+        }
+        if (fileIndex > 0 && hash != std::string::npos && line.compare(hash, 8, "#version") == 0)
+        {
+            source.text += "\n"; // Only the stage file declares it
+            continue;
+        }
+
+        source.text += line;
+        if (root && hash != std::string::npos && line.compare(hash, 8, "#version") == 0)
+        {
+            // Defines go right after the #version line, which has to come first
+            if (line[line.size() - 1] != '\n')
+                source.text += '\n';
+            source.text += defines ? defines : "";
+            sprintf(directive, "#line %d 0\n", lineNumber + 1);
+            source.text += directive;
+            root = false;
         }
-        fprintf(stdout, "OpenGL Error(%s): %s\n", errorString.c_str(), title);
     }
-    return error == GL_NO_ERROR;
+    includeChain.pop_back();
+    return true;
 }
 
-void camera_compute(Camera & c)
+bool preprocess_shader(const char * path, const char * defines, ShaderSource & source)
 {
-    c.eye.x = cos(c.theta) * sin(c.phi) * c.radius + c.o.x;   
-    c.eye.y = cos(c.phi) * c.radius + c.o.y ;
-    c.eye.z = sin(c.theta) * sin(c.phi) * c.radius + c.o.z;   
-    c.up = glm::vec3(0.f, c.phi < M_PI ?1.f:-1.f, 0.f);
+    source.text.clear();
+    source.files.clear();
+    std::vector<std::string> includeChain;
+    return preprocess_shader_file(path, defines, source, includeChain);
 }
 
-void camera_defaults(Camera & c)
+// Replaces the source numbers of the log locations, "0:12(5)" on Mesa and
+// AMD or "0(12)" on NVIDIA, by the file names
+std::string shader_log_with_files(const char * log, const std::vector<std::string> & files)
 {
-    c.phi = 3.14/2.f;
-    c.theta = 3.14/2.f;
-    c.radius = 10.f;
-    camera_compute(c);
+    std::string mapped;
+    bool lineStart = true;
+    for (const char * c = log; *c; )
+    {
+        if (lineStart || !isalnum((unsigned char) c[-1]))
+        {
+            const char * end = c;
+            unsigned int index = 0;
+            while (isdigit((unsigned char) *end) && index < files.size())
+                index = index * 10 + (*end++ - '0');
+            if (end != c && index < files.size() && (*end == ':' || *end == '(') && isdigit((unsigned char) end[1]))
+            {
+                mapped += files[index];
+                c = end;
+                lineStart = false;
+                continue;
+            }
+        }
+        lineStart = *c == '\n';
+        mapped += *c++;
+    }
+    return mapped;
 }
 
-void camera_zoom(Camera & c, float factor)
+#define PROGRAM_BINARY_MAGIC "AOPB"
+#define PROGRAM_BINARY_VERSION 1
+
+struct ProgramBinaryHeader
 {
-    c.radius += factor * c.radius ;
-    if (c.radius < 0.1)
-    {
-        c.radius = 10.f;
-        c.o = c.eye + glm::normalize(c.o - c.eye) * c.radius;
-    }
-    camera_compute(c);
+    char magic[4];
+    unsigned int version;
+    GLuint64 key;
+    unsigned int format;
+    unsigned int size; // Of the binary following the header
+};
+
+// FNV-1a
+GLuint64 hash_bytes(GLuint64 hash, const void * data, size_t size)
+{
+    const unsigned char * bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    return hash;
 }
 
-void camera_turn(Camera & c, float phi, float theta)
+void program_cache_init(ProgramCache & cache, const char * directory)
 {
-    c.theta += 1.f * theta;
-    c.phi   -= 1.f * phi;
-    if (c.phi >= (2 * M_PI) - 0.1 )
-        c.phi = 0.00001;
-    else if (c.phi <= 0 )
-        c.phi = 2 * M_PI - 0.1;
-    camera_compute(c);
+    cache.directory = directory;
+    const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+    for (int i = 0; i < 4; ++i)
+    {
+        const GLubyte * string = glGetString(strings[i]);
+        cache.driver += string ? (const char *) string : "";
+        cache.driver += '\n';
+    }
+    GLint formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    cache.formats.resize(formatCount);
+    if (formatCount > 0)
+    {
+        glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, &cache.formats[0]);
+#ifdef _WIN32
+        _mkdir(directory);
+#else
+        mkdir(directory, 0755);
+#endif
+    }
+    cache.loadedCount = 0;
+    cache.compiledCount = 0;
+    cache.milliseconds = 0.0;
 }
 
-void camera_pan(Camera & c, float x, float y)
+std::string program_cache_path(const ProgramCache & cache, GLuint64 key)
 {
-    glm::vec3 up(0.f, c.phi < M_PI ?1.f:-1.f, 0.f);
-    glm::vec3 fwd = glm::normalize(c.o - c.eye);
-    glm::vec3 side = glm::normalize(glm::cross(fwd, up));
-    c.up = glm::normalize(glm::cross(side, fwd));
-    c.o[0] += up[0] * y * c.radius * 2;
-    c.o[1] += up[1] * y * c.radius * 2;
-    c.o[2] += up[2] * y * c.radius * 2;
-    c.o[0] -= side[0] * x * c.radius * 2;
-    c.o[1] -= side[1] * x * c.radius * 2;
-    c.o[2] -= side[2] * x * c.radius * 2;       
-    camera_compute(c);
+    char name[32];
+    sprintf(name, "/%016llx.bin", (unsigned long long) key);
+    return cache.directory + name;
 }
 
-void init_gui_states(GUIStates & guiStates)
+GLuint program_cache_load(ProgramCache & cache, GLuint64 key)
 {
-    guiStates.panLock = false;
+    MappedFile file;
+    if (!mapped_file_open(file, program_cache_path(cache, key).c_str()))
+        return 0;
+    GLuint program = 0;
+    const ProgramBinaryHeader * header = (const ProgramBinaryHeader *) file.data;
+    if (file.size >= sizeof(ProgramBinaryHeader)
+        && memcmp(header->magic, PROGRAM_BINARY_MAGIC, 4) == 0
+        && header->version == PROGRAM_BINARY_VERSION
+        && header->key == key
+        && header->size == file.size - sizeof(ProgramBinaryHeader)
+        // An unknown format would raise an error instead of failing the link
+        && std::find(cache.formats.begin(), cache.formats.end(), (GLint) header->format) != cache.formats.end())
+    {
+        program = glCreateProgram();
+        glProgramBinary(program, header->format, file.data + sizeof(ProgramBinaryHeader), header->size);
+        GLint status;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (status == GL_FALSE)
+        {
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+    mapped_file_close(file);
+    return program;
+}
+
+void program_cache_store(ProgramCache & cache, GLuint64 key, GLuint program)
+{
+    GLint size = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0)
+        return;
+    std::vector<unsigned char> data(sizeof(ProgramBinaryHeader) + size);
+    GLsizei length = 0;
+    GLenum format;
+    glGetProgramBinary(program, size, &length, &format, &data[sizeof(ProgramBinaryHeader)]);
+    if (length <= 0)
+        return;
+    ProgramBinaryHeader * header = (ProgramBinaryHeader *) &data[0];
+    memcpy(header->magic, PROGRAM_BINARY_MAGIC, 4);
+    header->version = PROGRAM_BINARY_VERSION;
+    header->key = key;
+    header->format = format;
+    header->size = length;
+
+    // Written aside and renamed, another instance never reads half a file.
+    // The process id keeps instances storing the same program apart.
+    std::string path = program_cache_path(cache, key);
+    char suffix[32];
+    sprintf(suffix, ".%d.tmp", (int) getpid());
+    std::string temporaryPath = path + suffix;
+    FILE * fileDesc = fopen(temporaryPath.c_str(), "wb");
+    if (!fileDesc)
+        return;
+    size_t fileSize = sizeof(ProgramBinaryHeader) + length;
+    bool written = fwrite(&data[0], 1, fileSize, fileDesc) == fileSize;
+    written = fclose(fileDesc) == 0 && written;
+#ifdef _WIN32
+    remove(path.c_str()); // rename does not replace files
+#endif
+    if (!written || rename(temporaryPath.c_str(), path.c_str()) != 0)
+        remove(temporaryPath.c_str());
+}
+
+// The preprocessed texts cover the included files and the defines
+GLuint64 program_cache_key(const ProgramCache & cache, int stageCount, const GLenum * stages, const ShaderSource * sources)
+{
+    GLuint64 key = hash_bytes(14695981039346656037ULL, cache.driver.data(), cache.driver.size());
+    for (int i = 0; i < stageCount; ++i)
+    {
+        key = hash_bytes(key, &stages[i], sizeof(GLenum));
+        key = hash_bytes(key, sources[i].text.c_str(), sources[i].text.size() + 1); // The terminator separates the stages
+    }
+    return key;
+}
+
+int uniform_names_intern(UniformNames & un, const char * name)
+{
+    std::map<std::string, int>::const_iterator it = un.slots.find(name);
+    if (it != un.slots.end())
+        return it->second;
+    int slot = (int) un.names.size();
+    un.names.push_back(name);
+    un.slots[name] = slot;
+    un.blockBindings.push_back(-1);
+    return slot;
+}
+
+void uniform_names_bind_block(UniformNames & un, const char * name, GLuint binding)
+{
+    un.blockBindings[uniform_names_intern(un, name)] = (GLint) binding;
+}
+
+void program_reflect(ProgramReflection & pr, UniformNames & un, GLuint program)
+{
+    pr.program = program;
+    pr.uniforms.clear();
+    pr.blocks.clear();
+    pr.locations.clear();
+    pr.blockIndices.clear();
+
+    GLint blockCount = 0;
+    GLint maxLength = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+    std::vector<char> name(maxLength + 1);
+    for (GLint i = 0; i < blockCount; ++i)
+    {
+        ProgramBlock block;
+        glGetActiveUniformBlockName(program, i, (GLsizei) name.size(), 0, &name[0]);
+        block.slot = uniform_names_intern(un, &name[0]);
+        block.index = (GLuint) i;
+        glGetActiveUniformBlockiv(program, i, GL_UNIFORM_BLOCK_DATA_SIZE, &block.dataSize);
+        if (un.blockBindings[block.slot] >= 0)
+            glUniformBlockBinding(program, block.index, (GLuint) un.blockBindings[block.slot]);
+        glGetActiveUniformBlockiv(program, i, GL_UNIFORM_BLOCK_BINDING, &block.binding);
+        pr.blocks.push_back(block);
+    }
+
+    GLint uniformCount = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &uniformCount);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    name.resize(maxLength + 1);
+    for (GLint i = 0; i < uniformCount; ++i)
+    {
+        ProgramUniform uniform;
+        GLuint index = (GLuint) i;
+        glGetActiveUniform(program, index, (GLsizei) name.size(), 0, &uniform.size, &uniform.type, &name[0]);
+        glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_BLOCK_INDEX, &uniform.block);
+        glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_OFFSET, &uniform.offset);
+        // Arrays are named after their first element
+        char * bracket = strchr(&name[0], '[');
+        if (bracket)
+            *bracket = 0;
+        uniform.slot = uniform_names_intern(un, &name[0]);
+        uniform.location = uniform.block < 0 ? glGetUniformLocation(program, &name[0]) : -1;
+        pr.uniforms.push_back(uniform);
+    }
+
+    // Slot tables, the only lookups left for draws
+    pr.locations.resize(un.names.size(), -1);
+    pr.blockIndices.resize(un.names.size(), -1);
+    for (size_t i = 0; i < pr.uniforms.size(); ++i)
+        pr.locations[pr.uniforms[i].slot] = pr.uniforms[i].location;
+    for (size_t i = 0; i < pr.blocks.size(); ++i)
+        pr.blockIndices[pr.blocks[i].slot] = (int) i;
+}
+
+const ProgramBlock * program_block(const ProgramReflection & pr, int slot)
+{
+    if ((size_t) slot >= pr.blockIndices.size() || pr.blockIndices[slot] < 0)
+        return 0;
+    return &pr.blocks[pr.blockIndices[slot]];
+}
+
+void program_manager_init(ProgramManager & pm, const char * cacheDirectory)
+{
+    program_cache_init(pm.cache, cacheDirectory);
+    pm.parallelCompile = glfwExtensionSupported("GL_KHR_parallel_shader_compile") || glfwExtensionSupported("GL_ARB_parallel_shader_compile");
+    if (pm.parallelCompile)
+    {
+        // As many compiler threads as the driver sees fit
+        MaxShaderCompilerThreadsProc maxShaderCompilerThreads = (MaxShaderCompilerThreadsProc) glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+        if (!maxShaderCompilerThreads)
+            maxShaderCompilerThreads = (MaxShaderCompilerThreadsProc) glfwGetProcAddress("glMaxShaderCompilerThreadsARB");
+        if (maxShaderCompilerThreads)
+            maxShaderCompilerThreads(0xFFFFFFFF);
+    }
+    pm.frame = 0;
+    pm.linkingCount = 0;
+    file_watcher_init(pm.watcher);
+    pm.reloadCount = 0;
+}
+
+// Preprocesses the stages, watching every file they are made of, and starts
+// building them unless their sources did not change. The program linked,
+// or restored from the cache, replaces the current one.
+void program_manager_build(ProgramManager & pm, Program & program)
+{
+    double startTime = glfwGetTime();
+    ShaderSource sources[ProgramCache::MAX_STAGES];
+    for (int i = 0; i < program.stageCount; ++i)
+    {
+        bool read = preprocess_shader(program.paths[i].c_str(), program.defines.c_str(), sources[i]);
+        for (size_t j = 0; j < sources[i].files.size(); ++j)
+            file_watcher_add(pm.watcher, sources[i].files[j].c_str());
+        if (!read)
+        {
+            // Still rebuilt once the files it could not read are saved
+            for (int j = 0; j <= i; ++j)
+                program.sources[j].files = sources[j].files;
+            if (program.state == PROGRAM_READY)
+                fprintf(stderr, "Program %s kept\n", program.name.c_str());
+            return;
+        }
+    }
+    GLuint64 key = program_cache_key(pm.cache, program.stageCount, program.stages, sources);
+    if (program.state == PROGRAM_READY && key == program.key)
+        return; // Saved without changes
+    program.key = key;
+    for (int i = 0; i < program.stageCount; ++i)
+        program.sources[i] = sources[i];
+
+    GLuint id = pm.cache.formats.empty() ? 0 : program_cache_load(pm.cache, program.key);
+    if (id)
+    {
+        if (program.state == PROGRAM_READY)
+        {
+            glDeleteProgram(program.id);
+            ++pm.reloadCount;
+        }
+        program.id = id;
+        program.state = PROGRAM_READY;
+        program_reflect(program.reflection, pm.uniformNames, program.id);
+        ++pm.cache.loadedCount;
+        for (int i = 0; i < program.stageCount; ++i)
+            program.sources[i].text.clear();
+    }
+    else
+    {
+        if (program.state != PROGRAM_READY)
+            program.state = PROGRAM_LINKING;
+        program.linkingId = glCreateProgram();
+        if (!pm.cache.formats.empty())
+            glProgramParameteri(program.linkingId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        for (int i = 0; i < program.stageCount; ++i)
+        {
+            program.shaders[i] = submit_shader(program.stages[i], program.sources[i].text.c_str());
+            glAttachShader(program.linkingId, program.shaders[i]);
+        }
+        glLinkProgram(program.linkingId);
+        program.submitFrame = pm.frame;
+        ++pm.linkingCount;
+    }
+    pm.cache.milliseconds += (glfwGetTime() - startTime) * 1000.0;
+}
+
+int program_manager_add(ProgramManager & pm, int stageCount, const GLenum * stages, const char * const * paths, const char * defines, int fallback)
+{
+    pm.programs.push_back(Program());
+    Program & program = pm.programs.back();
+    program.state = PROGRAM_FAILED;
+    program.id = 0;
+    program.linkingId = 0;
+    program.stageCount = stageCount;
+    program.defines = defines ? defines : "";
+    program.key = 0;
+    program.fallback = fallback;
+    program.submitFrame = pm.frame;
+    program.stale = false;
+    for (int i = 0; i < stageCount; ++i)
+    {
+        program.name += (i ? "+" : "") + std::string(paths[i]);
+        program.stages[i] = stages[i];
+        program.paths[i] = paths[i];
+        program.shaders[i] = 0;
+    }
+    program_manager_build(pm, program);
+    return (int) pm.programs.size() - 1;
+}
+
+// Queries the statuses, which waits for the driver if it is not done yet
+void program_manager_complete(ProgramManager & pm, Program & program)
+{
+    bool compiled = true;
+    for (int i = 0; i < program.stageCount; ++i)
+    {
+        const char * source = program.sources[i].text.c_str();
+        if (check_compile_error(program.shaders[i], &source, &program.sources[i].files) < 0)
+            compiled = false;
+    }
+    bool linked = compiled && check_link_error(program.linkingId) == 0;
+    for (int i = 0; i < program.stageCount; ++i)
+    {
+        glDetachShader(program.linkingId, program.shaders[i]);
+        glDeleteShader(program.shaders[i]);
+        program.shaders[i] = 0;
+        program.sources[i].text.clear();
+    }
+    if (linked)
+    {
+        // Swapped in between frames, draws never see a half built program
+        if (program.state == PROGRAM_READY)
+        {
+            glDeleteProgram(program.id);
+            ++pm.reloadCount;
+        }
+        program.id = program.linkingId;
+        program.state = PROGRAM_READY;
+        program_reflect(program.reflection, pm.uniformNames, program.id);
+        ++pm.cache.compiledCount;
+        if (!pm.cache.formats.empty())
+            program_cache_store(pm.cache, program.key, program.id);
+    }
+    else
+    {
+        glDeleteProgram(program.linkingId);
+        if (program.state == PROGRAM_READY)
+            fprintf(stderr, "Program %s failed, previous one kept\n", program.name.c_str());
+        else
+        {
+            fprintf(stderr, "Program %s failed\n", program.name.c_str());
+            program.state = PROGRAM_FAILED;
+        }
+    }
+    program.linkingId = 0;
+    --pm.linkingCount;
+}
+
+void program_manager_update(ProgramManager & pm)
+{
+    // Programs made from the files saved since last frame
+    std::vector<std::string> changed;
+    std::vector<int> dependents;
+    file_watcher_poll(pm.watcher, changed);
+    for (size_t i = 0; i < changed.size(); ++i)
+    {
+        program_manager_dependents(pm, changed[i].c_str(), dependents);
+        for (size_t j = 0; j < dependents.size(); ++j)
+            pm.programs[dependents[j]].stale = true;
+    }
+    // Rebuilt in the background, once their previous build is done
+    for (size_t i = 0; i < pm.programs.size(); ++i)
+    {
+        Program & program = pm.programs[i];
+        if (program.stale && !program.linkingId)
+        {
+            program.stale = false;
+            program_manager_build(pm, program);
+        }
+    }
+
+    double startTime = glfwGetTime();
+    for (size_t i = 0; i < pm.programs.size() && pm.linkingCount > 0; ++i)
+    {
+        Program & program = pm.programs[i];
+        if (!program.linkingId)
+            continue;
+        if (pm.parallelCompile)
+        {
+            GLint complete = GL_FALSE;
+            glGetProgramiv(program.linkingId, GL_COMPLETION_STATUS_KHR, &complete);
+            if (!complete)
+                continue;
+        }
+        else if (program.submitFrame == pm.frame)
+            continue; // Leaves a frame to drivers compiling on their own threads
+        program_manager_complete(pm, program);
+    }
+    ++pm.frame;
+    pm.cache.milliseconds += (glfwGetTime() - startTime) * 1000.0;
+}
+
+void program_manager_wait(ProgramManager & pm, int handle)
+{
+    double startTime = glfwGetTime();
+    if (pm.programs[handle].linkingId)
+        program_manager_complete(pm, pm.programs[handle]);
+    pm.cache.milliseconds += (glfwGetTime() - startTime) * 1000.0;
+}
+
+GLuint program_manager_program(const ProgramManager & pm, int handle)
+{
+    while (handle >= 0 && pm.programs[handle].state != PROGRAM_READY)
+        handle = pm.programs[handle].fallback;
+    return handle >= 0 ? pm.programs[handle].id : 0;
+}
+
+const ProgramReflection * program_manager_reflection(const ProgramManager & pm, int handle)
+{
+    while (handle >= 0 && pm.programs[handle].state != PROGRAM_READY)
+        handle = pm.programs[handle].fallback;
+    return handle >= 0 ? &pm.programs[handle].reflection : 0;
+}
+
+void program_manager_dependents(const ProgramManager & pm, const char * path, std::vector<int> & handles)
+{
+    handles.clear();
+    for (size_t i = 0; i < pm.programs.size(); ++i)
+    {
+        const Program & program = pm.programs[i];
+        bool depends = false;
+        for (int j = 0; j < program.stageCount && !depends; ++j)
+            depends = std::find(program.sources[j].files.begin(), program.sources[j].files.end(), path) != program.sources[j].files.end();
+        if (depends)
+            handles.push_back((int) i);
+    }
+}
+
+// Collects the names of the "#pragma keyword" lines
+void parse_shader_keywords(const std::string & source, ProgramVariants & pv)
+{
+    const char * pragma = "#pragma keyword";
+    size_t length = strlen(pragma);
+    for (size_t position = source.find(pragma); position != std::string::npos; position = source.find(pragma, position + length))
+    {
+        // Only when the directive starts the line
+        size_t lineStart = source.find_last_not_of(" \t", position - 1);
+        if (position > 0 && lineStart != std::string::npos && source[lineStart] != '\n')
+            continue;
+        size_t lineEnd = source.find('\n', position);
+        std::string line = source.substr(position + length, lineEnd == std::string::npos ? std::string::npos : lineEnd - position - length);
+        if (line.empty() || (line[0] != ' ' && line[0] != '\t'))
+            continue;
+
+        unsigned int group = 0;
+        int nameCount = 0;
+        size_t nameEnd = 0;
+        for (size_t nameStart = line.find_first_not_of(" \t\r"); nameStart != std::string::npos; nameStart = line.find_first_not_of(" \t\r", nameEnd))
+        {
+            nameEnd = line.find_first_of(" \t\r", nameStart);
+            std::string name = line.substr(nameStart, nameEnd == std::string::npos ? std::string::npos : nameEnd - nameStart);
+            size_t index = std::find(pv.keywords.begin(), pv.keywords.end(), name) - pv.keywords.begin();
+            if (index == pv.keywords.size())
+            {
+                if (index == (size_t) ProgramVariants::MAX_KEYWORDS)
+                {
+                    fprintf(stderr, "Too many shader keywords, %s ignored\n", name.c_str());
+                    continue;
+                }
+                pv.keywords.push_back(name);
+            }
+            group |= 1u << index;
+            ++nameCount;
+        }
+        if (nameCount > 1)
+            pv.choices.push_back(group);
+    }
+}
+
+int program_manager_add_variants(ProgramManager & pm, int stageCount, const GLenum * stages, const char * const * paths)
+{
+    pm.variants.push_back(ProgramVariants());
+    ProgramVariants & pv = pm.variants.back();
+    pv.stageCount = stageCount;
+    for (int i = 0; i < stageCount; ++i)
+    {
+        pv.stages[i] = stages[i];
+        pv.paths[i] = paths[i];
+        ShaderSource source;
+        if (preprocess_shader(paths[i], 0, source))
+            parse_shader_keywords(source.text, pv);
+    }
+    int handle = (int) pm.variants.size() - 1;
+    pv.defaultProgram = -1;
+    pv.defaultProgram = program_manager_variant(pm, handle, 0);
+    return handle;
+}
+
+unsigned int program_manager_keyword(const ProgramManager & pm, int variants, const char * keyword)
+{
+    const std::vector<std::string> & keywords = pm.variants[variants].keywords;
+    size_t index = std::find(keywords.begin(), keywords.end(), keyword) - keywords.begin();
+    return index < keywords.size() ? 1u << index : 0;
+}
+
+int program_manager_variant(ProgramManager & pm, int variants, unsigned int keywords)
+{
+    ProgramVariants & pv = pm.variants[variants];
+
+    // Exclusive groups left unset take their first keyword
+    for (size_t i = 0; i < pv.choices.size(); ++i)
+        if (!(keywords & pv.choices[i]))
+            keywords |= pv.choices[i] & (0u - pv.choices[i]);
+
+    std::map<unsigned int, int>::const_iterator it = pv.programs.find(keywords);
+    if (it != pv.programs.end())
+        return it->second;
+
+    // Only the exclusive groups may differ in the fallback
+    unsigned int base = keywords;
+    for (size_t i = 0; i < pv.choices.size(); ++i)
+        base = (base & ~pv.choices[i]) | (pv.choices[i] & (0u - pv.choices[i]));
+    int fallback = base != keywords ? program_manager_variant(pm, variants, base) : pv.defaultProgram;
+
+    std::string defines;
+    for (size_t i = 0; i < pv.keywords.size(); ++i)
+        if (keywords & (1u << i))
+            defines += "#define " + pv.keywords[i] + " 1\n";
+    const char * paths[ProgramCache::MAX_STAGES];
+    for (int i = 0; i < pv.stageCount; ++i)
+        paths[i] = pv.paths[i].c_str();
+    int handle = program_manager_add(pm, pv.stageCount, pv.stages, paths, defines.c_str(), fallback);
+    pv.programs[keywords] = handle;
+    return handle;
+}
+
+
+bool checkError(const char* title)
+{
+    int error;
+    if((error = glGetError()) != GL_NO_ERROR)
+    {
+        std::string errorString;
+        switch(error)
+        {
+        case GL_INVALID_ENUM:
+            errorString = "GL_INVALID_ENUM";
+            break;
+        case GL_INVALID_VALUE:
+            errorString = "GL_INVALID_VALUE";
+            break;
+        case GL_INVALID_OPERATION:
+            errorString = "GL_INVALID_OPERATION";
+            break;
+        case GL_INVALID_FRAMEBUFFER_OPERATION:
+            errorString = "GL_INVALID_FRAMEBUFFER_OPERATION";
+            break;
+        case GL_OUT_OF_MEMORY:
+            errorString = "GL_OUT_OF_MEMORY";
+            break;
+        default:
+            errorString = "UNKNOWN";
+            break;
+        }
+        fprintf(stdout, "OpenGL Error(%s): %s\n", errorString.c_str(), title);
+    }
+    return error == GL_NO_ERROR;
+}
+
+bool checkFramebuffer(const char* title)
+{
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::string statusString;
+        switch(status)
+        {
+        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:
+            statusString = "GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT";
+            break;
+        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:
+            statusString = "GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT";
+            break;
+        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:
+            statusString = "GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER";
+            break;
+        case GL_FRAMEBUFFER_UNSUPPORTED:
+            statusString = "GL_FRAMEBUFFER_UNSUPPORTED";
+            break;
+        default:
+            statusString = "UNKNOWN";
+            break;
+        }
+        fprintf(stdout, "OpenGL Framebuffer Error(%s): %s\n", statusString.c_str(), title);
+    }
+    return status == GL_FRAMEBUFFER_COMPLETE;
+}
+
+GLuint create_render_texture(GLenum internalFormat, GLenum format, GLenum type, GLenum filter, int width, int height)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    return texture;
+}
+
+float halton(int index, int base)
+{
+    float f = 1.f;
+    float r = 0.f;
+    while (index > 0)
+    {
+        f /= base;
+        r += f * (index % base);
+        index /= base;
+    }
+    return r;
+}
+
+glm::vec2 taa_jitter(int frame)
+{
+    // 16 samples of the (2, 3) Halton sequence, centered on the pixel
+    int index = (frame % 16) + 1;
+    return glm::vec2(halton(index, 2) - 0.5f, halton(index, 3) - 0.5f);
+}
+
+void ssao_kernel(glm::vec3 * kernel, int count)
+{
+    // Hemisphere samples around +Z, denser close to the origin
+    srand(0);
+    for (int i = 0; i < count; ++i)
+    {
+        glm::vec3 s(rand() / (float) RAND_MAX * 2.f - 1.f,
+                    rand() / (float) RAND_MAX * 2.f - 1.f,
+                    rand() / (float) RAND_MAX);
+        s = glm::normalize(s) * (rand() / (float) RAND_MAX);
+        float scale = (float) i / count;
+        kernel[i] = s * (0.1f + 0.9f * scale * scale);
+    }
+}
+
+void gpu_timer_init(GpuTimer & timer, const char * name)
+{
+    glGenQueries(GpuTimer::QUERY_COUNT, timer.queries);
+    for (int i = 0; i < GpuTimer::QUERY_COUNT; ++i)
+        timer.pending[i] = false;
+    timer.current = 0;
+    timer.milliseconds = 0.0;
+    timer.name = name;
+}
+
+void gpu_timer_begin(GpuTimer & timer)
+{
+    // Read back the result of the oldest query, if the GPU is done with it, before reusing it
+    GLuint query = timer.queries[timer.current];
+    if (timer.pending[timer.current])
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+        {
+            GLuint64 elapsed;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+            timer.milliseconds = elapsed / 1000000.0;
+        }
+        timer.pending[timer.current] = false;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, query);
+}
+
+void gpu_timer_end(GpuTimer & timer)
+{
+    glEndQuery(GL_TIME_ELAPSED);
+    timer.pending[timer.current] = true;
+    timer.current = (timer.current + 1) % GpuTimer::QUERY_COUNT;
+}
+
+void frame_pacer_calibrate(FramePacer & fp)
+{
+    // GL_TIMESTAMP is the GPU time once the commands issued so far have reached it
+    GLint64 timestamp;
+    glGetInteger64v(GL_TIMESTAMP, &timestamp);
+    fp.clockOffset = glfwGetTime() - timestamp / 1000000000.0;
+}
+
+void frame_pacer_init(FramePacer & fp, int framesInFlight, bool lateInput)
+{
+    glGenQueries(FramePacer::MAX_FRAMES, fp.queries);
+    for (int i = 0; i < FramePacer::MAX_FRAMES; ++i)
+    {
+        fp.fences[i] = 0;
+        fp.inputTimes[i] = 0.0;
+    }
+    fp.submitted = 0;
+    fp.retired = 0;
+    fp.framesInFlight = glm::clamp(framesInFlight, 1, FramePacer::MAX_FRAMES);
+    fp.lateInput = lateInput;
+    fp.inputTime = glfwGetTime();
+    fp.waitMilliseconds = 0.0;
+    fp.latencyMilliseconds = 0.0;
+    frame_pacer_calibrate(fp);
+}
+
+void frame_pacer_shutdown(FramePacer & fp)
+{
+    for (; fp.retired < fp.submitted; ++fp.retired)
+        glDeleteSync(fp.fences[fp.retired % FramePacer::MAX_FRAMES]);
+    glDeleteQueries(FramePacer::MAX_FRAMES, fp.queries);
+}
+
+bool frame_pacer_retire(FramePacer & fp, bool block)
+{
+    // Frames complete in order, only the oldest one is ever waited on
+    int slot = fp.retired % FramePacer::MAX_FRAMES;
+    GLenum status = glClientWaitSync(fp.fences[slot], block ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, block ? 1000000000 : 0);
+    if (status == GL_TIMEOUT_EXPIRED)
+        return false;
+    if (status != GL_WAIT_FAILED)
+    {
+        GLuint64 timestamp;
+        glGetQueryObjectui64v(fp.queries[slot], GL_QUERY_RESULT, &timestamp);
+        double end = timestamp / 1000000000.0 + fp.clockOffset;
+        fp.latencyMilliseconds = (end - fp.inputTimes[slot]) * 1000.0;
+    }
+    glDeleteSync(fp.fences[slot]);
+    fp.fences[slot] = 0;
+    ++fp.retired;
+    return true;
+}
+
+void frame_pacer_wait(FramePacer & fp)
+{
+    double start = glfwGetTime();
+    while (fp.submitted - fp.retired >= fp.framesInFlight)
+        frame_pacer_retire(fp, true);
+    // Pick up the latency of frames already done without waiting for them
+    while (fp.retired < fp.submitted && frame_pacer_retire(fp, false))
+        ;
+    fp.waitMilliseconds = (glfwGetTime() - start) * 1000.0;
+    // Both clocks drift, keep them lined up
+    frame_pacer_calibrate(fp);
+}
+
+void frame_pacer_input(FramePacer & fp)
+{
+    fp.inputTime = glfwGetTime();
+}
+
+void frame_pacer_end(FramePacer & fp)
+{
+    // frame_pacer_wait leaves a free slot
+    int slot = fp.submitted % FramePacer::MAX_FRAMES;
+    glQueryCounter(fp.queries[slot], GL_TIMESTAMP);
+    fp.fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    fp.inputTimes[slot] = fp.inputTime;
+    ++fp.submitted;
+}
+
+void frustum_from_matrix(Frustum & f, const glm::mat4 & viewProjection)
+{
+    // Planes are sums and differences of the matrix rows, glm stores columns
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; ++i)
+        rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+    for (int i = 0; i < 3; ++i)
+    {
+        f.planes[i * 2] = rows[3] + rows[i];
+        f.planes[i * 2 + 1] = rows[3] - rows[i];
+    }
+    for (int i = 0; i < 6; ++i)
+        f.planes[i] /= glm::length(glm::vec3(f.planes[i]));
+}
+
+bool frustum_test_sphere(const Frustum & f, const glm::vec3 & center, float radius)
+{
+    for (int i = 0; i < 6; ++i)
+        if (glm::dot(glm::vec3(f.planes[i]), center) + f.planes[i].w < -radius)
+            return false;
+    return true;
+}
+
+int texture_worker(void * arg)
+{
+    TextureManager & tm = *(TextureManager *) arg;
+    mtx_lock(&tm.mutex);
+    while (true)
+    {
+        while (!tm.quit && tm.decodeQueue.empty())
+            cnd_wait(&tm.condition, &tm.mutex);
+        if (tm.quit)
+            break;
+        int handle = tm.decodeQueue.front();
+        tm.decodeQueue.pop_front();
+        std::string path = tm.textures[handle].path;
+        int requestedComponents = tm.textures[handle].requestedComponents;
+        bool srgb = tm.textures[handle].srgb;
+        mtx_unlock(&tm.mutex);
+
+        int x = 0, y = 0, comp = 0, levelCount = 0, tailLevel = 0, format = -1;
+        double mipmapMilliseconds = 0.0;
+        size_t levelOffsets[TEXFILE_MAX_LEVELS];
+        unsigned char * data = 0;
+
+        // Prefer the block compressed file written by aotex next to the image,
+        // only its header and level table are read here
+        TexFileHeader header;
+        TexFileLevel levels[TEXFILE_MAX_LEVELS];
+        MappedFile file;
+        std::string texfilePath = path.substr(0, path.rfind('.')) + TEXFILE_EXTENSION;
+        if (open_texfile(file, texfilePath.c_str(), header, levels) && !tm.compressedFormats[header.format])
+            mapped_file_close(file);
+        if (file.data)
+        {
+            x = header.width;
+            y = header.height;
+            comp = header.format == TEXFILE_BC4 ? 1 : (header.format == TEXFILE_BC5 ? 2 : 4);
+            levelCount = header.levelCount;
+            tailLevel = header.tailLevel;
+            format = header.format;
+            // The file knows how its mips were filtered, not the caller
+            srgb = (header.flags & TEXFILE_SRGB) != 0;
+            for (int level = 0; level < levelCount; ++level)
+                levelOffsets[level] = (size_t) levels[level].offset;
+        }
+        else
+        {
+            // Images are decoded from a mapping straight into the allocation
+            // that gets the mip chain, stbi_load is the fallback
+            bool chainAllocated = false;
+            MappedFile image;
+            if (mapped_file_open(image, path.c_str()))
+            {
+                mapped_file_prefetch(image, 0, image.size);
+                // The bulk TGA decoder reads the header without the format probing
+                bool tga = path.size() > 4 && path.compare(path.size() - 4, 4, ".tga") == 0
+                    && stbi_tga_load_into(image.data, (int) image.size, 0, 0, &x, &y, &comp, requestedComponents, 0);
+                if (tga || stbi_info_from_memory(image.data, (int) image.size, &x, &y, &comp))
+                {
+                    size_t chainSize = mipmap_chain_size(x, y, requestedComponents ? requestedComponents : comp);
+                    data = (unsigned char *) malloc(chainSize);
+                    int decoded = 0;
+                    if (data)
+                        decoded = tga ? stbi_tga_load_into(image.data, (int) image.size, data, (int) chainSize, &x, &y, &comp, requestedComponents, 0)
+                                      : stbi_load_into_from_memory(image.data, (int) image.size, data, (int) chainSize, &x, &y, &comp, requestedComponents);
+                    if (!decoded)
+                    {
+                        free(data);
+                        data = 0;
+                    }
+                    chainAllocated = data != 0;
+                }
+                mapped_file_close(image);
+            }
+            if (!data)
+                data = stbi_load(path.c_str(), &x, &y, &comp, requestedComponents);
+            if (!data)
+                debug_print("Could not load %s : %s", path.c_str(), stbi_failure_reason());
+            else
+            {
+                comp = requestedComponents ? requestedComponents : comp;
+                levelCount = mipmap_level_count(x, y);
+                if (levelCount > TEXFILE_MAX_LEVELS)
+                    levelCount = TEXFILE_MAX_LEVELS;
+                for (int level = 0; level < levelCount; ++level)
+                    levelOffsets[level] = mipmap_level_offset(x, y, comp, level);
+                // Same mip tail as an .aotex file would have
+                tailLevel = levelCount;
+                while (tailLevel > 0 && mipmap_level_offset(x, y, comp, tailLevel) - levelOffsets[tailLevel - 1] < TEXFILE_PAGE_SIZE)
+                    --tailLevel;
+
+                // Mip levels are stored right after level 0 in the same allocation
+                double start = glfwGetTime();
+                if (!chainAllocated)
+                {
+                    // Out of memory fails the texture like a decode error
+                    unsigned char * chain = (unsigned char *) realloc(data, mipmap_chain_size(x, y, comp));
+                    if (!chain)
+                    {
+                        debug_print("Could not allocate the mips of %s", path.c_str());
+                        free(data);
+                    }
+                    data = chain;
+                }
+                if (data)
+                    mipmap_generate(data, x, y, comp, srgb);
+                mipmapMilliseconds = (glfwGetTime() - start) * 1000.0;
+            }
+        }
+
+        // The GL thread owns the texture state, it finds failures by null data pointers
+        mtx_lock(&tm.mutex);
+        Texture & texture = tm.textures[handle];
+        texture.data = data;
+        texture.file = file;
+        texture.width = x;
+        texture.height = y;
+        texture.components = comp;
+        texture.levelCount = levelCount;
+        texture.tailLevel = tailLevel;
+        texture.format = format;
+        texture.srgb = srgb;
+        memcpy(texture.levelOffsets, levelOffsets, sizeof(levelOffsets));
+        texture.mipmapMilliseconds = mipmapMilliseconds;
+        texture.uploadQueued = true;
+        tm.uploadQueue.push_back(handle);
+    }
+    mtx_unlock(&tm.mutex);
+    return 0;
+}
+
+void texture_manager_init(TextureManager & tm, int workerCount, int uploadBufferSize)
+{
+    mtx_init(&tm.mutex, mtx_plain);
+    cnd_init(&tm.condition);
+    tm.quit = false;
+    tm.workerCount = workerCount < TextureManager::MAX_WORKERS ? workerCount : TextureManager::MAX_WORKERS;
+    for (int i = 0; i < tm.workerCount; ++i)
+        thrd_create(&tm.workers[i], texture_worker, &tm);
+
+    // Grey checker shown until a texture is fully uploaded
+    unsigned char checker[] = { 96, 96, 96, 160, 160, 160, 160, 160, 160, 96, 96, 96 };
+    glGenTextures(1, &tm.placeholder);
+    glBindTexture(GL_TEXTURE_2D, tm.placeholder);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 2, 2, 0, GL_RGB, GL_UNSIGNED_BYTE, checker);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glGenTextures(1, &tm.placeholderArray);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tm.placeholderArray);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB8, 2, 2, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, checker);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // Ring of pixel unpack buffers, each one fenced until the GPU has consumed it
+    tm.uploadBufferSize = uploadBufferSize;
+    tm.currentUploadBuffer = 0;
+    glGenBuffers(TextureManager::UPLOAD_BUFFER_COUNT, tm.uploadBuffers);
+    for (int i = 0; i < TextureManager::UPLOAD_BUFFER_COUNT; ++i)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, tm.uploadBuffers[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, uploadBufferSize, 0, GL_STREAM_DRAW);
+        tm.uploadFences[i] = 0;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    tm.uploadedBytes = 0;
+    tm.readyCount = 0;
+    tm.frame = 0;
+    tm.budgetBytes = 32 * 1024 * 1024;
+    tm.residentBytes = 0;
+    tm.wantedBytes = 0;
+    tm.evictedBytes = 0;
+    tm.deferredLevels = 0;
+    tm.trace = false;
+
+    tm.maxAnisotropy = 1.f;
+    if (GLEW_EXT_texture_filter_anisotropic)
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &tm.maxAnisotropy);
+    tm.anisotropy = tm.maxAnisotropy < 8.f ? tm.maxAnisotropy : 8.f;
+
+    // RGTC is core since GL 3.0, S3TC and BPTC are extensions on a 4.1 context
+    tm.compressedFormats[TEXFILE_RGBA8] = true;
+    tm.compressedFormats[TEXFILE_BC1] = GLEW_EXT_texture_compression_s3tc != 0;
+    tm.compressedFormats[TEXFILE_BC3] = GLEW_EXT_texture_compression_s3tc != 0;
+    tm.compressedFormats[TEXFILE_BC4] = true;
+    tm.compressedFormats[TEXFILE_BC5] = true;
+    tm.compressedFormats[TEXFILE_BC7] = GLEW_ARB_texture_compression_bptc != 0;
+}
+
+void texture_manager_shutdown(TextureManager & tm)
+{
+    mtx_lock(&tm.mutex);
+    tm.quit = true;
+    cnd_broadcast(&tm.condition);
+    mtx_unlock(&tm.mutex);
+    for (int i = 0; i < tm.workerCount; ++i)
+        thrd_join(tm.workers[i], 0);
+
+    for (size_t i = 0; i < tm.textures.size(); ++i)
+    {
+        stbi_image_free(tm.textures[i].data);
+        tm.textures[i].data = 0;
+        mapped_file_close(tm.textures[i].file);
+        if (tm.textures[i].id)
+            glDeleteTextures(1, &tm.textures[i].id);
+    }
+    for (int i = 0; i < TextureManager::UPLOAD_BUFFER_COUNT; ++i)
+        if (tm.uploadFences[i])
+            glDeleteSync(tm.uploadFences[i]);
+    for (size_t i = 0; i < tm.arrays.size(); ++i)
+        glDeleteTextures(1, &tm.arrays[i].id);
+    tm.arrays.clear();
+    tm.packGroups.clear();
+    glDeleteBuffers(TextureManager::UPLOAD_BUFFER_COUNT, tm.uploadBuffers);
+    glDeleteTextures(1, &tm.placeholder);
+    glDeleteTextures(1, &tm.placeholderArray);
+    cnd_destroy(&tm.condition);
+    mtx_destroy(&tm.mutex);
+}
+
+int texture_manager_load(TextureManager & tm, const char * path, int components, bool srgb)
+{
+    Texture texture;
+    texture.path = path;
+    texture.requestedComponents = components;
+    texture.srgb = srgb;
+    texture.state = TEXTURE_QUEUED;
+    texture.id = 0;
+    texture.width = 0;
+    texture.height = 0;
+    texture.components = 0;
+    texture.levelCount = 0;
+    texture.tailLevel = 0;
+    texture.format = -1;
+    texture.data = 0;
+    mapped_file_init(texture.file);
+    texture.residentLevel = 0;
+    texture.allocatedLevel = 0;
+    texture.requestedLevel = TEXFILE_MAX_LEVELS;
+    texture.pendingLevel = TEXFILE_MAX_LEVELS;
+    texture.lastUsedFrame = -1;
+    texture.uploadQueued = false;
+    texture.deferred = false;
+    texture.uploadedRows = 0;
+    texture.mipmapMilliseconds = 0.0;
+    texture.packed = false;
+    texture.array = -1;
+    texture.layer = 0;
+    texture.x = 0;
+    texture.y = 0;
+
+    mtx_lock(&tm.mutex);
+    int handle = (int) tm.textures.size();
+    tm.textures.push_back(texture);
+    tm.decodeQueue.push_back(handle);
+    cnd_signal(&tm.condition);
+    mtx_unlock(&tm.mutex);
+    return handle;
+}
+
+static const GLenum textureFormats[] = { 0, GL_RED, GL_RG, GL_RGB, GL_RGBA };
+static const GLenum textureInternalFormats[] = { 0, GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+// Shading and the framebuffer are in gamma space, so sRGB texels are
+// sampled as stored, like the decoded images. The flag only changes how
+// mips are filtered.
+static const GLenum textureCompressedFormats[TEXFILE_FORMAT_COUNT] = {
+    GL_RGBA8,
+    GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+    GL_COMPRESSED_RGBA_S3TC_DXT5_EXT,
+    GL_COMPRESSED_RED_RGTC1,
+    GL_COMPRESSED_RG_RGTC2,
+    GL_COMPRESSED_RGBA_BPTC_UNORM_ARB
+};
+
+GLenum texture_internal_format(const Texture & texture)
+{
+    if (texture.format > TEXFILE_RGBA8)
+        return textureCompressedFormats[texture.format];
+    return textureInternalFormats[texture.components];
+}
+
+size_t texture_level_size(const Texture & texture, int level)
+{
+    int w = texture.width >> level;
+    int h = texture.height >> level;
+    w = w > 0 ? w : 1;
+    h = h > 0 ? h : 1;
+    if (texture.format > TEXFILE_RGBA8)
+        return texfile_level_size(texture.format, w, h);
+    return (size_t) w * h * texture.components;
+}
+
+// Allocates storage for a level of the bound texture, or releases it by
+// respecifying the level as empty
+void texture_specify_level(const Texture & texture, int level, bool release)
+{
+    int w = texture.width >> level;
+    int h = texture.height >> level;
+    w = release ? 0 : (w > 0 ? w : 1);
+    h = release ? 0 : (h > 0 ? h : 1);
+    if (texture.format > TEXFILE_RGBA8)
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, texture_internal_format(texture), w, h, 0,
+                               release ? 0 : (GLsizei) texture_level_size(texture, level), 0);
+    else
+        glTexImage2D(GL_TEXTURE_2D, level, texture_internal_format(texture), w, h, 0, textureFormats[texture.components], GL_UNSIGNED_BYTE, 0);
+}
+
+int texture_target_level(const Texture & texture)
+{
+    if (texture.array >= 0)
+        return 0;
+    return texture.requestedLevel < texture.tailLevel ? texture.requestedLevel : texture.tailLevel;
+}
+
+bool texture_atlas_entry(const Texture & texture)
+{
+    return texture.format <= TEXFILE_RGBA8
+        && texture.width >= TEXTURE_ATLAS_PADDING && texture.width <= TEXTURE_ATLAS_MAX_ENTRY && (texture.width & (texture.width - 1)) == 0
+        && texture.height >= TEXTURE_ATLAS_PADDING && texture.height <= TEXTURE_ATLAS_MAX_ENTRY && (texture.height & (texture.height - 1)) == 0;
+}
+
+bool texture_taller(const Texture * a, const Texture * b)
+{
+    return a->height > b->height;
+}
+
+// Allocates every level of every layer of an array, its textures are then
+// uploaded like the others
+void texture_array_allocate(TextureManager & tm, TextureArray & array, const Texture & model)
+{
+    glGenTextures(1, &array.id);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.id);
+    GLenum internalFormat = texture_internal_format(model);
+    for (int level = 0; level < array.levelCount; ++level)
+    {
+        int w = array.width >> level;
+        int h = array.height >> level;
+        w = w > 0 ? w : 1;
+        h = h > 0 ? h : 1;
+        size_t size = array.format > TEXFILE_RGBA8 ? texfile_level_size(array.format, w, h) : (size_t) w * h * array.components;
+        if (array.format > TEXFILE_RGBA8)
+            glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat, w, h, array.layerCount, 0, (GLsizei) (size * array.layerCount), 0);
+        else
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat, w, h, array.layerCount, 0, textureFormats[array.components], GL_UNSIGNED_BYTE, 0);
+        tm.residentBytes += (int) (size * array.layerCount);
+    }
+    if (array.components == 1)
+    {
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_G, GL_RED);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_B, GL_RED);
+    }
+    // Atlas entries wrap in the shader, their padding holds the wrapped edges
+    GLenum wrap = array.atlas ? GL_CLAMP_TO_EDGE : GL_REPEAT;
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, array.levelCount - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, array.levelCount - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    if (tm.maxAnisotropy > 1.f)
+        glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, tm.anisotropy);
+    array.residentLevel = array.levelCount;
+    if (tm.trace)
+        fprintf(stderr, "texture stream: frame %d pack %d textures in a %s %dx%dx%d array (%d KB resident)\n", tm.frame, (int) array.textures.size(),
+                array.atlas ? "atlas" : "layer", array.width, array.height, array.layerCount, tm.residentBytes / 1024);
+}
+
+// Lays out the decoded textures of a pack group into new arrays, the ones
+// that failed to decode are left out
+void texture_manager_build_arrays(TextureManager & tm, const std::vector<int> & group)
+{
+    std::vector<Texture *> remaining;
+    for (size_t i = 0; i < group.size(); ++i)
+    {
+        Texture & texture = tm.textures[group[i]];
+        if (texture.data || texture.file.data)
+            remaining.push_back(&texture);
+    }
+    std::stable_sort(remaining.begin(), remaining.end(), texture_taller);
+    while (!remaining.empty())
+    {
+        // Atlas entries share an array with the same format, other textures
+        // with the same format and size
+        const Texture & model = *remaining[0];
+        TextureArray array;
+        array.atlas = texture_atlas_entry(model);
+        array.width = array.atlas ? TEXTURE_ATLAS_SIZE : model.width;
+        array.height = array.atlas ? TEXTURE_ATLAS_SIZE : model.height;
+        array.components = model.components;
+        array.format = model.format;
+        array.srgb = model.srgb;
+        array.levelCount = array.atlas ? TEXTURE_ATLAS_LEVELS : model.levelCount;
+        std::vector<Texture *> members;
+        std::vector<Texture *> others;
+        for (size_t i = 0; i < remaining.size(); ++i)
+        {
+            const Texture & texture = *remaining[i];
+            bool match = texture_internal_format(texture) == texture_internal_format(model) && texture_atlas_entry(texture) == array.atlas
+                && (array.atlas || (texture.width == model.width && texture.height == model.height && texture.levelCount == model.levelCount));
+            (match ? members : others).push_back(remaining[i]);
+        }
+        remaining.swap(others);
+
+        // Atlas entries are laid out on shelves from the tallest, on 8 texel
+        // boundaries since sizes and padding are multiples of 8
+        int x = 0, y = 0, shelfHeight = 0, layer = 0;
+        int arrayIndex = (int) tm.arrays.size();
+        for (size_t i = 0; i < members.size(); ++i)
+        {
+            Texture & texture = *members[i];
+            if (array.atlas)
+            {
+                int w = texture.width + 2 * TEXTURE_ATLAS_PADDING;
+                int h = texture.height + 2 * TEXTURE_ATLAS_PADDING;
+                if (x + w > TEXTURE_ATLAS_SIZE)
+                {
+                    x = 0;
+                    y += shelfHeight;
+                    shelfHeight = 0;
+                }
+                if (y + h > TEXTURE_ATLAS_SIZE)
+                {
+                    x = 0;
+                    y = 0;
+                    shelfHeight = 0;
+                    ++layer;
+                }
+                texture.x = x + TEXTURE_ATLAS_PADDING;
+                texture.y = y + TEXTURE_ATLAS_PADDING;
+                texture.layer = layer;
+                x += w;
+                shelfHeight = h > shelfHeight ? h : shelfHeight;
+            }
+            else
+                texture.layer = (int) i;
+            texture.array = arrayIndex;
+            array.textures.push_back((int) (&texture - &tm.textures[0]));
+        }
+        array.layerCount = array.atlas ? layer + 1 : (int) members.size();
+        texture_array_allocate(tm, array, model);
+        tm.arrays.push_back(array);
+    }
+}
+
+// Uploads rows of a level of a packed texture from the bound unpack buffer.
+// Atlas entries get the rows again in the wrapped copies around them, as far
+// as the padding goes.
+void texture_array_upload_rows(const TextureArray & array, const Texture & texture, int level, int row, int rows, int levelWidth, int levelHeight, int size)
+{
+    int x = texture.x >> level;
+    int y = texture.y >> level;
+    if (texture.format > TEXFILE_RGBA8)
+    {
+        int top = row * 4;
+        int h = rows * 4 < levelHeight - top ? rows * 4 : levelHeight - top;
+        glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, x, y + top, texture.layer, levelWidth, h, 1, texture_internal_format(texture), size, 0);
+        return;
+    }
+    int padding = array.atlas ? TEXTURE_ATLAS_PADDING >> level : 0;
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, levelWidth);
+    for (int j = -1; j <= 1; ++j)
+    {
+        for (int i = -1; i <= 1; ++i)
+        {
+            int left = x + i * levelWidth;
+            int top = y + j * levelHeight + row;
+            int x0 = left > x - padding ? left : x - padding;
+            int x1 = left + levelWidth < x + levelWidth + padding ? left + levelWidth : x + levelWidth + padding;
+            int y0 = top > y - padding ? top : y - padding;
+            int y1 = top + rows < y + levelHeight + padding ? top + rows : y + levelHeight + padding;
+            if (x0 >= x1 || y0 >= y1)
+                continue;
+            glPixelStorei(GL_UNPACK_SKIP_PIXELS, x0 - left);
+            glPixelStorei(GL_UNPACK_SKIP_ROWS, y0 - top);
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, x0, y0, texture.layer, x1 - x0, y1 - y0, 1, textureFormats[texture.components], GL_UNSIGNED_BYTE, 0);
+        }
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+}
+
+// Moves the base level of an array down to the level every layer has, its
+// textures are ready once each one has its smallest level
+void texture_array_level_uploaded(TextureManager & tm, TextureArray & array)
+{
+    int residentLevel = 0;
+    for (size_t i = 0; i < array.textures.size(); ++i)
+    {
+        const Texture & texture = tm.textures[array.textures[i]];
+        int level = texture.state == TEXTURE_QUEUED ? array.levelCount : texture.residentLevel;
+        residentLevel = level > residentLevel ? level : residentLevel;
+    }
+    if (residentLevel >= array.residentLevel)
+        return;
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.id);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, residentLevel);
+    if (array.residentLevel == array.levelCount)
+    {
+        for (size_t i = 0; i < array.textures.size(); ++i)
+            tm.textures[array.textures[i]].state = TEXTURE_READY;
+        tm.readyCount += (int) array.textures.size();
+    }
+    array.residentLevel = residentLevel;
+}
+
+// Frees the least recently used level that no current request needs,
+// returns false when nothing can be evicted
+bool texture_manager_evict(TextureManager & tm, int keep)
+{
+    int victim = -1;
+    for (size_t i = 0; i < tm.textures.size(); ++i)
+    {
+        const Texture & texture = tm.textures[i];
+        // Levels are evicted from the most detailed, never the mip tail nor a
+        // level that could not be streamed back
+        if ((int) i == keep || texture.state != TEXTURE_READY || texture.array >= 0 || texture.residentLevel >= texture.tailLevel
+            || texture.allocatedLevel != texture.residentLevel || texture.residentLevel >= texture.requestedLevel
+            || (!texture.data && !texture.file.data))
+            continue;
+        if (victim < 0 || texture.lastUsedFrame < tm.textures[victim].lastUsedFrame)
+            victim = (int) i;
+    }
+    if (victim < 0)
+        return false;
+
+    Texture & texture = tm.textures[victim];
+    int level = texture.residentLevel;
+    glBindTexture(GL_TEXTURE_2D, texture.id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level + 1);
+    texture_specify_level(texture, level, true);
+    texture.residentLevel = texture.allocatedLevel = level + 1;
+    tm.residentBytes -= (int) texture_level_size(texture, level);
+    tm.evictedBytes += (int) texture_level_size(texture, level);
+    if (tm.trace)
+        fprintf(stderr, "texture stream: frame %d evict %s level %d (%d KB resident)\n", tm.frame, texture.path.c_str(), level, tm.residentBytes / 1024);
+    return true;
+}
+
+void texture_manager_update(TextureManager & tm, int byteBudget)
+{
+    // Take the levels requested since the last update, textures that were not
+    // requested only keep their mip tail wanted
+    tm.wantedBytes = 0;
+    tm.evictedBytes = 0;
+    tm.deferredLevels = 0;
+    for (size_t i = 0; i < tm.textures.size(); ++i)
+    {
+        Texture & texture = tm.textures[i];
+        texture.requestedLevel = texture.lastUsedFrame == tm.frame ? texture.pendingLevel : TEXFILE_MAX_LEVELS;
+        texture.pendingLevel = TEXFILE_MAX_LEVELS;
+        if (texture.state != TEXTURE_READY)
+            continue;
+        int targetLevel = texture_target_level(texture);
+        for (int level = targetLevel; level < texture.levelCount; ++level)
+            tm.wantedBytes += (int) texture_level_size(texture, level);
+        if (targetLevel < texture.residentLevel)
+        {
+            mtx_lock(&tm.mutex);
+            if (!texture.uploadQueued)
+            {
+                texture.uploadQueued = true;
+                tm.uploadQueue.push_back((int) i);
+            }
+            mtx_unlock(&tm.mutex);
+        }
+    }
+    ++tm.frame;
+
+    // Pack the groups whose textures are all decoded, or failed to
+    for (size_t i = 0; i < tm.packGroups.size(); )
+    {
+        const std::vector<int> & group = tm.packGroups[i];
+        bool decoded = true;
+        mtx_lock(&tm.mutex);
+        for (size_t j = 0; j < group.size(); ++j)
+            decoded = decoded && (tm.textures[group[j]].uploadQueued || tm.textures[group[j]].state != TEXTURE_QUEUED);
+        mtx_unlock(&tm.mutex);
+        if (!decoded)
+        {
+            ++i;
+            continue;
+        }
+        texture_manager_build_arrays(tm, group);
+        tm.packGroups.erase(tm.packGroups.begin() + i);
+    }
+
+    tm.uploadedBytes = 0;
+    int waiting = 0;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    while (tm.uploadedBytes < byteBudget)
+    {
+        mtx_lock(&tm.mutex);
+        int handle = tm.uploadQueue.empty() ? -1 : tm.uploadQueue.front();
+        mtx_unlock(&tm.mutex);
+        if (handle < 0)
+            break;
+
+        // Skip this frame if the GPU still reads from the next staging buffer
+        GLsync & fence = tm.uploadFences[tm.currentUploadBuffer];
+        if (fence)
+        {
+            if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+                break;
+            glDeleteSync(fence);
+            fence = 0;
+        }
+
+        Texture & texture = tm.textures[handle];
+        if (!texture.data && !texture.file.data)
+        {
+            texture.state = TEXTURE_FAILED;
+            mtx_lock(&tm.mutex);
+            tm.uploadQueue.pop_front();
+            texture.uploadQueued = false;
+            mtx_unlock(&tm.mutex);
+            continue;
+        }
+
+        // Packed textures wait at the back of the queue for the rest of their group
+        if (texture.packed && texture.array < 0)
+        {
+            mtx_lock(&tm.mutex);
+            tm.uploadQueue.pop_front();
+            tm.uploadQueue.push_back(handle);
+            int queued = (int) tm.uploadQueue.size();
+            mtx_unlock(&tm.mutex);
+            if (++waiting >= queued)
+                break;
+            continue;
+        }
+
+        // Compressed levels are uploaded by rows of 4x4 blocks
+        bool compressed = texture.format > TEXFILE_RGBA8;
+        GLenum compressedFormat = compressed ? textureCompressedFormats[texture.format] : 0;
+
+        // Packed textures have their storage in the array, their levels are
+        // all uploaded
+        if (texture.state == TEXTURE_QUEUED && texture.array >= 0)
+        {
+            texture.residentLevel = tm.arrays[texture.array].levelCount;
+            texture.allocatedLevel = 0;
+            texture.uploadedRows = 0;
+            texture.state = TEXTURE_UPLOADING;
+        }
+
+        // Only the mip tail is allocated up front, it stays resident
+        if (texture.state == TEXTURE_QUEUED)
+        {
+            glGenTextures(1, &texture.id);
+            glBindTexture(GL_TEXTURE_2D, texture.id);
+            for (int level = texture.tailLevel; level < texture.levelCount; ++level)
+            {
+                texture_specify_level(texture, level, false);
+                tm.residentBytes += (int) texture_level_size(texture, level);
+            }
+            // Single channel maps are sampled as grey
+            if (texture.components == 1)
+            {
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_RED);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, texture.levelCount - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, texture.levelCount - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            if (tm.maxAnisotropy > 1.f)
+                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, tm.anisotropy);
+            texture.residentLevel = texture.levelCount;
+            texture.allocatedLevel = texture.tailLevel;
+            texture.uploadedRows = 0;
+            texture.state = TEXTURE_UPLOADING;
+        }
+
+        // Levels are uploaded from the smallest, the mip tail first then
+        // larger levels down to the requested one
+        int targetLevel = texture_target_level(texture);
+        bool done = texture.residentLevel <= targetLevel;
+        int level = texture.residentLevel - 1;
+
+        // A new level needs room in the budget, made by evicting levels nobody uses
+        if (!done && level < texture.allocatedLevel)
+        {
+            int size = (int) texture_level_size(texture, level);
+            while (tm.residentBytes + size > tm.budgetBytes && texture_manager_evict(tm, handle))
+                ;
+            if (tm.residentBytes + size > tm.budgetBytes)
+            {
+                ++tm.deferredLevels;
+                if (tm.trace && !texture.deferred)
+                    fprintf(stderr, "texture stream: frame %d defer %s level %d, budget full (%d/%d KB)\n",
+                            tm.frame, texture.path.c_str(), level, tm.residentBytes / 1024, tm.budgetBytes / 1024);
+                texture.deferred = true;
+                done = true;
+            }
+            else
+            {
+                glBindTexture(GL_TEXTURE_2D, texture.id);
+                texture_specify_level(texture, level, false);
+                texture.allocatedLevel = level;
+                texture.deferred = false;
+                tm.residentBytes += size;
+            }
+        }
+
+        if (done)
+        {
+            // Drop a level left half uploaded when the request changed
+            if (texture.allocatedLevel < texture.residentLevel)
+            {
+                glBindTexture(GL_TEXTURE_2D, texture.id);
+                texture_specify_level(texture, texture.allocatedLevel, true);
+                tm.residentBytes -= (int) texture_level_size(texture, texture.allocatedLevel);
+                texture.allocatedLevel = texture.residentLevel;
+                texture.uploadedRows = 0;
+            }
+            // Decoded images cannot be read again, they stay whole once level 0 is in
+            if (texture.residentLevel == 0)
+            {
+                stbi_image_free(texture.data);
+                texture.data = 0;
+            }
+            mtx_lock(&tm.mutex);
+            tm.uploadQueue.pop_front();
+            texture.uploadQueued = false;
+            mtx_unlock(&tm.mutex);
+            continue;
+        }
+
+        int levelWidth = texture.width >> level;
+        int levelHeight = texture.height >> level;
+        levelWidth = levelWidth > 0 ? levelWidth : 1;
+        levelHeight = levelHeight > 0 ? levelHeight : 1;
+        int rowSize = compressed ? (int) texfile_row_size(texture.format, levelWidth) : levelWidth * texture.components;
+        int rowCount = compressed ? (int) texfile_row_count(texture.format, levelHeight) : levelHeight;
+
+        // Read ahead the pages of a mapped level, they are only loaded when touched
+        if (texture.file.data && texture.uploadedRows == 0)
+            mapped_file_prefetch(texture.file, texture.levelOffsets[level], (size_t) rowSize * rowCount);
+
+        // As many rows as the budget and the staging buffer allow, at least one
+        int rows = (byteBudget - tm.uploadedBytes) / rowSize;
+        if (rows > tm.uploadBufferSize / rowSize)
+            rows = tm.uploadBufferSize / rowSize;
+        if (rows > rowCount - texture.uploadedRows)
+            rows = rowCount - texture.uploadedRows;
+        if (rows < 1)
+            rows = 1;
+        int size = rows * rowSize;
+        const unsigned char * source = (texture.file.data ? texture.file.data : texture.data)
+            + texture.levelOffsets[level] + (size_t) texture.uploadedRows * rowSize;
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, tm.uploadBuffers[tm.currentUploadBuffer]);
+        if (size > tm.uploadBufferSize)
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, 0, GL_STREAM_DRAW);
+        void * staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        memcpy(staging, source, size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        if (texture.array >= 0)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, tm.arrays[texture.array].id);
+            texture_array_upload_rows(tm.arrays[texture.array], texture, level, texture.uploadedRows, rows, levelWidth, levelHeight, size);
+        }
+        else if (compressed)
+        {
+            glBindTexture(GL_TEXTURE_2D, texture.id);
+            int y = texture.uploadedRows * 4;
+            int h = rows * 4 < levelHeight - y ? rows * 4 : levelHeight - y;
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, y, levelWidth, h, compressedFormat, size, 0);
+        }
+        else
+        {
+            glBindTexture(GL_TEXTURE_2D, texture.id);
+            glTexSubImage2D(GL_TEXTURE_2D, level, 0, texture.uploadedRows, levelWidth, rows, textureFormats[texture.components], GL_UNSIGNED_BYTE, 0);
+        }
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        tm.currentUploadBuffer = (tm.currentUploadBuffer + 1) % TextureManager::UPLOAD_BUFFER_COUNT;
+        tm.uploadedBytes += size;
+        texture.uploadedRows += rows;
+
+        // Only complete levels are sampled
+        if (texture.uploadedRows == rowCount)
+        {
+            texture.residentLevel = level;
+            texture.uploadedRows = 0;
+            if (texture.array >= 0)
+                texture_array_level_uploaded(tm, tm.arrays[texture.array]);
+            else
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+            if (texture.state == TEXTURE_UPLOADING && texture.array < 0 && level <= texture.tailLevel)
+            {
+                texture.state = TEXTURE_READY;
+                ++tm.readyCount;
+            }
+            if (tm.trace && level < texture.tailLevel)
+                fprintf(stderr, "texture stream: frame %d load %s level %d (%d KB resident)\n", tm.frame, texture.path.c_str(), level, tm.residentBytes / 1024);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void texture_manager_request_level(TextureManager & tm, int handle, int level)
+{
+    Texture & texture = tm.textures[handle];
+    level = level > 0 ? level : 0;
+    if (level < texture.pendingLevel)
+        texture.pendingLevel = level;
+    texture.lastUsedFrame = tm.frame;
+}
+
+void texture_manager_request_footprint(TextureManager & tm, int handle, float uvPerPixel)
+{
+    // Level where a texel covers about a pixel, nothing is known before decoding
+    const Texture & texture = tm.textures[handle];
+    if (texture.state != TEXTURE_READY)
+        return;
+    float texelsPerPixel = uvPerPixel * (texture.width > texture.height ? texture.width : texture.height);
+    int level = texelsPerPixel > 1.f ? (int) floorf(log2f(texelsPerPixel)) : 0;
+    texture_manager_request_level(tm, handle, level);
+}
+
+void texture_manager_set_anisotropy(TextureManager & tm, float anisotropy)
+{
+    if (tm.maxAnisotropy <= 1.f)
+        return;
+    tm.anisotropy = anisotropy < tm.maxAnisotropy ? anisotropy : tm.maxAnisotropy;
+    for (size_t i = 0; i < tm.textures.size(); ++i)
+    {
+        if (!tm.textures[i].id)
+            continue;
+        glBindTexture(GL_TEXTURE_2D, tm.textures[i].id);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, tm.anisotropy);
+    }
+    for (size_t i = 0; i < tm.arrays.size(); ++i)
+    {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, tm.arrays[i].id);
+        glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, tm.anisotropy);
+    }
+}
+
+void texture_manager_pack(TextureManager & tm, int count, const int * handles)
+{
+    // Textures already uploading keep their own storage
+    std::vector<int> group;
+    for (int i = 0; i < count; ++i)
+    {
+        Texture & texture = tm.textures[handles[i]];
+        if (texture.state != TEXTURE_QUEUED || texture.packed)
+            continue;
+        texture.packed = true;
+        group.push_back(handles[i]);
+    }
+    if (!group.empty())
+        tm.packGroups.push_back(group);
+}
+
+GLenum texture_manager_target(const TextureManager & tm, int handle)
+{
+    return tm.textures[handle].packed ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+}
+
+void texture_manager_placement(const TextureManager & tm, int handle, glm::vec4 & rect, int & layer)
+{
+    // Whole layers until a packed texture has its place
+    const Texture & texture = tm.textures[handle];
+    rect = glm::vec4(1.f, 1.f, 0.f, 0.f);
+    layer = 0;
+    if (texture.array < 0)
+        return;
+    const TextureArray & array = tm.arrays[texture.array];
+    if (array.atlas)
+        rect = glm::vec4(texture.width, texture.height, texture.x, texture.y) / (float) TEXTURE_ATLAS_SIZE;
+    layer = texture.layer;
+}
+
+GLuint texture_manager_texture(const TextureManager & tm, int handle)
+{
+    const Texture & texture = tm.textures[handle];
+    if (texture.packed)
+        return texture.state == TEXTURE_READY ? tm.arrays[texture.array].id : tm.placeholderArray;
+    return texture.state == TEXTURE_READY ? texture.id : tm.placeholder;
+}
+
+void material_manager_init(MaterialManager & mm)
+{
+    glGenBuffers(1, &mm.buffer);
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    mm.sliceSize = ((int) sizeof(MaterialParameters) + alignment - 1) / alignment * alignment;
+    mm.capacity = 0;
+    mm.dirty = false;
+    mm.multiBind = GLEW_ARB_multi_bind != 0;
+    mm.boundMaterial = -1;
+    mm.materialBinds = 0;
+    mm.textureBinds = 0;
+}
+
+void material_manager_shutdown(MaterialManager & mm)
+{
+    glDeleteBuffers(1, &mm.buffer);
+    mm.materials.clear();
+}
+
+int material_manager_add(MaterialManager & mm, const char * name, const MaterialParameters & parameters, int textureCount, const int * textures)
+{
+    Material material;
+    material.name = name;
+    material.parameters = parameters;
+    material.textureCount = textureCount < MATERIAL_MAX_TEXTURES ? textureCount : MATERIAL_MAX_TEXTURES;
+    for (int i = 0; i < material.textureCount; ++i)
+        material.textures[i] = textures[i];
+    for (int i = 0; i < MATERIAL_MAX_TEXTURES; ++i)
+        material.parameters.textureRects[i] = glm::vec4(1.f, 1.f, 0.f, 0.f);
+    material.parameters.textureLayers = glm::vec4(0.f);
+    mm.materials.push_back(material);
+    mm.dirty = true;
+    return (int) mm.materials.size() - 1;
+}
+
+void material_manager_set(MaterialManager & mm, int material, const MaterialParameters & parameters)
+{
+    // Texture placements are kept, they belong to the texture manager
+    MaterialParameters & current = mm.materials[material].parameters;
+    MaterialParameters changed = parameters;
+    for (int i = 0; i < MATERIAL_MAX_TEXTURES; ++i)
+        changed.textureRects[i] = current.textureRects[i];
+    changed.textureLayers = current.textureLayers;
+    if (memcmp(&current, &changed, sizeof(MaterialParameters)) == 0)
+        return;
+    current = changed;
+    mm.dirty = true;
+}
+
+void material_manager_update(MaterialManager & mm, const TextureManager & tm)
+{
+    // Packed textures get their place in an array once decoded
+    for (size_t i = 0; i < mm.materials.size(); ++i)
+    {
+        Material & material = mm.materials[i];
+        for (int j = 0; j < material.textureCount; ++j)
+        {
+            glm::vec4 rect;
+            int layer;
+            texture_manager_placement(tm, material.textures[j], rect, layer);
+            if (rect != material.parameters.textureRects[j] || (float) layer != material.parameters.textureLayers[j])
+            {
+                material.parameters.textureRects[j] = rect;
+                material.parameters.textureLayers[j] = (float) layer;
+                mm.dirty = true;
+            }
+        }
+    }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, mm.buffer);
+    if (mm.dirty)
+    {
+        // Reallocated when materials were added, all slices are rewritten anyway
+        int count = (int) mm.materials.size();
+        if (count > mm.capacity)
+        {
+            mm.capacity = count * 2;
+            glBufferData(GL_UNIFORM_BUFFER, mm.capacity * mm.sliceSize, 0, GL_DYNAMIC_DRAW);
+        }
+        std::vector<unsigned char> slices(count * mm.sliceSize);
+        for (int i = 0; i < count; ++i)
+            memcpy(&slices[i * mm.sliceSize], &mm.materials[i].parameters, sizeof(MaterialParameters));
+        if (count)
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, count * mm.sliceSize, &slices[0]);
+        mm.dirty = false;
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    for (int i = 0; i < MATERIAL_MAX_TEXTURES; ++i)
+        mm.boundTextures[i] = ~0u;
+    mm.boundMaterial = -1;
+    mm.materialBinds = 0;
+    mm.textureBinds = 0;
+}
+
+void material_manager_bind(MaterialManager & mm, const TextureManager & tm, int material)
+{
+    if (material == mm.boundMaterial)
+        return;
+    const Material & m = mm.materials[material];
+    glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK_BINDING, mm.buffer, material * mm.sliceSize, sizeof(MaterialParameters));
+
+    // Placeholders stand in for textures still streaming, the set may change from frame to frame
+    GLuint textures[MATERIAL_MAX_TEXTURES];
+    int first = m.textureCount;
+    int last = -1;
+    for (int i = 0; i < m.textureCount; ++i)
+    {
+        textures[i] = texture_manager_texture(tm, m.textures[i]);
+        if (textures[i] != mm.boundTextures[i])
+        {
+            first = i < first ? i : first;
+            last = i;
+        }
+    }
+    if (mm.multiBind && last >= first)
+    {
+        glBindTextures(first, last - first + 1, textures + first);
+        for (int i = first; i <= last; ++i)
+            mm.boundTextures[i] = textures[i];
+        mm.textureBinds += last - first + 1;
+    }
+    else
+    {
+        for (int i = first; i <= last; ++i)
+        {
+            if (textures[i] == mm.boundTextures[i])
+                continue;
+            glActiveTexture(GL_TEXTURE0 + i);
+            glBindTexture(texture_manager_target(tm, m.textures[i]), textures[i]);
+            mm.boundTextures[i] = textures[i];
+            ++mm.textureBinds;
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+    mm.boundMaterial = material;
+    ++mm.materialBinds;
+}
+
+unsigned int material_manager_array_mask(const MaterialManager & mm, const TextureManager & tm, int material)
+{
+    const Material & m = mm.materials[material];
+    unsigned int mask = 0;
+    for (int i = 0; i < m.textureCount; ++i)
+        if (texture_manager_target(tm, m.textures[i]) == GL_TEXTURE_2D_ARRAY)
+            mask |= 1u << i;
+    return mask;
+}
+
+void camera_compute(Camera & c)
+{
+    c.eye.x = cos(c.theta) * sin(c.phi) * c.radius + c.o.x;   
+    c.eye.y = cos(c.phi) * c.radius + c.o.y ;
+    c.eye.z = sin(c.theta) * sin(c.phi) * c.radius + c.o.z;   
+    c.up = glm::vec3(0.f, c.phi < M_PI ?1.f:-1.f, 0.f);
+}
+
+void camera_defaults(Camera & c)
+{
+    c.phi = 3.14/2.f;
+    c.theta = 3.14/2.f;
+    c.radius = 10.f;
+    camera_compute(c);
+}
+
+void camera_zoom(Camera & c, float factor)
+{
+    c.radius += factor * c.radius ;
+    if (c.radius < 0.1)
+    {
+        c.radius = 10.f;
+        c.o = c.eye + glm::normalize(c.o - c.eye) * c.radius;
+    }
+    camera_compute(c);
+}
+
+void camera_turn(Camera & c, float phi, float theta)
+{
+    c.theta += 1.f * theta;
+    c.phi   -= 1.f * phi;
+    if (c.phi >= (2 * M_PI) - 0.1 )
+        c.phi = 0.00001;
+    else if (c.phi <= 0 )
+        c.phi = 2 * M_PI - 0.1;
+    camera_compute(c);
+}
+
+void camera_pan(Camera & c, float x, float y)
+{
+    glm::vec3 up(0.f, c.phi < M_PI ?1.f:-1.f, 0.f);
+    glm::vec3 fwd = glm::normalize(c.o - c.eye);
+    glm::vec3 side = glm::normalize(glm::cross(fwd, up));
+    c.up = glm::normalize(glm::cross(side, fwd));
+    c.o[0] += up[0] * y * c.radius * 2;
+    c.o[1] += up[1] * y * c.radius * 2;
+    c.o[2] += up[2] * y * c.radius * 2;
+    c.o[0] -= side[0] * x * c.radius * 2;
+    c.o[1] -= side[1] * x * c.radius * 2;
+    c.o[2] -= side[2] * x * c.radius * 2;       
+    camera_compute(c);
+}
+
+void init_gui_states(GUIStates & guiStates)
+{
+    guiStates.panLock = false;
     guiStates.turnLock = false;
     guiStates.zoomLock = false;
     guiStates.lockPositionX = 0;
@@ -643,3 +3484,33 @@ void init_gui_states(GUIStates & guiStates)
     guiStates.time = 0.0;
     guiStates.playing = false;
 }
+
+// Maps an .aotex file and checks its header and level table, level data is
+// left untouched until uploaded
+bool open_texfile(MappedFile & file, const char * path, TexFileHeader & header, TexFileLevel * levels)
+{
+    if (!mapped_file_open(file, path))
+        return false;
+    bool valid = file.size >= sizeof(TexFileHeader);
+    if (valid)
+    {
+        memcpy(&header, file.data, sizeof(TexFileHeader));
+        valid = memcmp(header.magic, TEXFILE_MAGIC, 4) == 0 && header.version == TEXFILE_VERSION
+            && header.format < TEXFILE_FORMAT_COUNT && header.levelCount > 0 && header.levelCount <= TEXFILE_MAX_LEVELS
+            && header.tailLevel <= header.levelCount
+            && sizeof(TexFileHeader) + header.levelCount * sizeof(TexFileLevel) <= file.size;
+    }
+    if (valid)
+    {
+        memcpy(levels, file.data + sizeof(TexFileHeader), header.levelCount * sizeof(TexFileLevel));
+        for (unsigned int i = 0; i < header.levelCount && valid; ++i)
+            valid = levels[i].offset + levels[i].size <= (unsigned long long) file.size
+                && levels[i].size == texfile_level_size(header.format, levels[i].width, levels[i].height);
+    }
+    if (!valid)
+    {
+        debug_print("Invalid texture file %s, rebuild it with aotex", path);
+        mapped_file_close(file);
+    }
+    return valid;
+}
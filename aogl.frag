@@ -1,69 +1,117 @@
 #version 410 core
 
 #define FRAG_COLOR	0
+#define FRAG_VELOCITY	1
 
 precision highp int;
 
+// Textures packed into an array sample a layer of it, the others are plain 2D textures
+#pragma keyword DIFFUSE_ARRAY
+#pragma keyword SPECULAIRE_ARRAY
+
+#if defined(DIFFUSE_ARRAY)
+uniform sampler2DArray Diffuse;
+#else
 uniform sampler2D Diffuse;
+#endif
+#if defined(SPECULAIRE_ARRAY)
+uniform sampler2DArray Speculaire;
+#else
 uniform sampler2D Speculaire;
+#endif
 uniform vec3 CameraPosition;
 
+// Material parameters, one slice of the material buffer per material
+layout(std140) uniform Material
+{
+	vec4 Tint;
+	float SpecularPower;
+	float SpecularMix;
+	vec4 TextureRects[4]; // Scale and offset in the layer, atlas entries are a part of it
+	vec4 TextureLayers;
+};
+
+vec4 sample_material(sampler2DArray tex, int i, vec2 uv)
+{
+	// Wrapped by hand, the gradients of the unwrapped coordinates keep the
+	// level selection continuous across the seams
+	vec4 rect = TextureRects[i];
+	return textureGrad(tex, vec3(rect.zw + fract(uv) * rect.xy, TextureLayers[i]), dFdx(uv) * rect.xy, dFdy(uv) * rect.xy);
+}
+
+vec4 sample_material(sampler2D tex, int i, vec2 uv)
+{
+	return texture(tex, uv);
+}
+
 layout(location = FRAG_COLOR, index = 0) out vec4 FragColor;
+layout(location = FRAG_VELOCITY, index = 0) out vec2 FragVelocity;
 
 in block
 {
-	vec2 TexCoord;
-	vec3 Normal;
-	vec3 Position;
+#include "scene_block.glsl"
 } In;
 
+// Shading model, one variant each
+#pragma keyword SHADING_SPECULAR SHADING_LAMBERT SHADING_PROCEDURAL SHADING_NORMAL SHADING_POSITION SHADING_TEXCOORD SHADING_RED
+
 void main()
 {
+#if defined(SHADING_RED)
 	/// Simple Red
-	// FragColor = vec4(0.5, 0.1, 0.1, 1.);
+	FragColor = vec4(0.5, 0.1, 0.1, 1.);
 
+#elif defined(SHADING_NORMAL)
 	/// Normal
-	//FragColor = In.Normal;
+	FragColor = vec4(In.Normal, 1);
 
+#elif defined(SHADING_POSITION)
 	/// Position
-	//FragColor = vec4(vec3(In.Position), 0);
-	
+	FragColor = vec4(vec3(In.Position), 0);
+
+#elif defined(SHADING_TEXCOORD)
 	/// TexCoord
-	// FragColor = vec4(vec2(In.TexCoord), 0, 1);
+	FragColor = vec4(vec2(In.TexCoord), 0, 1);
 
+#elif defined(SHADING_PROCEDURAL)
 	/// Procedural texture
-	// float tex = smoothstep(0.3, 0.32, length(fract(5.0*In.TexCoord)-0.5)) * In.Position.x;
+	float tex = smoothstep(0.3, 0.32, length(fract(5.0*In.TexCoord)-0.5)) * In.Position.x;
 
-	// FragColor = vec4(0.8, 0.2, 0.3, 1) - tex;
+	FragColor = vec4(0.8, 0.2, 0.3, 1) - tex;
 
+#elif defined(SHADING_LAMBERT)
 	/// Texture mix + Illumination
-	// vec3 Light = vec3(0, 4, 20);
+	vec3 Light = vec3(0, 4, 20);
 
-	// vec3 diffuse = texture(Diffuse, In.TexCoord).rgb;
-	// vec3 speculaire = texture(Speculaire, In.TexCoord).rgb;
-	// // vec3 diffuseColor = mix(diffuse, speculaire, 0.5);
+	vec3 diffuse = sample_material(Diffuse, 0, In.TexCoord).rgb;
+	vec3 speculaire = sample_material(Speculaire, 1, In.TexCoord).rgb;
+	// vec3 diffuseColor = mix(diffuse, speculaire, 0.5);
 
-	// vec3 l = normalize(Light - In.Position);
+	vec3 l = normalize(Light - In.Position);
 
-	// float ndotl =  clamp(dot(In.Normal, l), 0.0, 1.0);
-	// vec3 color = diffuse * ndotl;
+	float ndotl =  clamp(dot(In.Normal, l), 0.0, 1.0);
+	vec3 color = diffuse * ndotl * Tint.rgb;
 	
-	// FragColor = vec4(color, 1);
+	FragColor = vec4(color, 1);
 
+#else
 	/// Tex + specular
 	vec3 Light = vec3(0, 4, 20);
-	float specularPower = 10;
 
-	vec3 diffuse = texture(Diffuse, In.TexCoord).rgb;
-	vec3 speculaire = texture(Speculaire, In.TexCoord).rgb;
+	vec3 diffuse = sample_material(Diffuse, 0, In.TexCoord).rgb;
+	vec3 speculaire = sample_material(Speculaire, 1, In.TexCoord).rgb;
 
 	vec3 v = normalize(CameraPosition - In.Position);
 	vec3 l = normalize(Light - In.Position);
 	vec3 h = normalize(l + v);
 	float ndoth =  clamp(dot(In.Normal, h), 0.0, 1.0);
-	vec3 specularColor =  speculaire * pow(ndoth, specularPower);
+	vec3 specularColor =  speculaire * pow(ndoth, SpecularPower);
 
-	vec3 finalColor = mix(diffuse, specularColor, 0.5);
+	vec3 finalColor = mix(diffuse, specularColor, SpecularMix) * Tint.rgb;
 
 	FragColor = vec4(finalColor, 1);
+#endif
+
+	/// Screen space motion since last frame, in texture coordinates
+	FragVelocity = (In.ClipPosition.xy / In.ClipPosition.w - In.PrevClipPosition.xy / In.PrevClipPosition.w) * 0.5;
 }
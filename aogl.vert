@@ -4,12 +4,17 @@
 #define NORMAL		1
 #define TEXCOORD	2
 
+// Spinning and stretching instances, the cubes
+#pragma keyword ANIMATED
+
 precision highp float;
 precision highp int;
 
 uniform mat4 MVP;
+uniform mat4 PrevMVP;
+uniform vec2 Jitter;
 uniform float Time;
-uniform int Object;
+uniform float PrevTime;
 
 layout(location = POSITION) in vec3 Position;
 layout(location = NORMAL) in vec3 Normal;
@@ -22,43 +27,55 @@ out gl_PerVertex
 
 out block
 {
-	vec2 TexCoord;
-	vec3 Normal;
-	vec3 Position;
+#include "scene_block.glsl"
 } Out;
 
+vec3 animate(vec3 p, float time)
+{
+	vec3 pos = p;
+
+#ifdef ANIMATED
+	pos.x = p.x * cos(time) - p.z * sin(time);
+	pos.y = p.y;
+	pos.z = p.x * sin(time) + p.z * cos(time);
+
+	pos.x += gl_InstanceID - (10/2);
+	pos.y *= 1 / cos(time*gl_InstanceID/2);
+#endif
+	return pos;
+}
+
 void main()
 {	
-	vec3 pos = Position;
+	vec3 pos = animate(Position, Time);
 	vec3 normal = Normal;
 
-	if(Object == 0){
-		pos.x = Position.x * cos(Time) - Position.z * sin(Time);
-		pos.y = Position.y;
-		pos.z = Position.x * sin(Time) + Position.z * cos(Time);
-
-		normal.x = Normal.x * cos(Time) - Normal.z * sin(Time);
-		normal.y = Normal.y;
-		normal.z = Normal.x * sin(Time) + Normal.z * cos(Time);
+#ifdef ANIMATED
+	normal.x = Normal.x * cos(Time) - Normal.z * sin(Time);
+	normal.y = Normal.y;
+	normal.z = Normal.x * sin(Time) + Normal.z * cos(Time);
 
-		// if(gl_VertexID == 0 || gl_VertexID == 1 || gl_VertexID == 2 || gl_VertexID == 3) pos.y *= 1 / cos(Time);
-		// if(gl_VertexID == 4 || gl_VertexID == 5 || gl_VertexID == 6 || gl_VertexID == 7) pos.y *= 1 / cos(Time);
-		// if(gl_VertexID == 8 || gl_VertexID == 9 || gl_VertexID == 10 || gl_VertexID == 11) pos.y *= 1 / cos(Time);
-		// if(gl_VertexID == 12 || gl_VertexID == 13 || gl_VertexID == 14 || gl_VertexID == 15) pos.y *= 1 / cos(Time);
-		// if(gl_VertexID == 16 || gl_VertexID == 17 || gl_VertexID == 18 || gl_VertexID == 19) pos.y *= 1 / cos(Time);	
-		// if(gl_VertexID == 20 || gl_VertexID == 21 || gl_VertexID == 22 || gl_VertexID == 23) pos.y *= 1 / cos(Time);
-		// if(gl_VertexID == 24 || gl_VertexID == 25 || gl_VertexID == 26 || gl_VertexID == 27) pos.y *= 1 / cos(Time);
+	// if(gl_VertexID == 0 || gl_VertexID == 1 || gl_VertexID == 2 || gl_VertexID == 3) pos.y *= 1 / cos(Time);
+	// if(gl_VertexID == 4 || gl_VertexID == 5 || gl_VertexID == 6 || gl_VertexID == 7) pos.y *= 1 / cos(Time);
+	// if(gl_VertexID == 8 || gl_VertexID == 9 || gl_VertexID == 10 || gl_VertexID == 11) pos.y *= 1 / cos(Time);
+	// if(gl_VertexID == 12 || gl_VertexID == 13 || gl_VertexID == 14 || gl_VertexID == 15) pos.y *= 1 / cos(Time);
+	// if(gl_VertexID == 16 || gl_VertexID == 17 || gl_VertexID == 18 || gl_VertexID == 19) pos.y *= 1 / cos(Time);	
+	// if(gl_VertexID == 20 || gl_VertexID == 21 || gl_VertexID == 22 || gl_VertexID == 23) pos.y *= 1 / cos(Time);
+	// if(gl_VertexID == 24 || gl_VertexID == 25 || gl_VertexID == 26 || gl_VertexID == 27) pos.y *= 1 / cos(Time);
 
-		pos.x += gl_InstanceID - (10/2);
-		pos.y *= 1 / cos(Time*gl_InstanceID/2);
-
-		normal.x += gl_InstanceID - (10/2);
-		normal.y *= 1 / cos(Time*gl_InstanceID/2);
-	}
+	normal.x += gl_InstanceID - (10/2);
+	normal.y *= 1 / cos(Time*gl_InstanceID/2);
+#endif
 
 	Out.TexCoord = TexCoord;
 	Out.Normal = normal;
 	Out.Position = pos;
 
-	gl_Position = MVP * vec4(pos, 1.0);
+	// Unjittered positions of this frame and the previous one, for motion vectors
+	Out.ClipPosition = MVP * vec4(pos, 1.0);
+	Out.PrevClipPosition = PrevMVP * vec4(animate(Position, PrevTime), 1.0);
+
+	// Sub-pixel offset for temporal anti-aliasing
+	gl_Position = Out.ClipPosition;
+	gl_Position.xy += Jitter * gl_Position.w;
 }
\ No newline at end of file
@@ -0,0 +1,280 @@
+// aotex : converts images into block compressed .aotex textures, with their
+// full mip chain, next to the source images.
+//
+//  usage : aotex [-bc7] [-j threads] <image or directory> ...
+//
+// The format follows the texture name : *_spec images become BC4, *_bump and
+// *_normal images become BC5 (grey height maps are turned into normal maps
+// first), everything else is BC1, or BC3 when it has alpha. -bc7 encodes color
+// textures as BC7 instead. Images are converted on as many threads as there
+// are cores, or on the number given with -j.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <thread>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "stb/stb_image.h"
+#include "stb/stb_image_batch.h"
+#include "common/mipmap.h"
+#include "common/bc.h"
+#include "common/texfile.h"
+
+bool has_suffix(const std::string & name, const char * suffix)
+{
+    std::string base = name.substr(0, name.rfind('.'));
+    size_t length = strlen(suffix);
+    return base.size() >= length && base.compare(base.size() - length, length, suffix) == 0;
+}
+
+bool is_image(const std::string & name)
+{
+    const char * extensions[] = { ".tga", ".png", ".jpg", ".jpeg", ".bmp", ".psd", ".gif" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+        return false;
+    std::string extension = name.substr(dot);
+    for (size_t i = 0; i < extension.size(); ++i)
+        extension[i] = (char) tolower(extension[i]);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+        if (extension == extensions[i])
+            return true;
+    return false;
+}
+
+void list_images(const std::string & directory, std::vector<std::string> & images)
+{
+#ifdef _WIN32
+    struct _finddata_t entry;
+    intptr_t handle = _findfirst((directory + "/*").c_str(), &entry);
+    if (handle == -1)
+        return;
+    do
+    {
+        if (is_image(entry.name))
+            images.push_back(directory + "/" + entry.name);
+    } while (_findnext(handle, &entry) == 0);
+    _findclose(handle);
+#else
+    DIR * dir = opendir(directory.c_str());
+    if (!dir)
+        return;
+    while (struct dirent * entry = readdir(dir))
+        if (is_image(entry->d_name))
+            images.push_back(directory + "/" + entry->d_name);
+    closedir(dir);
+#endif
+}
+
+bool is_directory(const char * path)
+{
+#ifdef _WIN32
+    struct _finddata_t entry;
+    intptr_t handle = _findfirst(path, &entry);
+    if (handle == -1)
+        return false;
+    _findclose(handle);
+    return (entry.attrib & _A_SUBDIR) != 0;
+#else
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+// Tangent space normals from a height map stored in the red channel
+void height_to_normal(unsigned char * rgba, int width, int height, float strength)
+{
+    std::vector<unsigned char> heights(width * height);
+    for (int i = 0; i < width * height; ++i)
+        heights[i] = rgba[i * 4];
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            // Sobel filter, wrapping around like the texture does
+            int h[3][3];
+            for (int j = 0; j < 3; ++j)
+                for (int i = 0; i < 3; ++i)
+                    h[j][i] = heights[((y + j - 1 + height) % height) * width + (x + i - 1 + width) % width];
+            float dx = (h[0][2] + 2 * h[1][2] + h[2][2]) - (h[0][0] + 2 * h[1][0] + h[2][0]);
+            float dy = (h[2][0] + 2 * h[2][1] + h[2][2]) - (h[0][0] + 2 * h[0][1] + h[0][2]);
+            float n[3] = { -dx * strength / 255.f, -dy * strength / 255.f, 1.f };
+            float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            unsigned char * out = rgba + (y * width + x) * 4;
+            for (int c = 0; c < 3; ++c)
+                out[c] = (unsigned char) ((n[c] / length * 0.5f + 0.5f) * 255.f + 0.5f);
+            out[3] = 255;
+        }
+    }
+}
+
+// Takes ownership of rgba
+bool convert(const std::string & path, unsigned char * rgba, int width, int height, int components, bool bc7)
+{
+    bool hasAlpha = false;
+    for (int i = 0; i < width * height && components == 4; ++i)
+        hasAlpha = hasAlpha || rgba[i * 4 + 3] != 255;
+
+    TexFileFormat format;
+    bc_encode_block_func encode;
+    unsigned int flags = 0;
+    if (has_suffix(path, "_spec"))
+    {
+        format = TEXFILE_BC4;
+        encode = bc4_encode_block;
+    }
+    else if (has_suffix(path, "_bump") || has_suffix(path, "_normal"))
+    {
+        if (components < 3)
+            height_to_normal(rgba, width, height, 2.f);
+        format = TEXFILE_BC5;
+        encode = bc5_encode_block;
+    }
+    else
+    {
+        format = bc7 ? TEXFILE_BC7 : (hasAlpha ? TEXFILE_BC3 : TEXFILE_BC1);
+        encode = bc7 ? bc7_encode_block : (hasAlpha ? bc3_encode_block : bc1_encode_block);
+        flags |= TEXFILE_SRGB;
+    }
+
+    // Mips are filtered before compression, color in linear space
+    unsigned char * chain = (unsigned char *) realloc(rgba, mipmap_chain_size(width, height, 4));
+    if (!chain)
+    {
+        fprintf(stderr, "Could not allocate the mips of %s\n", path.c_str());
+        stbi_image_free(rgba);
+        return false;
+    }
+    mipmap_generate(chain, width, height, 4, (flags & TEXFILE_SRGB) != 0);
+
+    TexFileHeader header;
+    memcpy(header.magic, TEXFILE_MAGIC, 4);
+    header.version = TEXFILE_VERSION;
+    header.format = format;
+    header.flags = flags;
+    header.width = width;
+    header.height = height;
+    header.levelCount = mipmap_level_count(width, height);
+    if (header.levelCount > TEXFILE_MAX_LEVELS)
+        header.levelCount = TEXFILE_MAX_LEVELS;
+
+    TexFileLevel levels[TEXFILE_MAX_LEVELS];
+    for (unsigned int l = 0; l < header.levelCount; ++l)
+    {
+        levels[l].width = width > (1 << l) ? width >> l : 1;
+        levels[l].height = height > (1 << l) ? height >> l : 1;
+        levels[l].size = texfile_level_size(format, levels[l].width, levels[l].height);
+    }
+
+    // The mip tail is packed right after the level table, larger levels
+    // are page aligned
+    header.tailLevel = header.levelCount;
+    while (header.tailLevel > 0 && levels[header.tailLevel - 1].size < TEXFILE_PAGE_SIZE)
+        --header.tailLevel;
+    size_t tableEnd = sizeof(TexFileHeader) + header.levelCount * sizeof(TexFileLevel);
+    size_t offset = tableEnd;
+    for (int l = (int) header.levelCount - 1; l >= 0; --l)
+    {
+        if (l < (int) header.tailLevel)
+            offset = texfile_align(offset);
+        levels[l].offset = offset;
+        offset += (size_t) levels[l].size;
+    }
+
+    std::vector<unsigned char> data(offset, 0);
+    unsigned char * out = &data[0];
+    for (unsigned int l = 0; l < header.levelCount; ++l)
+        bc_encode_image(encode, texfile_block_size(format), chain + mipmap_level_offset(width, height, 4, l),
+                        levels[l].width, levels[l].height, out + levels[l].offset);
+    stbi_image_free(chain);
+
+    std::string output = path.substr(0, path.rfind('.')) + TEXFILE_EXTENSION;
+    FILE * file = fopen(output.c_str(), "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Could not write %s\n", output.c_str());
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(levels, sizeof(TexFileLevel), header.levelCount, file);
+    fwrite(out + tableEnd, 1, data.size() - tableEnd, file);
+    fclose(file);
+
+    const char * formatNames[TEXFILE_FORMAT_COUNT] = { "RGBA8", "BC1", "BC3", "BC4", "BC5", "BC7" };
+    printf("%s -> %s (%s, %dx%d, %u levels, %u in the mip tail, %u KB)\n", path.c_str(), output.c_str(), formatNames[format],
+           width, height, header.levelCount, header.levelCount - header.tailLevel, (unsigned int) (offset / 1024));
+    return true;
+}
+
+struct Conversion
+{
+    std::string path;
+    bool bc7;
+    bool done;
+};
+
+// Runs on the thread that decoded the image
+void convert_loaded(const stbi_batch_item * item, int, stbi_batch_result * result)
+{
+    Conversion * conversion = (Conversion *) item->user;
+    if (!result->data)
+        fprintf(stderr, "Could not load %s : %s\n", conversion->path.c_str(), result->failure_reason);
+    else
+        conversion->done = convert(conversion->path, result->data, result->x, result->y, result->comp, conversion->bc7);
+}
+
+int main(int argc, char ** argv)
+{
+    bool bc7 = false;
+    int threads = (int) std::thread::hardware_concurrency();
+    std::vector<std::string> images;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-bc7") == 0)
+            bc7 = true;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (is_directory(argv[i]))
+            list_images(argv[i], images);
+        else
+            images.push_back(argv[i]);
+    }
+    if (images.empty())
+    {
+        fprintf(stderr, "usage : %s [-bc7] [-j threads] <image or directory> ...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (threads < 1)
+        threads = 1;
+
+    std::vector<Conversion> conversions(images.size());
+    std::vector<stbi_batch_item> items(images.size());
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        conversions[i].path = images[i];
+        conversions[i].bc7 = bc7;
+        conversions[i].done = false;
+        items[i].filename = conversions[i].path.c_str();
+        items[i].buffer = 0;
+        items[i].len = 0;
+        items[i].req_comp = 4;
+        items[i].user = &conversions[i];
+    }
+    stbi_load_batch(&items[0], (int) items.size(), threads, convert_loaded);
+
+    int failures = 0;
+    for (size_t i = 0; i < conversions.size(); ++i)
+        if (!conversions[i].done)
+            ++failures;
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
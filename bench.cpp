@@ -0,0 +1,1049 @@
+// bench : timings of the CPU side of the texture pipeline, each against the
+// straightforward version it replaces, with a check that both agree.
+//
+//  usage : bench [-n runs] [benchmark] ...
+//
+//  mipmap    mip chain generation of a 1024x1024 image, sRGB and linear,
+//            against a float reference
+//  jpeg      decoding of the diffuse texture encoded as a 4:2:0 and a 4:4:4
+//            JPEG, against the scalar IDCT and color conversion
+//  inflate   decompression of the zlib stream of the bump texture PNG,
+//            against the inflate stb_image had before
+//  batch     stbi_load_batch of 8 JPEGs and 8 PNGs from memory on 1 thread
+//            up to one per core, against the decodes of the calling thread
+//  rows      stbi_load_rows of the JPEGs, the PNG and the diffuse TGA for
+//            every req_comp, checked row for row against stbi_load
+//
+// Every benchmark runs when none is named. Times are the best of the runs,
+// and the exit code is an error when a check fails. Run it from the
+// repository root, the test images come from textures/.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "common/mipmap.h"
+#include "stb/stb_image.h"
+#include "stb/stb_image_batch.h"
+
+static int g_runs = 5;
+
+double now_milliseconds()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename Function>
+double best_milliseconds(Function function)
+{
+    double best = 1e9;
+    for (int run = 0; run < g_runs; ++run)
+    {
+        double start = now_milliseconds();
+        function();
+        double time = now_milliseconds() - start;
+        best = time < best ? time : best;
+    }
+    return best;
+}
+
+// Noise with some structure, so that filtering has something to average
+void fill_image(unsigned char * pixels, int width, int height, int components)
+{
+    unsigned int seed = 12345;
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            for (int c = 0; c < components; ++c)
+            {
+                seed = seed * 1664525u + 1013904223u;
+                int v = ((x ^ y) * (c + 3) & 0xff) / 2 + (int) (seed >> 25);
+                pixels[((size_t) y * width + x) * components + c] = (unsigned char) v;
+            }
+}
+
+bool read_file(const char * path, std::vector<unsigned char> & data)
+{
+    FILE * file = fopen(path, "rb");
+    if (!file)
+        return false;
+    data.clear();
+    unsigned char buffer[65536];
+    for (size_t read; (read = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+        data.insert(data.end(), buffer, buffer + read);
+    fclose(file);
+    return true;
+}
+
+// The diffuse texture of the scene as RGB, or noise when it is missing
+void test_image(std::vector<unsigned char> & rgb, int & width, int & height)
+{
+    int comp;
+    unsigned char * pixels = stbi_load("textures/spnza_bricks_a_diff.tga", &width, &height, &comp, 3);
+    if (pixels)
+    {
+        rgb.assign(pixels, pixels + (size_t) width * height * 3);
+        stbi_image_free(pixels);
+        return;
+    }
+    fprintf(stderr, "textures/spnza_bricks_a_diff.tga not found, using noise\n");
+    width = height = 1024;
+    rgb.resize((size_t) width * height * 3);
+    fill_image(&rgb[0], width, height, 3);
+}
+
+// Mip chain with a 2x2 box filter in float, through pow for the sRGB curve
+void mipmap_reference(unsigned char * chain, int width, int height, int components, bool srgb)
+{
+    int colorChannels = srgb ? (components == 2 || components == 4 ? components - 1 : components) : 0;
+    std::vector<float> work((size_t) width * height * components);
+    for (size_t i = 0; i < work.size(); ++i)
+    {
+        float v = chain[i] / 255.f;
+        bool color = (int) (i % components) < colorChannels;
+        work[i] = color ? (v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f)) : v;
+    }
+    int levelCount = mipmap_level_count(width, height);
+    unsigned char * level = chain;
+    for (int l = 1; l < levelCount; ++l)
+    {
+        level += (size_t) width * height * components;
+        int w = width > 1 ? width / 2 : 1;
+        int h = height > 1 ? height / 2 : 1;
+        std::vector<float> next((size_t) w * h * components);
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x)
+                for (int c = 0; c < components; ++c)
+                {
+                    int x0 = width > 1 ? 2 * x : x, x1 = width > 1 ? x0 + 1 : x0;
+                    int y0 = height > 1 ? 2 * y : y, y1 = height > 1 ? y0 + 1 : y0;
+                    float v = (work[((size_t) y0 * width + x0) * components + c] + work[((size_t) y0 * width + x1) * components + c]
+                             + work[((size_t) y1 * width + x0) * components + c] + work[((size_t) y1 * width + x1) * components + c]) * 0.25f;
+                    next[((size_t) y * w + x) * components + c] = v;
+                    if (c < colorChannels)
+                        v = v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1.f / 2.4f) - 0.055f;
+                    level[((size_t) y * w + x) * components + c] = (unsigned char) (v * 255.f + 0.5f);
+                }
+        work.swap(next);
+        width = w;
+        height = h;
+    }
+}
+
+bool bench_mipmap()
+{
+    bool agree = true;
+    const int SIZE = 1024;
+    for (int components = 3; components <= 4; ++components)
+    {
+        for (int srgb = 1; srgb >= 0; --srgb)
+        {
+            size_t chainSize = mipmap_chain_size(SIZE, SIZE, components);
+            std::vector<unsigned char> image(chainSize), reference(chainSize);
+            fill_image(&image[0], SIZE, SIZE, components);
+            memcpy(&reference[0], &image[0], (size_t) SIZE * SIZE * components);
+
+            double best = 1e9, bestReference = 1e9;
+            for (int run = 0; run < g_runs; ++run)
+            {
+                double start = now_milliseconds();
+                mipmap_generate(&image[0], SIZE, SIZE, components, srgb != 0);
+                double middle = now_milliseconds();
+                mipmap_reference(&reference[0], SIZE, SIZE, components, srgb != 0);
+                double end = now_milliseconds();
+                best = middle - start < best ? middle - start : best;
+                bestReference = end - middle < bestReference ? end - middle : bestReference;
+            }
+
+            int maxError = 0;
+            for (size_t i = (size_t) SIZE * SIZE * components; i < chainSize; ++i)
+            {
+                int error = abs(image[i] - reference[i]);
+                maxError = error > maxError ? error : maxError;
+            }
+            agree = agree && maxError <= 1;
+            printf("mipmap %dx%d %s %s : %.2f ms, reference %.2f ms (x%.1f), max error %d\n", SIZE, SIZE,
+                   components == 3 ? "RGB" : "RGBA", srgb ? "sRGB" : "linear", best, bestReference, bestReference / best, maxError);
+        }
+    }
+    return agree;
+}
+
+// Baseline JPEG encoder with the example tables of the spec (Annex K), to
+// make test images for the decoder
+static const unsigned char JPEG_ZIGZAG[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+static const unsigned char JPEG_QUANT_LUMA[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55, 14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92, 49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99
+};
+static const unsigned char JPEG_QUANT_CHROMA[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99
+};
+static const unsigned char JPEG_DC_VALUES[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const unsigned char JPEG_DC_LUMA_BITS[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const unsigned char JPEG_DC_CHROMA_BITS[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const unsigned char JPEG_AC_LUMA_BITS[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const unsigned char JPEG_AC_LUMA_VALUES[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+static const unsigned char JPEG_AC_CHROMA_BITS[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const unsigned char JPEG_AC_CHROMA_VALUES[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+struct JpegHuffman
+{
+    unsigned short code[256];
+    unsigned char size[256];
+};
+
+struct JpegWriter
+{
+    std::vector<unsigned char> * out;
+    unsigned int buffer;
+    int count;
+};
+
+void jpeg_build_huffman(JpegHuffman & huffman, const unsigned char * bits, const unsigned char * values)
+{
+    int code = 0, k = 0;
+    for (int length = 1; length <= 16; ++length)
+    {
+        for (int i = 0; i < bits[length - 1]; ++i, ++k, ++code)
+        {
+            huffman.code[values[k]] = (unsigned short) code;
+            huffman.size[values[k]] = (unsigned char) length;
+        }
+        code <<= 1;
+    }
+}
+
+void jpeg_put_bits(JpegWriter & writer, unsigned int value, int size)
+{
+    writer.buffer = (writer.buffer << size) | (value & ((1u << size) - 1));
+    writer.count += size;
+    while (writer.count >= 8)
+    {
+        unsigned char byte = (unsigned char) (writer.buffer >> (writer.count - 8));
+        writer.out->push_back(byte);
+        if (byte == 0xff)
+            writer.out->push_back(0);
+        writer.count -= 8;
+    }
+}
+
+void jpeg_put_segment(std::vector<unsigned char> & out, unsigned char marker, const unsigned char * data, size_t size)
+{
+    out.push_back(0xff);
+    out.push_back(marker);
+    out.push_back((unsigned char) ((size + 2) >> 8));
+    out.push_back((unsigned char) (size + 2));
+    out.insert(out.end(), data, data + size);
+}
+
+int jpeg_category(int value)
+{
+    int category = 0;
+    for (int a = value < 0 ? -value : value; a; a >>= 1)
+        ++category;
+    return category;
+}
+
+// Forward DCT, quantization and entropy coding of a level shifted block,
+// returns the DC coefficient
+int jpeg_encode_block(JpegWriter & writer, const float block[64], const unsigned char * quant, int previousDC,
+                      const JpegHuffman & dc, const JpegHuffman & ac)
+{
+    static float cosines[8][8];
+    if (cosines[0][0] == 0.f)
+        for (int u = 0; u < 8; ++u)
+            for (int x = 0; x < 8; ++x)
+                cosines[u][x] = (u == 0 ? sqrtf(0.5f) : 1.f) * cosf((2 * x + 1) * u * 3.14159265f / 16.f) / 2.f;
+
+    float rows[64];
+    for (int y = 0; y < 8; ++y)
+        for (int u = 0; u < 8; ++u)
+        {
+            float sum = 0.f;
+            for (int x = 0; x < 8; ++x)
+                sum += cosines[u][x] * block[y * 8 + x];
+            rows[y * 8 + u] = sum;
+        }
+    int coefficients[64];
+    for (int i = 0; i < 64; ++i)
+    {
+        int u = JPEG_ZIGZAG[i] % 8, v = JPEG_ZIGZAG[i] / 8;
+        float sum = 0.f;
+        for (int y = 0; y < 8; ++y)
+            sum += cosines[v][y] * rows[y * 8 + u];
+        coefficients[i] = (int) floorf(sum / quant[JPEG_ZIGZAG[i]] + 0.5f);
+    }
+
+    int delta = coefficients[0] - previousDC;
+    int category = jpeg_category(delta);
+    jpeg_put_bits(writer, dc.code[category], dc.size[category]);
+    jpeg_put_bits(writer, delta < 0 ? delta - 1 : delta, category);
+    int run = 0;
+    for (int i = 1; i < 64; ++i)
+    {
+        if (coefficients[i] == 0)
+        {
+            ++run;
+            continue;
+        }
+        for (; run > 15; run -= 16)
+            jpeg_put_bits(writer, ac.code[0xf0], ac.size[0xf0]);
+        category = jpeg_category(coefficients[i]);
+        int symbol = (run << 4) | category;
+        jpeg_put_bits(writer, ac.code[symbol], ac.size[symbol]);
+        jpeg_put_bits(writer, coefficients[i] < 0 ? coefficients[i] - 1 : coefficients[i], category);
+        run = 0;
+    }
+    if (run)
+        jpeg_put_bits(writer, ac.code[0], ac.size[0]);
+    return coefficients[0];
+}
+
+// Sample of a YCbCr plane, averaged over 2x2 pixels for subsampled chroma
+float jpeg_sample(const std::vector<float> & plane, int width, int height, int x, int y, int scale)
+{
+    float sum = 0.f;
+    for (int j = 0; j < scale; ++j)
+        for (int i = 0; i < scale; ++i)
+        {
+            int px = x * scale + i < width ? x * scale + i : width - 1;
+            int py = y * scale + j < height ? y * scale + j : height - 1;
+            sum += plane[(size_t) py * width + px];
+        }
+    return sum / (scale * scale);
+}
+
+void jpeg_encode(std::vector<unsigned char> & out, const unsigned char * rgb, int width, int height, bool subsampled)
+{
+    std::vector<float> planes[3];
+    for (int c = 0; c < 3; ++c)
+        planes[c].resize((size_t) width * height);
+    for (size_t i = 0; i < (size_t) width * height; ++i)
+    {
+        float r = rgb[i * 3], g = rgb[i * 3 + 1], b = rgb[i * 3 + 2];
+        planes[0][i] = 0.299f * r + 0.587f * g + 0.114f * b;
+        planes[1][i] = -0.1687f * r - 0.3313f * g + 0.5f * b + 128.f;
+        planes[2][i] = 0.5f * r - 0.4187f * g - 0.0813f * b + 128.f;
+    }
+
+    int scale = subsampled ? 2 : 1;
+    out.clear();
+    out.push_back(0xff);
+    out.push_back(0xd8);
+    unsigned char quant[130];
+    quant[0] = 0;
+    quant[65] = 1;
+    for (int i = 0; i < 64; ++i)
+    {
+        quant[1 + i] = JPEG_QUANT_LUMA[JPEG_ZIGZAG[i]];
+        quant[66 + i] = JPEG_QUANT_CHROMA[JPEG_ZIGZAG[i]];
+    }
+    jpeg_put_segment(out, 0xdb, quant, sizeof(quant));
+    unsigned char frame[15] = { 8, (unsigned char) (height >> 8), (unsigned char) height, (unsigned char) (width >> 8), (unsigned char) width,
+                                3, 1, (unsigned char) (scale << 4 | scale), 0, 2, 0x11, 1, 3, 0x11, 1 };
+    jpeg_put_segment(out, 0xc0, frame, sizeof(frame));
+    const unsigned char * tables[4][2] = { { JPEG_DC_LUMA_BITS, JPEG_DC_VALUES }, { JPEG_AC_LUMA_BITS, JPEG_AC_LUMA_VALUES },
+                                           { JPEG_DC_CHROMA_BITS, JPEG_DC_VALUES }, { JPEG_AC_CHROMA_BITS, JPEG_AC_CHROMA_VALUES } };
+    JpegHuffman huffman[4];
+    for (int t = 0; t < 4; ++t)
+    {
+        unsigned char table[1 + 16 + 162];
+        int count = 0;
+        for (int i = 0; i < 16; ++i)
+            count += tables[t][0][i];
+        table[0] = (unsigned char) ((t & 1) << 4 | t >> 1);
+        memcpy(table + 1, tables[t][0], 16);
+        memcpy(table + 17, tables[t][1], count);
+        jpeg_put_segment(out, 0xc4, table, 17 + count);
+        jpeg_build_huffman(huffman[t], tables[t][0], tables[t][1]);
+    }
+    const unsigned char scan[10] = { 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+    jpeg_put_segment(out, 0xda, scan, sizeof(scan));
+
+    JpegWriter writer = { &out, 0, 0 };
+    int previousDC[3] = { 0, 0, 0 };
+    float block[64];
+    int mcuSize = 8 * scale;
+    for (int my = 0; my < height; my += mcuSize)
+        for (int mx = 0; mx < width; mx += mcuSize)
+        {
+            for (int by = 0; by < scale; ++by)
+                for (int bx = 0; bx < scale; ++bx)
+                {
+                    for (int i = 0; i < 64; ++i)
+                        block[i] = jpeg_sample(planes[0], width, height, mx + bx * 8 + i % 8, my + by * 8 + i / 8, 1) - 128.f;
+                    previousDC[0] = jpeg_encode_block(writer, block, JPEG_QUANT_LUMA, previousDC[0], huffman[0], huffman[1]);
+                }
+            for (int c = 1; c < 3; ++c)
+            {
+                for (int i = 0; i < 64; ++i)
+                    block[i] = jpeg_sample(planes[c], width, height, mx / scale + i % 8, my / scale + i / 8, scale) - 128.f;
+                previousDC[c] = jpeg_encode_block(writer, block, JPEG_QUANT_CHROMA, previousDC[c], huffman[2], huffman[3]);
+            }
+        }
+    if (writer.count)
+        jpeg_put_bits(writer, 0x7f, 8 - writer.count);
+    out.push_back(0xff);
+    out.push_back(0xd9);
+}
+
+#ifdef STBI_SIMD
+// The scalar IDCT of stb_image (jidctint ISLOW), one 1D pass: the outputs
+// are rounded with bias and scaled down by shift
+inline int jpeg_fixed(float x)
+{
+    return (int) (x * 4096 + 0.5);
+}
+
+void reference_idct_1d(const int s[8], int bias, int shift, int out[8])
+{
+    int p1 = (s[2] + s[6]) * jpeg_fixed(0.5411961f);
+    int t2 = p1 + s[6] * jpeg_fixed(-1.847759065f);
+    int t3 = p1 + s[2] * jpeg_fixed(0.765366865f);
+    int t0 = (s[0] + s[4]) * 4096;
+    int t1 = (s[0] - s[4]) * 4096;
+    int x0 = t0 + t3 + bias, x3 = t0 - t3 + bias;
+    int x1 = t1 + t2 + bias, x2 = t1 - t2 + bias;
+
+    t0 = s[7];
+    t1 = s[5];
+    t2 = s[3];
+    t3 = s[1];
+    int p3 = t0 + t2, p4 = t1 + t3, p2 = t1 + t2;
+    p1 = t0 + t3;
+    int p5 = (p3 + p4) * jpeg_fixed(1.175875602f);
+    t0 *= jpeg_fixed(0.298631336f);
+    t1 *= jpeg_fixed(2.053119869f);
+    t2 *= jpeg_fixed(3.072711026f);
+    t3 *= jpeg_fixed(1.501321110f);
+    p1 = p5 + p1 * jpeg_fixed(-0.899976223f);
+    p2 = p5 + p2 * jpeg_fixed(-2.562915447f);
+    p3 *= jpeg_fixed(-1.961570560f);
+    p4 *= jpeg_fixed(-0.390180644f);
+    t3 += p1 + p4;
+    t2 += p2 + p3;
+    t1 += p2 + p4;
+    t0 += p1 + p3;
+
+    out[0] = (x0 + t3) >> shift;
+    out[7] = (x0 - t3) >> shift;
+    out[1] = (x1 + t2) >> shift;
+    out[6] = (x1 - t2) >> shift;
+    out[2] = (x2 + t1) >> shift;
+    out[5] = (x2 - t1) >> shift;
+    out[3] = (x3 + t0) >> shift;
+    out[4] = (x3 - t0) >> shift;
+}
+
+void reference_idct(stbi_uc * out, int out_stride, short data[64], unsigned short * dequantize)
+{
+    int columns[64];
+    for (int i = 0; i < 8; ++i)
+    {
+        int s[8], v[8];
+        bool acZero = true;
+        for (int k = 0; k < 8; ++k)
+        {
+            s[k] = data[k * 8 + i] * dequantize[k * 8 + i];
+            acZero = acZero && (k == 0 || data[k * 8 + i] == 0);
+        }
+        // Columns with only a DC term are flat, as in stb_image
+        if (acZero)
+            for (int k = 0; k < 8; ++k)
+                v[k] = s[0] * 4;
+        else
+            reference_idct_1d(s, 512, 10, v);
+        for (int k = 0; k < 8; ++k)
+            columns[k * 8 + i] = v[k];
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        int v[8];
+        reference_idct_1d(columns + i * 8, 65536 + (128 << 17), 17, v);
+        for (int k = 0; k < 8; ++k)
+            out[i * out_stride + k] = (stbi_uc) (v[k] < 0 ? 0 : (v[k] > 255 ? 255 : v[k]));
+    }
+}
+
+// The scalar YCbCr to RGB conversion of stb_image
+void reference_YCbCr_to_RGB(stbi_uc * out, stbi_uc const * y, stbi_uc const * pcb, stbi_uc const * pcr, int count, int step)
+{
+    const int crR = (int) (1.40200f * 65536 + 0.5), crG = (int) (0.71414f * 65536 + 0.5);
+    const int cbG = (int) (0.34414f * 65536 + 0.5), cbB = (int) (1.77200f * 65536 + 0.5);
+    for (int i = 0; i < count; ++i, out += step)
+    {
+        int yFixed = (y[i] << 16) + 32768;
+        int cr = pcr[i] - 128, cb = pcb[i] - 128;
+        int rgb[3] = { (yFixed + cr * crR) >> 16, (yFixed - cr * crG - cb * cbG) >> 16, (yFixed + cb * cbB) >> 16 };
+        for (int c = 0; c < 3; ++c)
+            out[c] = (stbi_uc) (rgb[c] < 0 ? 0 : (rgb[c] > 255 ? 255 : rgb[c]));
+        out[3] = 255;
+    }
+}
+#endif
+
+bool bench_jpeg()
+{
+    int width, height;
+    std::vector<unsigned char> rgb;
+    test_image(rgb, width, height);
+
+    bool agree = true;
+    for (int subsampled = 1; subsampled >= 0; --subsampled)
+    {
+        std::vector<unsigned char> jpeg;
+        jpeg_encode(jpeg, &rgb[0], width, height, subsampled != 0);
+
+        int x, y, comp;
+        unsigned char * decoded = stbi_load_from_memory(&jpeg[0], (int) jpeg.size(), &x, &y, &comp, 3);
+        if (!decoded)
+        {
+            printf("jpeg : %s\n", stbi_failure_reason());
+            return false;
+        }
+        double best = best_milliseconds([&] { stbi_image_free(stbi_load_from_memory(&jpeg[0], (int) jpeg.size(), &x, &y, &comp, 3)); });
+        printf("jpeg %dx%d %s, %d KB : %.2f ms (%.0f Mpixel/s)", width, height, subsampled ? "4:2:0" : "4:4:4",
+               (int) (jpeg.size() / 1024), best, width * height / best / 1000.0);
+
+#ifdef STBI_SIMD
+        stbi_install_idct(reference_idct);
+        stbi_install_YCbCr_to_RGB(reference_YCbCr_to_RGB);
+        unsigned char * reference = stbi_load_from_memory(&jpeg[0], (int) jpeg.size(), &x, &y, &comp, 3);
+        double bestReference = best_milliseconds([&] { stbi_image_free(stbi_load_from_memory(&jpeg[0], (int) jpeg.size(), &x, &y, &comp, 3)); });
+        stbi_install_idct(0);
+        stbi_install_YCbCr_to_RGB(0);
+
+        bool identical = reference && memcmp(decoded, reference, (size_t) width * height * 3) == 0;
+        agree = agree && identical;
+        printf(", scalar %.2f ms (x%.1f), %s", bestReference, bestReference / best, identical ? "identical" : "different");
+        stbi_image_free(reference);
+#endif
+        printf("\n");
+        stbi_image_free(decoded);
+    }
+    return agree;
+}
+
+// The inflate of stb_image 1.33 (zlib decode v0.2), to a buffer of the
+// decompressed size: 32-bit bit buffer, 9-bit fast table, byte copies
+struct ReferenceHuffman
+{
+    unsigned short fast[1 << 9];
+    unsigned short firstcode[16];
+    int maxcode[17];
+    unsigned short firstsymbol[16];
+    unsigned char size[288];
+    unsigned short value[288];
+};
+
+struct ReferenceInflate
+{
+    const unsigned char * in;
+    const unsigned char * inEnd;
+    int bitCount;
+    unsigned int bits;
+    unsigned char * out;
+    unsigned char * outStart;
+    unsigned char * outEnd;
+    ReferenceHuffman length, distance;
+};
+
+int reference_bit_reverse(int v, int bits)
+{
+    v = ((v & 0xAAAA) >> 1) | ((v & 0x5555) << 1);
+    v = ((v & 0xCCCC) >> 2) | ((v & 0x3333) << 2);
+    v = ((v & 0xF0F0) >> 4) | ((v & 0x0F0F) << 4);
+    v = ((v & 0xFF00) >> 8) | ((v & 0x00FF) << 8);
+    return v >> (16 - bits);
+}
+
+bool reference_build_huffman(ReferenceHuffman & z, const unsigned char * sizelist, int num)
+{
+    int sizes[17] = { 0 }, nextCode[16];
+    memset(z.fast, 255, sizeof(z.fast));
+    for (int i = 0; i < num; ++i)
+        ++sizes[sizelist[i]];
+    sizes[0] = 0;
+    int code = 0, k = 0;
+    for (int i = 1; i < 16; ++i)
+    {
+        nextCode[i] = code;
+        z.firstcode[i] = (unsigned short) code;
+        z.firstsymbol[i] = (unsigned short) k;
+        code += sizes[i];
+        if (sizes[i] && code - 1 >= (1 << i))
+            return false;
+        z.maxcode[i] = code << (16 - i);
+        code <<= 1;
+        k += sizes[i];
+    }
+    z.maxcode[16] = 0x10000;
+    for (int i = 0; i < num; ++i)
+    {
+        int s = sizelist[i];
+        if (!s)
+            continue;
+        int c = nextCode[s] - z.firstcode[s] + z.firstsymbol[s];
+        z.size[c] = (unsigned char) s;
+        z.value[c] = (unsigned short) i;
+        if (s <= 9)
+            for (int f = reference_bit_reverse(nextCode[s], s); f < (1 << 9); f += 1 << s)
+                z.fast[f] = (unsigned short) c;
+        ++nextCode[s];
+    }
+    return true;
+}
+
+unsigned int reference_receive(ReferenceInflate & a, int n)
+{
+    while (a.bitCount < n)
+    {
+        a.bits |= (unsigned int) (a.in < a.inEnd ? *a.in++ : 0) << a.bitCount;
+        a.bitCount += 8;
+    }
+    unsigned int k = a.bits & ((1u << n) - 1);
+    a.bits >>= n;
+    a.bitCount -= n;
+    return k;
+}
+
+int reference_decode(ReferenceInflate & a, const ReferenceHuffman & z)
+{
+    if (a.bitCount < 16)
+        while (a.bitCount <= 24)
+        {
+            a.bits |= (unsigned int) (a.in < a.inEnd ? *a.in++ : 0) << a.bitCount;
+            a.bitCount += 8;
+        }
+    int b = z.fast[a.bits & 511];
+    int s;
+    if (b == 0xffff)
+    {
+        int k = reference_bit_reverse(a.bits & 0xffff, 16);
+        for (s = 10; k >= z.maxcode[s]; ++s)
+            ;
+        if (s == 16)
+            return -1;
+        b = (k >> (16 - s)) - z.firstcode[s] + z.firstsymbol[s];
+    }
+    s = z.size[b];
+    a.bits >>= s;
+    a.bitCount -= s;
+    return z.value[b];
+}
+
+bool reference_huffman_block(ReferenceInflate & a)
+{
+    static const int lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const int lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const int distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049,
+                                          3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const int distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    for (;;)
+    {
+        int z = reference_decode(a, a.length);
+        if (z < 256)
+        {
+            if (z < 0 || a.out >= a.outEnd)
+                return false;
+            *a.out++ = (unsigned char) z;
+            continue;
+        }
+        if (z == 256)
+            return true;
+        z -= 257;
+        if (z >= 29)
+            return false;
+        int length = lengthBase[z] + (int) reference_receive(a, lengthExtra[z]);
+        z = reference_decode(a, a.distance);
+        if (z < 0 || z >= 30)
+            return false;
+        int distance = distanceBase[z] + (int) reference_receive(a, distanceExtra[z]);
+        if (a.out - a.outStart < distance || a.out + length > a.outEnd)
+            return false;
+        const unsigned char * p = a.out - distance;
+        while (length--)
+            *a.out++ = *p++;
+    }
+}
+
+bool reference_dynamic_codes(ReferenceInflate & a)
+{
+    static const unsigned char dezigzag[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    int hlit = (int) reference_receive(a, 5) + 257;
+    int hdist = (int) reference_receive(a, 5) + 1;
+    int hclen = (int) reference_receive(a, 4) + 4;
+    unsigned char codelengthSizes[19] = { 0 };
+    for (int i = 0; i < hclen; ++i)
+        codelengthSizes[dezigzag[i]] = (unsigned char) reference_receive(a, 3);
+    ReferenceHuffman codelength;
+    if (!reference_build_huffman(codelength, codelengthSizes, 19))
+        return false;
+
+    unsigned char lengths[286 + 32 + 137];
+    int n = 0;
+    while (n < hlit + hdist)
+    {
+        int c = reference_decode(a, codelength);
+        if (c < 0 || c >= 19)
+            return false;
+        if (c < 16)
+            lengths[n++] = (unsigned char) c;
+        else
+        {
+            int repeat = c == 16 ? (int) reference_receive(a, 2) + 3 : (c == 17 ? (int) reference_receive(a, 3) + 3 : (int) reference_receive(a, 7) + 11);
+            if (c == 16 && n == 0)
+                return false;
+            memset(lengths + n, c == 16 ? lengths[n - 1] : 0, repeat);
+            n += repeat;
+        }
+    }
+    return n == hlit + hdist && reference_build_huffman(a.length, lengths, hlit) && reference_build_huffman(a.distance, lengths + hlit, hdist);
+}
+
+bool reference_inflate(const unsigned char * in, int inLength, unsigned char * out, int outLength)
+{
+    ReferenceInflate a;
+    a.in = in + 2; // zlib header
+    a.inEnd = in + inLength;
+    a.bitCount = 0;
+    a.bits = 0;
+    a.out = a.outStart = out;
+    a.outEnd = out + outLength;
+    int final;
+    do
+    {
+        final = (int) reference_receive(a, 1);
+        int type = (int) reference_receive(a, 2);
+        if (type == 0)
+        {
+            reference_receive(a, a.bitCount & 7);
+            unsigned char header[4];
+            int k = 0;
+            for (; a.bitCount > 0; a.bitCount -= 8, a.bits >>= 8)
+                header[k++] = (unsigned char) a.bits;
+            while (k < 4)
+                header[k++] = a.in < a.inEnd ? *a.in++ : 0;
+            int length = header[1] * 256 + header[0];
+            if ((header[3] * 256 + header[2]) != (length ^ 0xffff) || a.in + length > a.inEnd || a.out + length > a.outEnd)
+                return false;
+            memcpy(a.out, a.in, length);
+            a.in += length;
+            a.out += length;
+        }
+        else if (type == 1)
+        {
+            unsigned char lengths[288], distances[32];
+            memset(lengths, 8, 144);
+            memset(lengths + 144, 9, 112);
+            memset(lengths + 256, 7, 24);
+            memset(lengths + 280, 8, 8);
+            memset(distances, 5, 32);
+            if (!reference_build_huffman(a.length, lengths, 288) || !reference_build_huffman(a.distance, distances, 32) || !reference_huffman_block(a))
+                return false;
+        }
+        else if (type == 2)
+        {
+            if (!reference_dynamic_codes(a) || !reference_huffman_block(a))
+                return false;
+        }
+        else
+            return false;
+    } while (!final);
+    return a.out == a.outEnd;
+}
+
+// The concatenated IDAT chunks of a PNG file, a zlib stream
+bool png_zlib_stream(const char * path, std::vector<unsigned char> & stream)
+{
+    std::vector<unsigned char> png;
+    if (!read_file(path, png))
+        return false;
+
+    stream.clear();
+    for (size_t offset = 8; offset + 12 <= png.size();)
+    {
+        size_t length = (size_t) png[offset] << 24 | png[offset + 1] << 16 | png[offset + 2] << 8 | png[offset + 3];
+        if (offset + 12 + length > png.size())
+            break;
+        if (memcmp(&png[offset + 4], "IDAT", 4) == 0)
+            stream.insert(stream.end(), png.begin() + offset + 8, png.begin() + offset + 8 + length);
+        offset += 12 + length;
+    }
+    return !stream.empty();
+}
+
+bool bench_inflate()
+{
+    const char * path = "textures/spnza_bricks_a_bump.png";
+    std::vector<unsigned char> stream;
+    if (!png_zlib_stream(path, stream))
+    {
+        printf("inflate : could not read %s\n", path);
+        return false;
+    }
+    int size;
+    char * expected = stbi_zlib_decode_malloc((const char *) &stream[0], (int) stream.size(), &size);
+    if (!expected)
+    {
+        printf("inflate : %s\n", stbi_failure_reason());
+        return false;
+    }
+
+    std::vector<unsigned char> out(size), reference(size);
+    int decoded = 0;
+    bool referenceDecoded = false;
+    double best = best_milliseconds([&] { decoded = stbi_zlib_decode_buffer((char *) &out[0], size, (const char *) &stream[0], (int) stream.size()); });
+    double bestReference = best_milliseconds([&] { referenceDecoded = reference_inflate(&stream[0], (int) stream.size(), &reference[0], size); });
+    bool identical = decoded == size && referenceDecoded && memcmp(&out[0], expected, size) == 0 && out == reference;
+    printf("inflate %s, %d KB -> %d KB : %.2f ms (%.0f MB/s), previous %.2f ms (x%.1f), %s\n", path, (int) (stream.size() / 1024), size / 1024,
+           best, size / best / 1000.0, bestReference, bestReference / best, identical ? "identical" : "different");
+    free(expected);
+    return identical;
+}
+
+// Expected decode of a batch item, and the count of results that differ
+struct BatchExpected
+{
+    unsigned char * pixels;
+    int x, y;
+};
+
+static std::atomic<int> g_batchMismatches(0);
+
+void batch_loaded(stbi_batch_item const * item, int, stbi_batch_result * result)
+{
+    const BatchExpected * expected = (const BatchExpected *) item->user;
+    if (!result->data || result->x != expected->x || result->y != expected->y
+        || memcmp(result->data, expected->pixels, (size_t) expected->x * expected->y * 4) != 0)
+        ++g_batchMismatches;
+    stbi_image_free(result->data);
+}
+
+bool bench_batch()
+{
+    int width, height;
+    std::vector<unsigned char> rgb, jpeg, png;
+    test_image(rgb, width, height);
+    jpeg_encode(jpeg, &rgb[0], width, height, true);
+    const char * pngPath = "textures/spnza_bricks_a_bump.png";
+    if (!read_file(pngPath, png))
+    {
+        printf("batch : could not read %s\n", pngPath);
+        return false;
+    }
+
+    const int ITEM_COUNT = 16;
+    BatchExpected expected[2];
+    const std::vector<unsigned char> * sources[2] = { &jpeg, &png };
+    for (int s = 0; s < 2; ++s)
+    {
+        int comp;
+        expected[s].pixels = stbi_load_from_memory(&(*sources[s])[0], (int) sources[s]->size(), &expected[s].x, &expected[s].y, &comp, 4);
+        if (!expected[s].pixels)
+        {
+            printf("batch : %s\n", stbi_failure_reason());
+            return false;
+        }
+    }
+    stbi_batch_item items[ITEM_COUNT];
+    for (int i = 0; i < ITEM_COUNT; ++i)
+    {
+        const std::vector<unsigned char> & source = *sources[i % 2];
+        stbi_batch_item item = { 0, &source[0], (int) source.size(), 4, &expected[i % 2] };
+        items[i] = item;
+    }
+
+    // Powers of two, then one thread per core
+    int cores = (int) std::thread::hardware_concurrency();
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < cores; threads *= 2)
+        threadCounts.push_back(threads);
+    threadCounts.push_back(cores > 1 ? cores : 1);
+
+    g_batchMismatches = 0;
+    double single = 0.0;
+    for (size_t t = 0; t < threadCounts.size(); ++t)
+    {
+        int threads = threadCounts[t];
+        int loaded = 0;
+        double best = best_milliseconds([&] { loaded = stbi_load_batch(items, ITEM_COUNT, threads, batch_loaded); });
+        if (loaded != ITEM_COUNT)
+            ++g_batchMismatches;
+        single = threads == 1 ? best : single;
+        printf("batch of %d images, %d thread%s : %.2f ms (x%.1f)\n", ITEM_COUNT, threads, threads > 1 ? "s" : "", best, single / best);
+    }
+    printf("batch %s\n", g_batchMismatches ? "decodes differ from the calling thread" : "decodes identical to the calling thread");
+
+    stbi_image_free(expected[0].pixels);
+    stbi_image_free(expected[1].pixels);
+    return g_batchMismatches == 0;
+}
+
+// Rows handed over by stbi_load_rows, with the first place they differ
+// from the whole image
+struct RowsCheck
+{
+    const unsigned char * expected;
+    int nextRow;
+    int calls;
+    int stopAfter;
+    int mismatchRow;
+};
+
+int rows_received(void * user, stbi_uc const * rows, int first_row, int row_count, int x, int, int n)
+{
+    RowsCheck * check = (RowsCheck *) user;
+    size_t rowSize = (size_t) x * n;
+    if (first_row != check->nextRow && check->mismatchRow < 0)
+        check->mismatchRow = first_row;
+    for (int r = 0; r < row_count && check->mismatchRow < 0; ++r)
+        if (memcmp(rows + r * rowSize, check->expected + (first_row + r) * rowSize, rowSize) != 0)
+            check->mismatchRow = first_row + r;
+    check->nextRow = first_row + row_count;
+    return ++check->calls != check->stopAfter;
+}
+
+bool bench_rows()
+{
+    int width, height;
+    std::vector<unsigned char> rgb, files[4];
+    test_image(rgb, width, height);
+    jpeg_encode(files[0], &rgb[0], width, height, true);
+    jpeg_encode(files[1], &rgb[0], width, height, false);
+    const char * names[4] = { "jpeg 4:2:0", "jpeg 4:4:4", "textures/spnza_bricks_a_bump.png", "textures/spnza_bricks_a_diff.tga" };
+    for (int f = 2; f < 4; ++f)
+        if (!read_file(names[f], files[f]))
+        {
+            printf("rows : could not read %s\n", names[f]);
+            return false;
+        }
+
+    bool agree = true;
+    for (int f = 0; f < 4; ++f)
+    {
+        for (int reqComp = 0; reqComp <= 4; ++reqComp)
+        {
+            int x, y, comp, rowsX, rowsY, rowsComp;
+            unsigned char * expected = stbi_load_from_memory(&files[f][0], (int) files[f].size(), &x, &y, &comp, reqComp);
+            if (!expected)
+            {
+                printf("rows %s : %s\n", names[f], stbi_failure_reason());
+                return false;
+            }
+            RowsCheck check = { expected, 0, 0, 0, -1 };
+            int decoded = stbi_load_rows_from_memory(&files[f][0], (int) files[f].size(), &rowsX, &rowsY, &rowsComp, reqComp, rows_received, &check);
+            bool identical = decoded && check.mismatchRow < 0 && check.nextRow == y && rowsX == x && rowsY == y && rowsComp == comp;
+
+            // Stopping from the first call fails the decode
+            RowsCheck stopped = { expected, 0, 0, 1, -1 };
+            bool stops = !stbi_load_rows_from_memory(&files[f][0], (int) files[f].size(), &rowsX, &rowsY, &rowsComp, reqComp, rows_received, &stopped)
+                         && stopped.calls == 1;
+
+            double best = 0.0, bestRows = 0.0;
+            if (reqComp == 4)
+            {
+                best = best_milliseconds([&] { stbi_image_free(stbi_load_from_memory(&files[f][0], (int) files[f].size(), &x, &y, &comp, 4)); });
+                bestRows = best_milliseconds([&] {
+                    RowsCheck timed = { expected, 0, 0, 0, -1 };
+                    stbi_load_rows_from_memory(&files[f][0], (int) files[f].size(), &rowsX, &rowsY, &rowsComp, 4, rows_received, &timed);
+                });
+            }
+            agree = agree && identical && stops;
+            printf("rows %s, req_comp %d : %d calls, %s", names[f], reqComp, check.calls,
+                   identical ? "identical" : "different");
+            if (check.mismatchRow >= 0)
+                printf(" from row %d", check.mismatchRow);
+            if (!stops)
+                printf(", does not stop");
+            if (reqComp == 4)
+                printf(", %.2f ms, stbi_load %.2f ms", bestRows, best);
+            printf("\n");
+            stbi_image_free(expected);
+        }
+    }
+    return agree;
+}
+
+struct Benchmark
+{
+    const char * name;
+    bool (*run)();
+};
+
+static const Benchmark g_benchmarks[] = {
+    { "mipmap", bench_mipmap },
+    { "jpeg", bench_jpeg },
+    { "inflate", bench_inflate },
+    { "batch", bench_batch },
+    { "rows", bench_rows }
+};
+static const int BENCHMARK_COUNT = sizeof(g_benchmarks) / sizeof(g_benchmarks[0]);
+
+int main(int argc, char ** argv)
+{
+    std::vector<const char *> names;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            g_runs = atoi(argv[++i]);
+        else
+            names.push_back(argv[i]);
+    }
+    if (g_runs < 1)
+        g_runs = 1;
+
+    int unknown = 0;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        int b = 0;
+        while (b < BENCHMARK_COUNT && strcmp(names[i], g_benchmarks[b].name) != 0)
+            ++b;
+        if (b == BENCHMARK_COUNT)
+        {
+            fprintf(stderr, "Unknown benchmark %s\n", names[i]);
+            ++unknown;
+        }
+    }
+    if (unknown)
+    {
+        fprintf(stderr, "usage : %s [-n runs] [benchmark] ...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    for (int b = 0; b < BENCHMARK_COUNT; ++b)
+    {
+        bool selected = names.empty();
+        for (size_t i = 0; i < names.size() && !selected; ++i)
+            selected = strcmp(names[i], g_benchmarks[b].name) == 0;
+        if (selected && !g_benchmarks[b].run())
+            ++failed;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
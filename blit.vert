@@ -0,0 +1,23 @@
+#version 410 core
+
+precision highp float;
+precision highp int;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+out block
+{
+	vec2 TexCoord;
+} Out;
+
+void main()
+{
+	// Fullscreen triangle, no vertex buffer needed
+	vec2 uv = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+
+	Out.TexCoord = uv;
+	gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,380 @@
+#include "bc.h"
+
+#include <math.h>
+#include <string.h>
+
+static inline int clamp_int(int v, int lo, int hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// Principal axis of the block colors by power iteration, returns the mean
+static void principal_axis(const unsigned char * rgba, int channels, float * mean, float * axis)
+{
+    float cov[4][4];
+    for (int c = 0; c < channels; ++c)
+    {
+        mean[c] = 0.f;
+        for (int i = 0; i < 16; ++i)
+            mean[c] += rgba[i * 4 + c];
+        mean[c] /= 16.f;
+    }
+    for (int a = 0; a < channels; ++a)
+    {
+        for (int b = 0; b < channels; ++b)
+        {
+            cov[a][b] = 0.f;
+            for (int i = 0; i < 16; ++i)
+                cov[a][b] += (rgba[i * 4 + a] - mean[a]) * (rgba[i * 4 + b] - mean[b]);
+        }
+    }
+    for (int c = 0; c < channels; ++c)
+        axis[c] = 1.f;
+    for (int iteration = 0; iteration < 8; ++iteration)
+    {
+        float next[4];
+        float length = 0.f;
+        for (int a = 0; a < channels; ++a)
+        {
+            next[a] = 0.f;
+            for (int b = 0; b < channels; ++b)
+                next[a] += cov[a][b] * axis[b];
+            length += next[a] * next[a];
+        }
+        if (length < 1e-8f)
+            break;
+        length = sqrtf(length);
+        for (int c = 0; c < channels; ++c)
+            axis[c] = next[c] / length;
+    }
+}
+
+// Extremes of the block along its principal axis
+static void axis_endpoints(const unsigned char * rgba, int channels, float * e0, float * e1)
+{
+    float mean[4], axis[4];
+    principal_axis(rgba, channels, mean, axis);
+    float tmin = 1e9f, tmax = -1e9f;
+    for (int i = 0; i < 16; ++i)
+    {
+        float t = 0.f;
+        for (int c = 0; c < channels; ++c)
+            t += (rgba[i * 4 + c] - mean[c]) * axis[c];
+        tmin = t < tmin ? t : tmin;
+        tmax = t > tmax ? t : tmax;
+    }
+    for (int c = 0; c < channels; ++c)
+    {
+        e0[c] = mean[c] + axis[c] * tmax;
+        e1[c] = mean[c] + axis[c] * tmin;
+    }
+}
+
+static inline unsigned short pack565(const float * c)
+{
+    int r = clamp_int((int) (c[0] * 31.f / 255.f + 0.5f), 0, 31);
+    int g = clamp_int((int) (c[1] * 63.f / 255.f + 0.5f), 0, 63);
+    int b = clamp_int((int) (c[2] * 31.f / 255.f + 0.5f), 0, 31);
+    return (unsigned short) ((r << 11) | (g << 5) | b);
+}
+
+static inline void unpack565(unsigned short v, int * c)
+{
+    c[0] = ((v >> 11) & 31) * 255 / 31;
+    c[1] = ((v >> 5) & 63) * 255 / 63;
+    c[2] = (v & 31) * 255 / 31;
+}
+
+// Picks indices for a pair of 565 endpoints, returns the squared error
+static int bc1_indices(const unsigned char * rgba, unsigned short c0, unsigned short c1, unsigned int * indices)
+{
+    int palette[4][3];
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+    int error = 0;
+    *indices = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        int best = 0, bestError = 1 << 30;
+        for (int p = 0; p < 4; ++p)
+        {
+            int dr = rgba[i * 4] - palette[p][0];
+            int dg = rgba[i * 4 + 1] - palette[p][1];
+            int db = rgba[i * 4 + 2] - palette[p][2];
+            int e = dr * dr + dg * dg + db * db;
+            if (e < bestError)
+            {
+                bestError = e;
+                best = p;
+            }
+        }
+        error += bestError;
+        *indices |= best << (i * 2);
+    }
+    return error;
+}
+
+// Least squares endpoints for fixed indices
+static bool bc1_refine(const unsigned char * rgba, unsigned int indices, float * e0, float * e1)
+{
+    static const float weights[4] = { 1.f, 0.f, 2.f / 3.f, 1.f / 3.f };
+    float aa = 0.f, bb = 0.f, ab = 0.f;
+    float ax[3] = { 0.f, 0.f, 0.f }, bx[3] = { 0.f, 0.f, 0.f };
+    for (int i = 0; i < 16; ++i)
+    {
+        float a = weights[(indices >> (i * 2)) & 3];
+        float b = 1.f - a;
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+        for (int c = 0; c < 3; ++c)
+        {
+            ax[c] += a * rgba[i * 4 + c];
+            bx[c] += b * rgba[i * 4 + c];
+        }
+    }
+    float det = aa * bb - ab * ab;
+    if (fabsf(det) < 1e-6f)
+        return false;
+    for (int c = 0; c < 3; ++c)
+    {
+        e0[c] = (ax[c] * bb - bx[c] * ab) / det;
+        e1[c] = (bx[c] * aa - ax[c] * ab) / det;
+    }
+    return true;
+}
+
+static void bc1_write(unsigned short c0, unsigned short c1, unsigned int indices, unsigned char * out)
+{
+    out[0] = (unsigned char) (c0 & 0xff);
+    out[1] = (unsigned char) (c0 >> 8);
+    out[2] = (unsigned char) (c1 & 0xff);
+    out[3] = (unsigned char) (c1 >> 8);
+    for (int i = 0; i < 4; ++i)
+        out[4 + i] = (unsigned char) (indices >> (i * 8));
+}
+
+// Orders the endpoints for the 4 color mode, remapping indices accordingly
+static void bc1_order(unsigned short & c0, unsigned short & c1, unsigned int & indices)
+{
+    if (c0 < c1)
+    {
+        unsigned short swap = c0;
+        c0 = c1;
+        c1 = swap;
+        indices ^= 0x55555555; // 0 <-> 1, 2 <-> 3
+    }
+    else if (c0 == c1)
+        indices = 0;
+}
+
+void bc1_encode_block(const unsigned char * rgba, unsigned char * out)
+{
+    float e0[3], e1[3];
+    axis_endpoints(rgba, 3, e0, e1);
+
+    // Inset the endpoints a little, the extremes are rarely hit exactly
+    for (int c = 0; c < 3; ++c)
+    {
+        float inset = (e0[c] - e1[c]) / 16.f;
+        e0[c] -= inset;
+        e1[c] += inset;
+    }
+
+    unsigned short c0 = pack565(e0), c1 = pack565(e1);
+    unsigned int indices;
+    int error = bc1_indices(rgba, c0, c1, &indices);
+    if (error > 0 && bc1_refine(rgba, indices, e0, e1))
+    {
+        unsigned short r0 = pack565(e0), r1 = pack565(e1);
+        unsigned int refinedIndices;
+        if (bc1_indices(rgba, r0, r1, &refinedIndices) < error)
+        {
+            c0 = r0;
+            c1 = r1;
+            indices = refinedIndices;
+        }
+    }
+    bc1_order(c0, c1, indices);
+    bc1_write(c0, c1, indices, out);
+}
+
+static void bc4_encode_channel(const unsigned char * rgba, int channel, unsigned char * out)
+{
+    int lo = 255, hi = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        int v = rgba[i * 4 + channel];
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+    }
+
+    // 8 value mode : endpoints, then 6 interpolated values from the first to the second
+    int palette[8];
+    palette[0] = hi;
+    palette[1] = lo;
+    for (int i = 1; i < 7; ++i)
+        palette[i + 1] = ((7 - i) * hi + i * lo + 3) / 7;
+
+    unsigned long long indices = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        int v = rgba[i * 4 + channel];
+        int best = 0, bestError = 1 << 30;
+        for (int p = 0; p < 8 && hi != lo; ++p)
+        {
+            int e = (v - palette[p]) * (v - palette[p]);
+            if (e < bestError)
+            {
+                bestError = e;
+                best = p;
+            }
+        }
+        indices |= (unsigned long long) best << (i * 3);
+    }
+
+    out[0] = (unsigned char) hi;
+    out[1] = (unsigned char) lo;
+    for (int i = 0; i < 6; ++i)
+        out[2 + i] = (unsigned char) (indices >> (i * 8));
+}
+
+void bc4_encode_block(const unsigned char * rgba, unsigned char * out)
+{
+    bc4_encode_channel(rgba, 0, out);
+}
+
+void bc3_encode_block(const unsigned char * rgba, unsigned char * out)
+{
+    bc4_encode_channel(rgba, 3, out);
+    bc1_encode_block(rgba, out + 8);
+}
+
+void bc5_encode_block(const unsigned char * rgba, unsigned char * out)
+{
+    bc4_encode_channel(rgba, 0, out);
+    bc4_encode_channel(rgba, 1, out + 8);
+}
+
+// Little endian bit writer for 128 bit blocks
+static void put_bits(unsigned char * out, int & position, unsigned int value, int count)
+{
+    for (int i = 0; i < count; ++i, ++position)
+        if (value & (1u << i))
+            out[position >> 3] |= (unsigned char) (1u << (position & 7));
+}
+
+void bc7_encode_block(const unsigned char * rgba, unsigned char * out)
+{
+    static const int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+    float e[2][4];
+    axis_endpoints(rgba, 4, e[0], e[1]);
+
+    // Mode 6 : 7 bit RGBA endpoints, each with its own shared low bit
+    int q[2][4], p[2];
+    int endpoint[2][4];
+    for (int k = 0; k < 2; ++k)
+    {
+        int bestError = 1 << 30;
+        for (int bit = 0; bit < 2; ++bit)
+        {
+            int candidate[4], error = 0;
+            for (int c = 0; c < 4; ++c)
+            {
+                int v = clamp_int((int) floorf(e[k][c] + 0.5f), 0, 255);
+                candidate[c] = clamp_int((v - bit + 1) >> 1, 0, 127);
+                int d = ((candidate[c] << 1) | bit) - v;
+                error += d * d;
+            }
+            if (error < bestError)
+            {
+                bestError = error;
+                p[k] = bit;
+                memcpy(q[k], candidate, sizeof(candidate));
+            }
+        }
+        for (int c = 0; c < 4; ++c)
+            endpoint[k][c] = (q[k][c] << 1) | p[k];
+    }
+
+    int indices[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        int best = 0, bestError = 1 << 30;
+        for (int w = 0; w < 16; ++w)
+        {
+            int error = 0;
+            for (int c = 0; c < 4; ++c)
+            {
+                int v = ((64 - weights[w]) * endpoint[0][c] + weights[w] * endpoint[1][c] + 32) >> 6;
+                error += (v - rgba[i * 4 + c]) * (v - rgba[i * 4 + c]);
+            }
+            if (error < bestError)
+            {
+                bestError = error;
+                best = w;
+            }
+        }
+        indices[i] = best;
+    }
+
+    // The anchor index is stored without its high bit, swap endpoints if it is set
+    if (indices[0] & 8)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            int swap = q[0][c];
+            q[0][c] = q[1][c];
+            q[1][c] = swap;
+        }
+        int swap = p[0];
+        p[0] = p[1];
+        p[1] = swap;
+        for (int i = 0; i < 16; ++i)
+            indices[i] = 15 - indices[i];
+    }
+
+    memset(out, 0, 16);
+    int position = 0;
+    put_bits(out, position, 1 << 6, 7);
+    for (int c = 0; c < 4; ++c)
+    {
+        put_bits(out, position, q[0][c], 7);
+        put_bits(out, position, q[1][c], 7);
+    }
+    put_bits(out, position, p[0], 1);
+    put_bits(out, position, p[1], 1);
+    put_bits(out, position, indices[0], 3);
+    for (int i = 1; i < 16; ++i)
+        put_bits(out, position, indices[i], 4);
+}
+
+size_t bc_encode_image(bc_encode_block_func encode, int blockSize, const unsigned char * rgba, int width, int height, unsigned char * out)
+{
+    unsigned char block[64];
+    unsigned char * start = out;
+    for (int by = 0; by < height; by += 4)
+    {
+        for (int bx = 0; bx < width; bx += 4)
+        {
+            for (int y = 0; y < 4; ++y)
+            {
+                int sy = by + y < height ? by + y : height - 1;
+                for (int x = 0; x < 4; ++x)
+                {
+                    int sx = bx + x < width ? bx + x : width - 1;
+                    memcpy(block + (y * 4 + x) * 4, rgba + ((size_t) sy * width + sx) * 4, 4);
+                }
+            }
+            encode(block, out);
+            out += blockSize;
+        }
+    }
+    return out - start;
+}
@@ -0,0 +1,18 @@
+#ifndef BC_H
+#define BC_H
+
+#include <stddef.h>
+
+// Block compression encoders. Blocks are 4x4 RGBA8 texels, row major.
+void bc1_encode_block(const unsigned char * rgba, unsigned char * out);  // 8 bytes, alpha ignored
+void bc3_encode_block(const unsigned char * rgba, unsigned char * out);  // 16 bytes
+void bc4_encode_block(const unsigned char * rgba, unsigned char * out);  // 8 bytes, red only
+void bc5_encode_block(const unsigned char * rgba, unsigned char * out);  // 16 bytes, red and green
+void bc7_encode_block(const unsigned char * rgba, unsigned char * out);  // 16 bytes, mode 6 only
+
+// Encodes a whole RGBA8 image with one of the encoders above, edge texels
+// are replicated to fill partial blocks. Returns the number of bytes written.
+typedef void (*bc_encode_block_func)(const unsigned char * rgba, unsigned char * out);
+size_t bc_encode_image(bc_encode_block_func encode, int blockSize, const unsigned char * rgba, int width, int height, unsigned char * out);
+
+#endif // BC_H
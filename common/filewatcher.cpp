@@ -0,0 +1,116 @@
+#include "filewatcher.h"
+
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+#ifdef __linux__
+
+void file_watcher_init(FileWatcher & fw)
+{
+    fw.paths.clear();
+    fw.watches.clear();
+    fw.names.clear();
+    fw.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+void file_watcher_close(FileWatcher & fw)
+{
+    // Closing the instance removes its watches
+    if (fw.fd >= 0)
+        close(fw.fd);
+    fw.fd = -1;
+    fw.paths.clear();
+    fw.watches.clear();
+    fw.names.clear();
+}
+
+void file_watcher_add(FileWatcher & fw, const char * path)
+{
+    if (fw.fd < 0 || std::find(fw.paths.begin(), fw.paths.end(), path) != fw.paths.end())
+        return;
+    std::string file = path;
+    size_t slash = file.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : file.substr(0, slash + 1);
+    // Adding a directory twice returns its existing watch. Files are seen
+    // once written and closed, or renamed over.
+    int watch = inotify_add_watch(fw.fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (watch < 0)
+        return;
+    fw.paths.push_back(file);
+    fw.watches.push_back(watch);
+    fw.names.push_back(slash == std::string::npos ? file : file.substr(slash + 1));
+}
+
+void file_watcher_poll(FileWatcher & fw, std::vector<std::string> & changed)
+{
+    if (fw.fd < 0)
+        return;
+    size_t first = changed.size();
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    for (;;)
+    {
+        ssize_t length = read(fw.fd, buffer, sizeof(buffer));
+        if (length <= 0)
+            break; // EAGAIN once the queue is empty
+        for (char * event = buffer; event < buffer + length; )
+        {
+            const struct inotify_event * e = (const struct inotify_event *) event;
+            event += sizeof(struct inotify_event) + e->len;
+            if (!e->len)
+                continue;
+            for (size_t i = 0; i < fw.paths.size(); ++i)
+            {
+                // Editors often write several times per save
+                if (fw.watches[i] == e->wd && fw.names[i] == e->name && std::find(changed.begin() + first, changed.end(), fw.paths[i]) == changed.end())
+                    changed.push_back(fw.paths[i]);
+            }
+        }
+    }
+}
+
+#else
+
+long long file_modification_time(const char * path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long) st.st_mtime : -1;
+}
+
+void file_watcher_init(FileWatcher & fw)
+{
+    fw.paths.clear();
+    fw.times.clear();
+}
+
+void file_watcher_close(FileWatcher & fw)
+{
+    file_watcher_init(fw);
+}
+
+void file_watcher_add(FileWatcher & fw, const char * path)
+{
+    if (std::find(fw.paths.begin(), fw.paths.end(), path) != fw.paths.end())
+        return;
+    fw.paths.push_back(path);
+    fw.times.push_back(file_modification_time(path));
+}
+
+void file_watcher_poll(FileWatcher & fw, std::vector<std::string> & changed)
+{
+    for (size_t i = 0; i < fw.paths.size(); ++i)
+    {
+        long long time = file_modification_time(fw.paths[i].c_str());
+        if (time != fw.times[i])
+        {
+            fw.times[i] = time;
+            changed.push_back(fw.paths[i]);
+        }
+    }
+}
+
+#endif
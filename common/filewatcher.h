@@ -0,0 +1,30 @@
+#ifndef FILEWATCHER_H
+#define FILEWATCHER_H
+
+#include <string>
+#include <vector>
+
+// Reports changes to a set of files without blocking. On Linux inotify
+// watches their directories, which also catches editors saving to a
+// temporary file renamed over the original. Elsewhere the modification
+// times are compared on each poll.
+struct FileWatcher
+{
+    std::vector<std::string> paths;
+#ifdef __linux__
+    int fd; // inotify instance, -1 if it could not be created
+    std::vector<int> watches; // Directory watch of each path
+    std::vector<std::string> names; // Path within its directory
+#else
+    std::vector<long long> times; // Modification time of each path
+#endif
+};
+
+void file_watcher_init(FileWatcher & fw);
+void file_watcher_close(FileWatcher & fw);
+// Watching the same path again does nothing
+void file_watcher_add(FileWatcher & fw, const char * path);
+// Appends the watched paths changed since the last poll, once each
+void file_watcher_poll(FileWatcher & fw, std::vector<std::string> & changed);
+
+#endif // FILEWATCHER_H
@@ -0,0 +1,99 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+void mapped_file_init(MappedFile & mf)
+{
+    mf.data = 0;
+    mf.size = 0;
+#ifdef _WIN32
+    mf.file = INVALID_HANDLE_VALUE;
+    mf.mapping = 0;
+#endif
+}
+
+#ifdef _WIN32
+
+bool mapped_file_open(MappedFile & mf, const char * path)
+{
+    mapped_file_init(mf);
+    mf.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+    if (mf.file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(mf.file, &size) && size.QuadPart > 0)
+        mf.mapping = CreateFileMappingA(mf.file, 0, PAGE_READONLY, 0, 0, 0);
+    if (mf.mapping)
+        mf.data = (const unsigned char *) MapViewOfFile(mf.mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mf.data)
+    {
+        mapped_file_close(mf);
+        return false;
+    }
+    mf.size = (size_t) size.QuadPart;
+    return true;
+}
+
+void mapped_file_close(MappedFile & mf)
+{
+    if (mf.data)
+        UnmapViewOfFile(mf.data);
+    if (mf.mapping)
+        CloseHandle(mf.mapping);
+    if (mf.file != INVALID_HANDLE_VALUE)
+        CloseHandle(mf.file);
+    mapped_file_init(mf);
+}
+
+void mapped_file_prefetch(const MappedFile &, size_t, size_t)
+{
+}
+
+#else
+
+bool mapped_file_open(MappedFile & mf, const char * path)
+{
+    mapped_file_init(mf);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void * data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(0, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    // No read ahead, levels are fetched one by one
+    madvise(data, (size_t) st.st_size, MADV_RANDOM);
+    mf.data = (const unsigned char *) data;
+    mf.size = (size_t) st.st_size;
+    return true;
+}
+
+void mapped_file_close(MappedFile & mf)
+{
+    if (mf.data)
+        munmap((void *) mf.data, mf.size);
+    mapped_file_init(mf);
+}
+
+void mapped_file_prefetch(const MappedFile & mf, size_t offset, size_t size)
+{
+    // madvise wants a page aligned address
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    if (mf.data && offset + size <= mf.size)
+        madvise((void *) (mf.data + start), offset + size - start, MADV_WILLNEED);
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+
+// Read only file mapping. Pages are only read from disk when touched, so
+// callers should lay out data to keep what they read together.
+struct MappedFile
+{
+    const unsigned char * data;
+    size_t size;
+#ifdef _WIN32
+    void * file;
+    void * mapping;
+#endif
+};
+
+void mapped_file_init(MappedFile & mf);
+bool mapped_file_open(MappedFile & mf, const char * path);
+void mapped_file_close(MappedFile & mf);
+
+// Hints that a range is about to be read
+void mapped_file_prefetch(const MappedFile & mf, size_t offset, size_t size);
+
+#endif // MAPPEDFILE_H
@@ -0,0 +1,151 @@
+#include "mipmap.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MIPMAP_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Conversion tables, built before main() so worker threads can share them
+struct MipmapTables
+{
+    unsigned short srgbToLinear[256];
+    unsigned char linearToSrgb[16384]; // Indexed by the 14 high bits of a 16-bit linear value
+
+    MipmapTables()
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            double c = i / 255.0;
+            double l = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+            srgbToLinear[i] = (unsigned short) (l * 65535.0 + 0.5);
+        }
+        for (int i = 0; i < 16384; ++i)
+        {
+            double l = (i + 0.5) / 16384.0;
+            double c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1.0 / 2.4) - 0.055;
+            linearToSrgb[i] = (unsigned char) (c * 255.0 + 0.5);
+        }
+    }
+};
+static const MipmapTables g_tables;
+
+int mipmap_level_count(int width, int height)
+{
+    int size = width > height ? width : height;
+    int count = 1;
+    while (size > 1)
+    {
+        size /= 2;
+        ++count;
+    }
+    return count;
+}
+
+size_t mipmap_level_offset(int width, int height, int components, int level)
+{
+    size_t offset = 0;
+    for (int i = 0; i < level; ++i)
+    {
+        offset += (size_t) width * height * components;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    return offset;
+}
+
+size_t mipmap_chain_size(int width, int height, int components)
+{
+    return mipmap_level_offset(width, height, components, mipmap_level_count(width, height));
+}
+
+// Working levels are 4 x 16-bit per pixel whatever the component count, so
+// that a 2x2 reduction of two pixels fits in one SSE register
+static void reduce(const unsigned short * src, int width, int height, unsigned short * dst)
+{
+    int w = width > 1 ? width / 2 : 1;
+    int h = height > 1 ? height / 2 : 1;
+    for (int y = 0; y < h; ++y)
+    {
+        const unsigned short * row0 = src + (size_t) (height > 1 ? 2 * y : y) * width * 4;
+        const unsigned short * row1 = height > 1 ? row0 + (size_t) width * 4 : row0;
+        unsigned short * out = dst + (size_t) y * w * 4;
+        if (width == 1)
+        {
+            for (int c = 0; c < 4; ++c)
+                out[c] = (unsigned short) ((row0[c] + row1[c] + 1) >> 1);
+            continue;
+        }
+        int x = 0;
+#ifdef MIPMAP_SSE2
+        // Two output pixels from four input pixels of each row
+        for (; x + 2 <= w; x += 2)
+        {
+            __m128i a = _mm_avg_epu16(_mm_loadu_si128((const __m128i *) (row0 + x * 8)),
+                                      _mm_loadu_si128((const __m128i *) (row1 + x * 8)));
+            __m128i b = _mm_avg_epu16(_mm_loadu_si128((const __m128i *) (row0 + x * 8 + 8)),
+                                      _mm_loadu_si128((const __m128i *) (row1 + x * 8 + 8)));
+            __m128i r = _mm_avg_epu16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+            _mm_storeu_si128((__m128i *) (out + x * 4), r);
+        }
+#endif
+        for (; x < w; ++x)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                int a = (row0[x * 8 + c] + row1[x * 8 + c] + 1) >> 1;
+                int b = (row0[x * 8 + 4 + c] + row1[x * 8 + 4 + c] + 1) >> 1;
+                out[x * 4 + c] = (unsigned short) ((a + b + 1) >> 1);
+            }
+        }
+    }
+}
+
+void mipmap_generate(unsigned char * chain, int width, int height, int components, bool srgb)
+{
+    // Grey and RGB channels are color, the last channel of 2 and 4 component images is alpha
+    int colorChannels = srgb ? (components == 2 || components == 4 ? components - 1 : components) : 0;
+
+    unsigned short * work = (unsigned short *) malloc((size_t) width * height * 4 * sizeof(unsigned short));
+    unsigned short * next = (unsigned short *) malloc((size_t) (width > 1 ? width / 2 : 1) * (height > 1 ? height / 2 : 1) * 4 * sizeof(unsigned short));
+
+    size_t pixelCount = (size_t) width * height;
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            unsigned char v = c < components ? chain[i * components + c] : 0;
+            work[i * 4 + c] = c < colorChannels ? g_tables.srgbToLinear[v] : (unsigned short) (v * 257);
+        }
+    }
+
+    int levelCount = mipmap_level_count(width, height);
+    unsigned char * level = chain;
+    for (int l = 1; l < levelCount; ++l)
+    {
+        level += (size_t) width * height * components;
+        reduce(work, width, height, next);
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+
+        pixelCount = (size_t) width * height;
+        for (size_t i = 0; i < pixelCount; ++i)
+        {
+            for (int c = 0; c < components; ++c)
+            {
+                unsigned short v = next[i * 4 + c];
+                level[i * components + c] = c < colorChannels ? g_tables.linearToSrgb[v >> 2] : (unsigned char) ((v * 255 + 32767) / 65535);
+            }
+        }
+
+        unsigned short * swap = work;
+        work = next;
+        next = swap;
+    }
+
+    free(work);
+    free(next);
+}
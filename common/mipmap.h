@@ -0,0 +1,21 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <stddef.h>
+
+// Mip chains are stored contiguously, level 0 first, each level tightly
+// packed with the same number of 8-bit components as level 0.
+
+// Number of levels down to 1x1
+int mipmap_level_count(int width, int height);
+
+// Byte offset of a level from the start of the chain, and total chain size
+size_t mipmap_level_offset(int width, int height, int components, int level);
+size_t mipmap_chain_size(int width, int height, int components);
+
+// Fills levels 1..n of 'chain' from level 0 with a 2x2 box filter. Color
+// channels are averaged in linear space when 'srgb' is set, alpha is always
+// averaged as is.
+void mipmap_generate(unsigned char * chain, int width, int height, int components, bool srgb);
+
+#endif // MIPMAP_H
@@ -0,0 +1,118 @@
+#include "streambuffer.h"
+
+void stream_buffer_init(StreamBuffer & sb, GLenum target, int frameSize)
+{
+    sb.target = target;
+    sb.regionSize = frameSize;
+    sb.region = 0;
+    sb.offset = 0;
+    sb.mapping = 0;
+    sb.orphan = false;
+    sb.stalls = 0;
+    for (int i = 0; i < STREAM_BUFFER_REGIONS; ++i)
+        sb.fences[i] = 0;
+
+    GLsizeiptr size = (GLsizeiptr) frameSize * STREAM_BUFFER_REGIONS;
+    glGenBuffers(1, &sb.buffer);
+    glBindBuffer(target, sb.buffer);
+    sb.persistent = GLEW_ARB_buffer_storage != 0;
+    if (sb.persistent)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(target, size, 0, flags);
+        sb.mapping = (unsigned char *) glMapBufferRange(target, 0, size, flags);
+        if (!sb.mapping)
+        {
+            // Immutable storage cannot be respecified, start over with a new name
+            glDeleteBuffers(1, &sb.buffer);
+            glGenBuffers(1, &sb.buffer);
+            glBindBuffer(target, sb.buffer);
+            sb.persistent = false;
+        }
+    }
+    if (!sb.persistent)
+        glBufferData(target, size, 0, GL_STREAM_DRAW);
+}
+
+void stream_buffer_shutdown(StreamBuffer & sb)
+{
+    for (int i = 0; i < STREAM_BUFFER_REGIONS; ++i)
+    {
+        if (sb.fences[i])
+            glDeleteSync(sb.fences[i]);
+        sb.fences[i] = 0;
+    }
+    if (sb.mapping)
+    {
+        glBindBuffer(sb.target, sb.buffer);
+        glUnmapBuffer(sb.target);
+        sb.mapping = 0;
+    }
+    glDeleteBuffers(1, &sb.buffer);
+    sb.buffer = 0;
+}
+
+static void stream_buffer_next_region(StreamBuffer & sb)
+{
+    if (sb.persistent)
+        sb.fences[sb.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    sb.region = (sb.region + 1) % STREAM_BUFFER_REGIONS;
+    sb.offset = 0;
+
+    // Only waits when the GPU is more than a ring behind
+    GLsync & fence = sb.fences[sb.region];
+    if (fence)
+    {
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+        {
+            ++sb.stalls;
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+                ;
+        }
+        glDeleteSync(fence);
+        fence = 0;
+    }
+    if (!sb.persistent && sb.region == 0)
+        sb.orphan = true;
+}
+
+void * stream_buffer_map(StreamBuffer & sb, int size, int alignment, int & offset)
+{
+    if (size > sb.regionSize)
+        return 0;
+    // Aligned in the buffer, not the region
+    int base = sb.region * sb.regionSize;
+    int start = (base + sb.offset + alignment - 1) / alignment * alignment - base;
+    if (start + size > sb.regionSize)
+    {
+        stream_buffer_next_region(sb);
+        base = sb.region * sb.regionSize;
+        start = (base + alignment - 1) / alignment * alignment - base;
+        if (start + size > sb.regionSize)
+            return 0;
+    }
+    offset = base + start;
+    sb.offset = start + size;
+
+    glBindBuffer(sb.target, sb.buffer);
+    if (sb.persistent)
+        return sb.mapping + offset;
+    // Ranges of the current cycle are never rewritten, those of the last
+    // one live on in the orphaned storage
+    GLbitfield access = GL_MAP_WRITE_BIT | (sb.orphan ? GL_MAP_INVALIDATE_BUFFER_BIT : GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    sb.orphan = false;
+    return glMapBufferRange(sb.target, offset, size, access);
+}
+
+void stream_buffer_unmap(StreamBuffer & sb)
+{
+    if (sb.persistent)
+        return;
+    glBindBuffer(sb.target, sb.buffer);
+    glUnmapBuffer(sb.target);
+}
+
+void stream_buffer_end_frame(StreamBuffer & sb)
+{
+    stream_buffer_next_region(sb);
+}
@@ -0,0 +1,37 @@
+#ifndef STREAMBUFFER_H
+#define STREAMBUFFER_H
+
+#include "glew/glew.h"
+
+// Buffer for data written every frame, vertices or uniforms, cut in a ring
+// of frame regions. With GL_ARB_buffer_storage it stays mapped persistent and
+// coherent, a region is written again once the fence placed after its frame
+// has passed. Otherwise writes go through unsynchronized range mappings and
+// the whole buffer is orphaned when they wrap around.
+static const int STREAM_BUFFER_REGIONS = 3;
+
+struct StreamBuffer
+{
+    GLuint buffer;
+    GLenum target;
+    int regionSize;
+    int region; // Written this frame
+    int offset; // In the region
+    bool persistent;
+    unsigned char * mapping; // Whole buffer on the persistent path
+    GLsync fences[STREAM_BUFFER_REGIONS];
+    bool orphan; // The next fallback mapping invalidates the whole buffer
+    int stalls; // Waits for a region the GPU was still reading, since init
+};
+
+void stream_buffer_init(StreamBuffer & sb, GLenum target, int frameSize);
+void stream_buffer_shutdown(StreamBuffer & sb);
+// Room for size bytes, at most frameSize, aligned on alignment which need not
+// be a power of two. Returns where to write and the offset to bind or draw
+// from, the buffer is left bound to its target. Unmap before drawing.
+void * stream_buffer_map(StreamBuffer & sb, int size, int alignment, int & offset);
+void stream_buffer_unmap(StreamBuffer & sb);
+// Fences the writes of the frame and moves on to the next region
+void stream_buffer_end_frame(StreamBuffer & sb);
+
+#endif // STREAMBUFFER_H
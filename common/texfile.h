@@ -0,0 +1,89 @@
+#ifndef TEXFILE_H
+#define TEXFILE_H
+
+#include <stddef.h>
+
+// Texture container written by the aotex tool and read by aogl through a
+// file mapping. A header and a table of levels come first, followed by the
+// mip tail, the levels smaller than a page packed together, so that the
+// first page holds everything needed to show a texture. Larger levels
+// follow from the smallest to level 0, each starting on a page boundary so
+// streaming one in only touches its own pages. Block compressed levels are
+// stored as rows of 4x4 blocks.
+
+#define TEXFILE_MAGIC "AOTX"
+#define TEXFILE_VERSION 2
+#define TEXFILE_EXTENSION ".aotex"
+#define TEXFILE_MAX_LEVELS 16
+#define TEXFILE_PAGE_SIZE 4096
+
+enum TexFileFormat
+{
+    TEXFILE_RGBA8,
+    TEXFILE_BC1, // RGB, 4 bits per texel
+    TEXFILE_BC3, // RGBA, 8 bits per texel
+    TEXFILE_BC4, // R, 4 bits per texel
+    TEXFILE_BC5, // RG, 8 bits per texel
+    TEXFILE_BC7, // RGBA, 8 bits per texel
+    TEXFILE_FORMAT_COUNT
+};
+
+enum TexFileFlags
+{
+    TEXFILE_SRGB = 1 // Color channels are sRGB encoded
+};
+
+struct TexFileHeader
+{
+    char magic[4];
+    unsigned int version;
+    unsigned int format;
+    unsigned int flags;
+    unsigned int width;
+    unsigned int height;
+    unsigned int levelCount;
+    unsigned int tailLevel; // First level of the mip tail
+};
+
+struct TexFileLevel
+{
+    unsigned long long offset; // From the start of the file
+    unsigned long long size;
+    unsigned int width;
+    unsigned int height;
+};
+
+// Bytes per 4x4 block, or per texel for uncompressed formats
+inline int texfile_block_size(unsigned int format)
+{
+    static const int sizes[TEXFILE_FORMAT_COUNT] = { 4, 8, 16, 8, 16, 16 };
+    return format < TEXFILE_FORMAT_COUNT ? sizes[format] : 0;
+}
+
+inline bool texfile_is_compressed(unsigned int format)
+{
+    return format != TEXFILE_RGBA8;
+}
+
+// Bytes of one row of texels, a row of blocks for compressed formats
+inline size_t texfile_row_size(unsigned int format, unsigned int width)
+{
+    return texfile_is_compressed(format) ? (size_t) ((width + 3) / 4) * texfile_block_size(format) : (size_t) width * texfile_block_size(format);
+}
+
+inline unsigned int texfile_row_count(unsigned int format, unsigned int height)
+{
+    return texfile_is_compressed(format) ? (height + 3) / 4 : height;
+}
+
+inline size_t texfile_level_size(unsigned int format, unsigned int width, unsigned int height)
+{
+    return texfile_row_size(format, width) * texfile_row_count(format, height);
+}
+
+inline size_t texfile_align(size_t offset)
+{
+    return (offset + TEXFILE_PAGE_SIZE - 1) / TEXFILE_PAGE_SIZE * TEXFILE_PAGE_SIZE;
+}
+
+#endif // TEXFILE_H
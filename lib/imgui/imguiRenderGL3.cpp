@@ -31,6 +31,7 @@
 #endif
 
 #include "imgui.h"
+#include "streambuffer.h"
 
 // Some math headers don't have PI defined.
 static const float PI = 3.14159265f;
@@ -67,11 +68,44 @@ static stbtt_bakedchar g_cdata[96]; // ASCII 32..126 is 95 glyphs
 static GLuint g_ftex = 0;
 static GLuint g_whitetex = 0;
 static GLuint g_vao = 0;
-static GLuint g_vbos[3] = {0, 0, 0};
+static StreamBuffer g_stream;
 static GLuint g_program = 0;
 static GLuint g_programViewportLocation = 0;
 static GLuint g_programTextureLocation = 0;
 
+// Interleaved vertex written to the stream buffer
+struct Vertex
+{
+        float x, y;
+        float u, v;
+        float r, g, b, a;
+};
+static const int STREAM_FRAME_SIZE = 1024 * 1024;
+
+// Writes triangles to the stream buffer and draws them, vertices are
+// aligned on their size so the first one is an index
+static void drawTriangles(const float* v, const float* uv, const float* c, int count)
+{
+        int offset = 0;
+        Vertex* out = (Vertex*) stream_buffer_map(g_stream, count * sizeof(Vertex), sizeof(Vertex), offset);
+        if (!out)
+                return;
+        for (int i = 0; i < count; ++i)
+        {
+                out[i].x = v[i*2];
+                out[i].y = v[i*2+1];
+                out[i].u = uv[i*2];
+                out[i].v = uv[i*2+1];
+                out[i].r = c[i*4];
+                out[i].g = c[i*4+1];
+                out[i].b = c[i*4+2];
+                out[i].a = c[i*4+3];
+        }
+        stream_buffer_unmap(g_stream);
+        glBindVertexArray(g_vao);
+        glDrawArrays(GL_TRIANGLES, offset / sizeof(Vertex), count);
+}
+
 inline unsigned int RGBA(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
         return (r) | (g << 8) | (b << 16) | (a << 24);
@@ -121,7 +155,6 @@ static void drawPolygon(const float* coords, unsigned numCoords, float r, unsign
                 g_tempCoords[i*2+1] = coords[i*2+1]+dmy*r;
         }
         
-        int vSize = numCoords * 12 + (numCoords - 2) * 6;
         int uvSize = numCoords * 2 * 6 + (numCoords - 2) * 2 * 3;
         int cSize = numCoords * 4 * 6 + (numCoords - 2) * 4 * 3;
         float * v = g_tempVertices;
@@ -215,14 +248,7 @@ static void drawPolygon(const float* coords, unsigned numCoords, float r, unsign
         }        
         glBindTexture(GL_TEXTURE_2D, g_whitetex);
         
-        glBindVertexArray(g_vao);
-        glBindBuffer(GL_ARRAY_BUFFER, g_vbos[0]);
-        glBufferData(GL_ARRAY_BUFFER, vSize*sizeof(float), v, GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, g_vbos[1]);
-        glBufferData(GL_ARRAY_BUFFER, uvSize*sizeof(float), uv, GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, g_vbos[2]);
-        glBufferData(GL_ARRAY_BUFFER, cSize*sizeof(float), c, GL_STATIC_DRAW);
-        glDrawArrays(GL_TRIANGLES, 0, (numCoords * 2 + numCoords - 2)*3);
+        drawTriangles(v, uv, c, (numCoords * 2 + numCoords - 2)*3);
  
 }
 
@@ -363,23 +389,20 @@ bool imguiRenderGLInit(const unsigned char* ttfBuffer, unsigned int ttfBufferSiz
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
+        // Every draw reads from the start of the stream buffer, offset by its first vertex
         glGenVertexArrays(1, &g_vao);
-        glGenBuffers(3, g_vbos);
+        stream_buffer_init(g_stream, GL_ARRAY_BUFFER, STREAM_FRAME_SIZE);
 
         glBindVertexArray(g_vao);
         glEnableVertexAttribArray(0);
         glEnableVertexAttribArray(1);
         glEnableVertexAttribArray(2);
 
-        glBindBuffer(GL_ARRAY_BUFFER, g_vbos[0]);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*2, (void*)0);
-        glBufferData(GL_ARRAY_BUFFER, 0, 0, GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, g_vbos[1]);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*2, (void*)0);
-        glBufferData(GL_ARRAY_BUFFER, 0, 0, GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, g_vbos[2]);
-        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*4, (void*)0);
-        glBufferData(GL_ARRAY_BUFFER, 0, 0, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, g_stream.buffer);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(2*sizeof(float)));
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(4*sizeof(float)));
+        glBindVertexArray(0);
         g_program = glCreateProgram();
     
         const char * vs =
@@ -448,7 +471,7 @@ void imguiRenderGLDestroy()
         if (g_vao)
         {
             glDeleteVertexArrays(1, &g_vao);
-            glDeleteBuffers(3, g_vbos);
+            stream_buffer_shutdown(g_stream);
             g_vao = 0;
         }
 
@@ -575,14 +598,7 @@ static void drawText(float x, float y, const char *text, int align, unsigned int
                                         r, g, b, a,
                                         r, g, b, a,
                                       };
-                        glBindVertexArray(g_vao);
-                        glBindBuffer(GL_ARRAY_BUFFER, g_vbos[0]);
-                        glBufferData(GL_ARRAY_BUFFER, 12*sizeof(float), v, GL_STATIC_DRAW);
-                        glBindBuffer(GL_ARRAY_BUFFER, g_vbos[1]);
-                        glBufferData(GL_ARRAY_BUFFER, 12*sizeof(float), uv, GL_STATIC_DRAW);
-                        glBindBuffer(GL_ARRAY_BUFFER, g_vbos[2]);
-                        glBufferData(GL_ARRAY_BUFFER, 24*sizeof(float), c, GL_STATIC_DRAW);
-                        glDrawArrays(GL_TRIANGLES, 0, 6);
+                        drawTriangles(v, uv, c, 6);
 
                 }
                 ++text;
@@ -671,4 +687,5 @@ void imguiRenderGLDraw(int width, int height)
                 }
         }
         glDisable(GL_SCISSOR_TEST);
+        stream_buffer_end_frame(g_stream);
 }
\ No newline at end of file
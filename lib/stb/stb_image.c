@@ -20,6 +20,12 @@
       - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
       - decode from arbitrary I/O callbacks
       - overridable dequantizing-IDCT, YCbCr-to-RGB conversion (define STBI_SIMD)
+      - SSE2 dequantizing-IDCT and YCbCr-to-RGB conversion, installed by default
+        when the compiler targets SSE2 (define STBI_NO_SIMD to disable)
+      - decoders are reentrant and the failure reason is per thread; the
+        global settings (gamma, iphone flags, installed idct...) should be
+        set before decoding on several threads. stb_image_batch.h decodes
+        a list of images on a pool of threads.
 
    Latest revisions:
       1.33 (2011-07-14) minor fixes suggested by Dave Moore
@@ -164,6 +170,13 @@
 //     stbi_ldr_to_hdr_scale(1.0f);
 //     stbi_ldr_to_hdr_gamma(2.2f);
 //
+// For GPU upload there is the same interface returning half floats (IEEE
+// binary16, for GL_HALF_FLOAT), at half the memory of the float one:
+//
+//    unsigned short *data = stbi_loadh(filename, &x, &y, &n, 0);
+//
+// Values beyond the half range are clamped to 65504.
+//
 // Finally, given a filename (or an open file or memory block--see header
 // file for details) containing image data, you can query for the "most
 // appropriate" interface to use (that is, whether the image is HDR or
@@ -193,6 +206,8 @@
 #include <stdio.h>
 #endif
 
+#include <stddef.h> // size_t
+
 #define STBI_VERSION 1
 
 enum
@@ -247,6 +262,12 @@ extern stbi_uc *stbi_load_from_callbacks  (stbi_io_callbacks const *clbk, void *
    
    extern float *stbi_loadf_from_callbacks  (stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp);
 
+   extern unsigned short *stbi_loadh_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+
+   #ifndef STBI_NO_STDIO
+   extern unsigned short *stbi_loadh            (char const *filename,   int *x, int *y, int *comp, int req_comp);
+   #endif
+
    extern void   stbi_hdr_to_ldr_gamma(float gamma);
    extern void   stbi_hdr_to_ldr_scale(float scale);
 
@@ -263,13 +284,57 @@ extern int      stbi_is_hdr_from_file(FILE *f);
 #endif // STBI_NO_STDIO
 
 
-// get a VERY brief reason for failure
-// NOT THREADSAFE
+// get a VERY brief reason for failure, of the last failure on this thread
 extern const char *stbi_failure_reason  (void); 
 
-// free the loaded image -- this is just free()
+// free the loaded image -- this is just free(), or the release hook of the
+// allocator that was set on this thread when it was loaded
 extern void     stbi_image_free      (void *retval_from_stbi_load);
 
+// allocator for everything the calling thread's decodes allocate, including
+// the images they return (pass those back to stbi_image_free on this thread
+// with the same allocator set). The struct is copied; NULL restores malloc.
+// resize gets the old size so an arena can grow its last block in place.
+typedef struct
+{
+   void *(*alloc)  (void *user, size_t size);
+   void *(*resize) (void *user, void *p, size_t old_size, size_t new_size);
+   void  (*release)(void *user, void *p);
+   void  *user;
+} stbi_allocator;
+
+extern void     stbi_set_allocator   (stbi_allocator const *a);
+
+// decode like stbi_load but into out, which holds out_size bytes and gets
+// x*y*n of them (n = req_comp, or comp when req_comp is 0). Formats other
+// than GIF decode straight into it unless req_comp needs a conversion pass,
+// otherwise the result is copied. Returns 0 on failure, including out being
+// too small; stbi_info gives the size beforehand.
+extern int      stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *out, int out_size,
+                                           int *x, int *y, int *comp, int req_comp);
+#ifndef STBI_NO_STDIO
+extern int      stbi_load_into       (char const *filename, stbi_uc *out, int out_size,
+                                      int *x, int *y, int *comp, int req_comp);
+#endif
+
+// decode by rows: instead of returning the image, rows are handed to the
+// callback top to bottom, a few at a time, while the rest is still being
+// decoded. Each call gets row_count rows of x*n bytes starting at first_row
+// (n = req_comp, or the components decoded when req_comp is 0), and the
+// image size so the first call can allocate for it. JPEG and non-interlaced
+// PNG only hold a few rows at once; other images are decoded whole and
+// handed over in one call. Return 0 from the callback to stop decoding,
+// which then fails with "aborted".
+typedef int (*stbi_row_callback)(void *user, stbi_uc const *rows, int first_row, int row_count,
+                                 int x, int y, int n);
+
+extern int      stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp,
+                                           stbi_row_callback rows, void *user);
+#ifndef STBI_NO_STDIO
+extern int      stbi_load_rows       (char const *filename, int *x, int *y, int *comp, int req_comp,
+                                      stbi_row_callback rows, void *user);
+#endif
+
 // get image dimensions & components without fully decoding
 extern int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 extern int      stbi_info_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
@@ -282,6 +347,15 @@ extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y,
 
 
 
+// decode an uncompressed or RLE 8/24/32-bit TGA that is in memory (or mapped)
+// straight into out, which holds out_size bytes and gets x*y*req_comp of them.
+// With out NULL only the header is read, to get x, y and comp beforehand.
+// Rows come top first like stbi_load, or bottom first (OpenGL order) with
+// flip_vertically. Returns 0 and sets the failure reason for other images,
+// which stbi_load still reads.
+extern int      stbi_tga_load_into   (stbi_uc const *buffer, int len, stbi_uc *out, int out_size,
+                                      int *x, int *y, int *comp, int req_comp, int flip_vertically);
+
 // for image formats that explicitly notate that they have premultiplied alpha,
 // we just return the colors as stored in the file. set this flag to force
 // unpremultiplication. results are undefined if the unpremultiply overflow.
@@ -303,6 +377,15 @@ extern int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const cha
 
 
 // define faster low-level operations (typically SIMD support)
+// SSE2 versions are built in and installed by default when the compiler
+// targets SSE2, which is always the case on x86-64
+#if !defined(STBI_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBI_SSE2
+#ifndef STBI_SIMD
+#define STBI_SIMD
+#endif
+#endif
+
 #ifdef STBI_SIMD
 typedef void (*stbi_idct_8x8)(stbi_uc *out, int out_stride, short data[64], unsigned short *dequantize);
 // compute an integer IDCT on "input"
@@ -317,6 +400,7 @@ typedef void (*stbi_YCbCr_to_RGB_run)(stbi_uc *output, stbi_uc const  *y, stbi_u
 //     cb: Cb input channel; scale/biased to be 0..255
 //     cr: Cr input channel; scale/biased to be 0..255
 
+// NULL installs the built-in version back
 extern void stbi_install_idct(stbi_idct_8x8 func);
 extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 #endif // STBI_SIMD
@@ -346,6 +430,18 @@ extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 #include <assert.h>
 #include <stdarg.h>
 
+#ifdef STBI_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
+#elif defined(__GNUC__)
+#define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
+#else
+#define STBI_SIMD_ALIGN(type, name) type name
+#endif
+
 #ifndef _MSC_VER
    #ifdef __cplusplus
    #define stbi_inline inline
@@ -364,9 +460,15 @@ typedef   signed short  int16;
 typedef unsigned int   uint32;
 typedef   signed int    int32;
 typedef unsigned int   uint;
+#ifdef _MSC_VER
+typedef unsigned __int64 uint64;
+#else
+typedef unsigned long long uint64;
+#endif
 
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
+typedef unsigned char validate_uint64[sizeof(uint64)==8 ? 1 : -1];
 
 #if defined(STBI_NO_STDIO) && !defined(STBI_NO_WRITE)
 #define STBI_NO_WRITE
@@ -374,6 +476,12 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
 
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 
+#ifdef _MSC_VER
+#define STBI_THREAD_LOCAL __declspec(thread)
+#else
+#define STBI_THREAD_LOCAL __thread
+#endif
+
 #ifdef _MSC_VER
 #define STBI_HAS_LROTL
 #endif
@@ -485,15 +593,31 @@ static int      stbi_psd_test(stbi *s);
 static stbi_uc *stbi_psd_load(stbi *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi_hdr_test(stbi *s);
 static float   *stbi_hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp);
+static uint16  *stbi_hdr_loadh(stbi *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi_pic_test(stbi *s);
 static stbi_uc *stbi_pic_load(stbi *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi_gif_test(stbi *s);
 static stbi_uc *stbi_gif_load(stbi *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi_gif_info(stbi *s, int *x, int *y, int *comp);
 
+// stbi_load_rows: decoded rows are collected here and handed to the
+// callback a batch at a time
+typedef struct
+{
+   stbi_row_callback callback;
+   void *user;
+   int req_comp;
+   uint8 *buffer;       // cap rows of x*n bytes
+   int x, y, n, cap;
+   int first, count;    // rows waiting in the buffer
+} stbi_rows;
 
-// this is not threadsafe
-static const char *failure_reason;
+static int      stbi_jpeg_load_rows(stbi *s, stbi_rows *rows, int *x, int *y, int *comp);
+static int      stbi_png_load_rows(stbi *s, stbi_rows *rows, int *x, int *y, int *comp);
+
+
+// one per thread, so that decoding on several threads doesn't mix reasons
+static STBI_THREAD_LOCAL const char *failure_reason;
 
 const char *stbi_failure_reason(void)
 {
@@ -521,14 +645,58 @@ static int e(const char *str)
 #define epf(x,y)   ((float *) (e(x,y)?NULL:NULL))
 #define epuc(x,y)  ((unsigned char *) (e(x,y)?NULL:NULL))
 
+// the allocator set on this thread, plain malloc when allocator_set is 0
+static STBI_THREAD_LOCAL stbi_allocator allocator;
+static STBI_THREAD_LOCAL int allocator_set;
+
+// stbi_load_into: the caller's buffer, which the first final result that
+// fits in it claims (see stbi_malloc_result) instead of allocating
+static STBI_THREAD_LOCAL uint8 *into_buffer;
+static STBI_THREAD_LOCAL size_t into_size;
+static STBI_THREAD_LOCAL uint8 *into_claimed;
+
+void stbi_set_allocator(stbi_allocator const *a)
+{
+   if (a) allocator = *a;
+   allocator_set = a != NULL;
+}
+
+static void *stbi_malloc(size_t size)
+{
+   return allocator_set ? allocator.alloc(allocator.user, size) : malloc(size);
+}
+
+static void *stbi_realloc(void *p, size_t old_size, size_t new_size)
+{
+   return allocator_set ? allocator.resize(allocator.user, p, old_size, new_size) : realloc(p, new_size);
+}
+
+static void stbi_free(void *p)
+{
+   // the claimed buffer belongs to the caller of stbi_load_into
+   if (p == NULL || p == into_claimed) return;
+   if (allocator_set) allocator.release(allocator.user, p);
+   else               free(p);
+}
+
+// allocate the buffer a loader returns as is, so stbi_load_into can hand
+// out the caller's memory; only call it where no conversion follows
+static void *stbi_malloc_result(size_t size)
+{
+   if (into_buffer && !into_claimed && size <= into_size)
+      return into_claimed = into_buffer;
+   return stbi_malloc(size);
+}
+
 void stbi_image_free(void *retval_from_stbi_load)
 {
-   free(retval_from_stbi_load);
+   stbi_free(retval_from_stbi_load);
 }
 
 #ifndef STBI_NO_HDR
 static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp);
+static uint16  *ldr_to_half(stbi_uc *data, int x, int y, int comp);
 #endif
 
 static unsigned char *stbi_load_main(stbi *s, int *x, int *y, int *comp, int req_comp)
@@ -586,6 +754,136 @@ unsigned char *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *use
    return stbi_load_main(&s,x,y,comp,req_comp);
 }
 
+static int stbi_load_into_main(stbi *s, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp)
+{
+   int w, h, c, ok = 0;
+   stbi_uc *result;
+   into_buffer  = out;
+   into_size    = out_size > 0 ? (size_t) out_size : 0;
+   into_claimed = NULL;
+   result = stbi_load_main(s, &w, &h, &c, req_comp);
+   into_buffer = NULL;
+   if (result) {
+      size_t size = (size_t) w * h * (req_comp ? req_comp : c);
+      if (result == out || size <= into_size) {
+         if (result != out) memcpy(out, result, size);
+         *x = w;
+         *y = h;
+         if (comp) *comp = c;
+         ok = 1;
+      } else
+         e("output too small", "Output buffer too small");
+      stbi_free(result);
+   }
+   into_claimed = NULL;
+   return ok;
+}
+
+int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *out, int out_size,
+                               int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_mem(&s,buffer,len);
+   return stbi_load_into_main(&s,out,out_size,x,y,comp,req_comp);
+}
+
+static int rows_begin(stbi_rows *r, int x, int y, int n, int cap)
+{
+   r->x = x;
+   r->y = y;
+   r->n = n;
+   r->cap = cap < y ? cap : y;
+   r->first = r->count = 0;
+   // one spare byte, as the JPEG color conversion writes a 4th byte for RGB
+   r->buffer = (uint8 *) stbi_malloc((size_t) r->cap * x * n + 1);
+   if (!r->buffer) return e("outofmem", "Out of memory");
+   return 1;
+}
+
+static int rows_flush(stbi_rows *r)
+{
+   if (r->count) {
+      if (!r->callback(r->user, r->buffer, r->first, r->count, r->x, r->y, r->n))
+         return e("aborted", "Row callback stopped decoding");
+      r->first += r->count;
+      r->count = 0;
+   }
+   return 1;
+}
+
+// where the next row goes, NULL when the callback stopped decoding
+static uint8 *rows_next(stbi_rows *r)
+{
+   if (r->count == r->cap && !rows_flush(r)) return NULL;
+   return r->buffer + (size_t) r->count++ * r->x * r->n;
+}
+
+static int stbi_load_rows_main(stbi *s, int *x, int *y, int *comp, stbi_rows *r)
+{
+   stbi_uc *data;
+   int ok = 0;
+   r->buffer = NULL;
+   if (r->req_comp < 0 || r->req_comp > 4) return e("bad req_comp", "Internal error");
+   if (stbi_jpeg_test(s))
+      ok = stbi_jpeg_load_rows(s, r, x, y, comp);
+   else if (stbi_png_test(s))
+      ok = stbi_png_load_rows(s, r, x, y, comp);
+   else if ((data = stbi_load_main(s, x, y, comp, r->req_comp)) != NULL) {
+      // everything else only decodes whole images
+      int n = r->req_comp ? r->req_comp : *comp;
+      ok = r->callback(r->user, data, 0, *y, *x, *y, n) || e("aborted", "Row callback stopped decoding");
+      stbi_free(data);
+   }
+   stbi_free(r->buffer);
+   return ok;
+}
+
+int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp,
+                               stbi_row_callback rows, void *user)
+{
+   stbi s;
+   stbi_rows r;
+   r.callback = rows;
+   r.user = user;
+   r.req_comp = req_comp;
+   start_mem(&s,buffer,len);
+   return stbi_load_rows_main(&s,x,y,comp,&r);
+}
+
+#ifndef STBI_NO_STDIO
+int stbi_load_rows(char const *filename, int *x, int *y, int *comp, int req_comp,
+                   stbi_row_callback rows, void *user)
+{
+   FILE *f = fopen(filename, "rb");
+   stbi s;
+   stbi_rows r;
+   int ok;
+   if (!f) return e("can't fopen", "Unable to open file");
+   r.callback = rows;
+   r.user = user;
+   r.req_comp = req_comp;
+   start_file(&s,f);
+   ok = stbi_load_rows_main(&s,x,y,comp,&r);
+   fclose(f);
+   return ok;
+}
+#endif
+
+#ifndef STBI_NO_STDIO
+int stbi_load_into(char const *filename, stbi_uc *out, int out_size,
+                   int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f = fopen(filename, "rb");
+   stbi s;
+   int ok;
+   if (!f) return e("can't fopen", "Unable to open file");
+   start_file(&s,f);
+   ok = stbi_load_into_main(&s,out,out_size,x,y,comp,req_comp);
+   fclose(f);
+   return ok;
+}
+#endif
+
 #ifndef STBI_NO_HDR
 
 float *stbi_loadf_main(stbi *s, int *x, int *y, int *comp, int req_comp)
@@ -634,6 +932,38 @@ float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 }
 #endif // !STBI_NO_STDIO
 
+static uint16 *stbi_loadh_main(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *data;
+   if (stbi_hdr_test(s))
+      return stbi_hdr_loadh(s,x,y,comp,req_comp);
+   data = stbi_load_main(s, x, y, comp, req_comp);
+   if (data)
+      return ldr_to_half(data, *x, *y, req_comp ? req_comp : *comp);
+   return (uint16 *) epuc("unknown image type", "Image not of any known type, or corrupt");
+}
+
+unsigned short *stbi_loadh_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_mem(&s,buffer,len);
+   return stbi_loadh_main(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+unsigned short *stbi_loadh(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f = fopen(filename, "rb");
+   stbi s;
+   uint16 *result;
+   if (!f) return (uint16 *) epuc("can't fopen", "Unable to open file");
+   start_file(&s,f);
+   result = stbi_loadh_main(&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+#endif // !STBI_NO_STDIO
+
 #endif // !STBI_NO_HDR
 
 // these is-hdr-or-not is defined independent of whether STBI_NO_HDR is
@@ -831,19 +1161,54 @@ static uint8 compute_y(int r, int g, int b)
    return (uint8) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
-static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
+#ifdef STBI_SSE2
+// RGB<->RGBA for the whole image as one long row, four pixels per step:
+// each pixel is moved into place with a byte shift and a mask
+static void convert_rgb_rgba_sse2(unsigned char *dest, unsigned char *src, int img_n, uint n)
+{
+   uint i = 0;
+   __m128i m0 = _mm_setr_epi32(0x00ffffff, 0, 0, 0);
+   __m128i m1 = _mm_setr_epi32(0, 0x00ffffff, 0, 0);
+   __m128i m2 = _mm_setr_epi32(0, 0, 0x00ffffff, 0);
+   __m128i m3 = _mm_setr_epi32(0, 0, 0, 0x00ffffff);
+   if (img_n == 3) {
+      __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+      // 16-byte loads read 4 bytes past the 4 pixels used
+      for (; i + 6 <= n; i += 4, src += 12, dest += 16) {
+         __m128i v = _mm_loadu_si128((__m128i const *) src);
+         __m128i o = _mm_or_si128(_mm_and_si128(v, m0), _mm_and_si128(_mm_slli_si128(v, 1), m1));
+         o = _mm_or_si128(o, _mm_and_si128(_mm_slli_si128(v, 2), m2));
+         o = _mm_or_si128(o, _mm_and_si128(_mm_slli_si128(v, 3), m3));
+         _mm_storeu_si128((__m128i *) dest, _mm_or_si128(o, alpha));
+      }
+      for (; i < n; ++i, src += 3, dest += 4)
+         dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255;
+   } else {
+      // 16-byte stores write 4 bytes past the 4 pixels produced
+      for (; i + 6 <= n; i += 4, src += 16, dest += 12) {
+         __m128i v = _mm_loadu_si128((__m128i const *) src);
+         __m128i o = _mm_or_si128(_mm_and_si128(v, m0), _mm_srli_si128(_mm_and_si128(v, m1), 1));
+         o = _mm_or_si128(o, _mm_srli_si128(_mm_and_si128(v, m2), 2));
+         o = _mm_or_si128(o, _mm_srli_si128(_mm_and_si128(v, m3), 3));
+         _mm_storeu_si128((__m128i *) dest, o);
+      }
+      for (; i < n; ++i, src += 4, dest += 3)
+         dest[0]=src[0],dest[1]=src[1],dest[2]=src[2];
+   }
+}
+#endif
+
+// convert x*y pixels of img_n components to req_comp components
+static void convert_pixels(unsigned char *good, unsigned char *data, int img_n, int req_comp, uint x, uint y)
 {
    int i,j;
-   unsigned char *good;
 
-   if (req_comp == img_n) return data;
-   assert(req_comp >= 1 && req_comp <= 4);
-
-   good = (unsigned char *) malloc(req_comp * x * y);
-   if (good == NULL) {
-      free(data);
-      return epuc("outofmem", "Out of memory");
+#ifdef STBI_SSE2
+   if ((img_n == 3 && req_comp == 4) || (img_n == 4 && req_comp == 3)) {
+      convert_rgb_rgba_sse2(good, data, img_n, x * y);
+      return;
    }
+#endif
 
    for (j=0; j < (int) y; ++j) {
       unsigned char *src  = data + j * x * img_n   ;
@@ -870,43 +1235,165 @@ static unsigned char *convert_format(unsigned char *data, int img_n, int req_com
       }
       #undef CASE
    }
+}
 
-   free(data);
+static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
+{
+   unsigned char *good;
+
+   if (req_comp == img_n) return data;
+   assert(req_comp >= 1 && req_comp <= 4);
+
+   good = (unsigned char *) stbi_malloc_result(req_comp * x * y);
+   if (good == NULL) {
+      stbi_free(data);
+      return epuc("outofmem", "Out of memory");
+   }
+   convert_pixels(good, data, img_n, req_comp, x, y);
+   stbi_free(data);
    return good;
 }
 
 #ifndef STBI_NO_HDR
+// round to the nearest half (ties to even), clamping to the largest finite
+// one; NaN becomes 65504 too
+static uint16 float_to_half(float f)
+{
+   union { float f; uint32 u; } v;
+   uint32 sign;
+   v.f = f;
+   sign = (v.u >> 16) & 0x8000;
+   v.u &= 0x7fffffff;
+   if (v.u > 0x477fe000) v.u = 0x477fe000;
+   if (v.u < (113 << 23)) {
+      // half denormal or zero: adding 0.5 lines the mantissa up with the
+      // low 10 bits, and the float addition does the rounding
+      v.f += 0.5f;
+      return (uint16) (sign | (v.u - 0x3f000000));
+   }
+   // rebias the exponent; the +0xfff plus the odd bit rounds to even
+   return (uint16) (sign | ((v.u + ((uint32) (15 - 127) << 23) + 0xfff + ((v.u >> 13) & 1)) >> 13));
+}
+
+#ifdef STBI_SSE2
+// float_to_half for 4 non-negative lanes, each result in the low 16 bits
+static __m128i float_to_half_sse2(__m128 f)
+{
+   __m128i u = _mm_castps_si128(_mm_min_ps(f, _mm_set1_ps(65504.0f)));
+   __m128i denorm = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(u), _mm_set1_ps(0.5f))), _mm_set1_epi32(0x3f000000));
+   __m128i odd = _mm_and_si128(_mm_srli_epi32(u, 13), _mm_set1_epi32(1));
+   __m128i normal = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(u, _mm_set1_epi32((int) ((uint32) (15 - 127) << 23) + 0xfff)), odd), 13);
+   __m128i small = _mm_cmplt_epi32(u, _mm_set1_epi32(113 << 23));
+   return _mm_or_si128(_mm_and_si128(small, denorm), _mm_andnot_si128(small, normal));
+}
+#endif
+
+// the float for every 8-bit value, so promoting an image costs a lookup per
+// component instead of a pow
+static void ldr_to_hdr_table(float color[256], float alpha[256])
+{
+   int i;
+   for (i=0; i < 256; ++i) {
+      color[i] = (float) pow(i/255.0f, l2h_gamma) * l2h_scale;
+      alpha[i] = i/255.0f;
+   }
+}
+
 static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 {
    int i,k,n;
-   float *output = (float *) malloc(x * y * comp * sizeof(float));
-   if (output == NULL) { free(data); return epf("outofmem", "Out of memory"); }
+   float color[256], alpha[256];
+   float *output = (float *) stbi_malloc(x * y * comp * sizeof(float));
+   if (output == NULL) { stbi_free(data); return epf("outofmem", "Out of memory"); }
+   ldr_to_hdr_table(color, alpha);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) pow(data[i*comp+k]/255.0f, l2h_gamma) * l2h_scale;
+         output[i*comp + k] = color[data[i*comp+k]];
       }
-      if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
+      if (k < comp) output[i*comp + k] = alpha[data[i*comp+k]];
    }
-   free(data);
+   stbi_free(data);
+   return output;
+}
+
+static uint16  *ldr_to_half(stbi_uc *data, int x, int y, int comp)
+{
+   int i,k,n;
+   float color[256], alpha[256];
+   uint16 color_h[256], alpha_h[256];
+   uint16 *output = (uint16 *) stbi_malloc(x * y * comp * sizeof(uint16));
+   if (output == NULL) { stbi_free(data); return (uint16 *) epuc("outofmem", "Out of memory"); }
+   ldr_to_hdr_table(color, alpha);
+   for (i=0; i < 256; ++i) {
+      color_h[i] = float_to_half(color[i]);
+      alpha_h[i] = float_to_half(alpha[i]);
+   }
+   // compute number of non-alpha components
+   if (comp & 1) n = comp; else n = comp-1;
+   for (i=0; i < x*y; ++i) {
+      for (k=0; k < n; ++k) {
+         output[i*comp + k] = color_h[data[i*comp+k]];
+      }
+      if (k < comp) output[i*comp + k] = alpha_h[data[i*comp+k]];
+   }
+   stbi_free(data);
    return output;
 }
 
 #define float2int(x)   ((int) (x))
+
+static int hdr_to_ldr_value(float f)
+{
+   float z = (float) pow(f*h2l_scale_i, h2l_gamma_i) * 255 + 0.5f;
+   if (!(z >= 0)) z = 0;   // NaN too
+   if (z > 255) z = 255;
+   return float2int(z);
+}
+
+// threshold[k] is the smallest non-negative float the curve maps to k or
+// more; float bits order like the floats, so bisect on the bits. Searching
+// the table then gives exactly the bytes of the pow, 8 compares apiece.
+// Only valid while the curve rises, i.e. for positive gamma and scale.
+static void hdr_to_ldr_table(float threshold[256])
+{
+   union { float f; uint32 u; } v;
+   int k;
+   for (k=1; k < 256; ++k) {
+      uint32 lo = 0, hi = 0x7f800000;
+      while (lo < hi) {
+         v.u = lo + (hi - lo) / 2;
+         if (hdr_to_ldr_value(v.f) >= k) hi = v.u; else lo = v.u + 1;
+      }
+      v.u = lo;
+      threshold[k] = v.f;
+   }
+}
+
 static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
 {
-   int i,k,n;
-   stbi_uc *output = (stbi_uc *) malloc(x * y * comp);
-   if (output == NULL) { free(data); return epuc("outofmem", "Out of memory"); }
+   int i,k,n,step,table;
+   float threshold[256];
+   stbi_uc *output;
+   if (data == NULL) return NULL;
+   output = (stbi_uc *) stbi_malloc_result(x * y * comp);
+   if (output == NULL) { stbi_free(data); return epuc("outofmem", "Out of memory"); }
+   table = h2l_gamma_i > 0 && h2l_scale_i > 0;
+   if (table) hdr_to_ldr_table(threshold);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*h2l_scale_i, h2l_gamma_i) * 255 + 0.5f;
-         if (z < 0) z = 0;
-         if (z > 255) z = 255;
-         output[i*comp + k] = (uint8) float2int(z);
+         float f = data[i*comp+k];
+         int v = 0;
+         if (table && f >= 0) {
+            // the last threshold reached
+            for (step=128; step; step >>= 1)
+               if (f >= threshold[v + step]) v += step;
+         } else
+            v = hdr_to_ldr_value(f);
+         output[i*comp + k] = (uint8) v;
       }
       if (k < comp) {
          float z = data[i*comp+k] * 255 + 0.5f;
@@ -915,7 +1402,7 @@ static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (uint8) float2int(z);
       }
    }
-   free(data);
+   stbi_free(data);
    return output;
 }
 #endif
@@ -961,6 +1448,19 @@ typedef struct
    int    delta[17];   // old 'firstsymbol' - old 'firstcode'
 } huffman;
 
+typedef uint8 *(*resample_row_func)(uint8 *out, uint8 *in0, uint8 *in1,
+                                    int w, int hs);
+
+typedef struct
+{
+   resample_row_func resample;
+   uint8 *line0,*line1;
+   int hs,vs;   // expansion factor in each axis
+   int w_lores; // horizontal pixels pre-expansion 
+   int ystep;   // how far through vertical expansion we are
+   int ypos;    // which pre-expansion row we're on
+} stbi_resample;
+
 typedef struct
 {
    #ifdef STBI_SIMD
@@ -986,6 +1486,7 @@ typedef struct
       int dc_pred;
 
       int x,y,w2,h2;
+      int ring;   // plane rows kept when decoding by rows, 0 for all h2
       uint8 *data;
       void *raw_data;
       uint8 *linebuf;
@@ -998,6 +1499,14 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+
+// resampling and color conversion of the output rows
+   int out_n, decode_n;   // components output, and decoded for them
+   stbi_resample res_comp[4];
+
+// stbi_load_rows: rows are output as the MCU rows they need are decoded
+   stbi_rows *rows;
+   int rows_done;
 } jpeg;
 
 static int build_huffman(huffman *h, int *count)
@@ -1310,12 +1819,200 @@ static void idct_block(uint8 *out, int out_stride, short data[64], stbi_dequanti
    }
 }
 
+#ifdef STBI_SSE2
+// SSE2 version of idct_block, same fixed point steps so the output matches
+// it exactly. Columns are done for 8 at once in 16-bit lanes, widened to
+// 32 bits around the multiplies, then the block is transposed for the rows.
+static void idct_block_sse2(uint8 *out, int out_stride, short data[64], unsigned short *dequantize)
+{
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i hi, lo, overflow, tmp;
+   int i;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm_setr_epi16((short) (x),(short) (y),(short) (x),(short) (y),(short) (x),(short) (y),(short) (x),(short) (y))
+
+   // out0 = c0[even]*x + c0[odd]*y, out1 = c1[even]*x + c1[odd]*y, 32-bit
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
+      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
+      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
+      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
+      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+
+   // out = in << 12, 16-bit in, 32-bit out
+   #define dct_widen(out, in) \
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by s and pack back to 16 bits
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
+
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   // IDCT_1D on 8 columns, the rotations fold its shared products into
+   // pairs of constants
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m128i rot0_0 = dct_const(f2f(0.5411961f), f2f(0.5411961f) + f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(f2f(0.5411961f) + f2f( 0.765366865f), f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(f2f(1.175875602f) + f2f(-0.899976223f), f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(f2f(1.175875602f), f2f(1.175875602f) + f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(f2f(-1.961570560f) + f2f( 0.298631336f), f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(f2f(-1.961570560f), f2f(-1.961570560f) + f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(f2f(-0.390180644f) + f2f( 2.053119869f), f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(f2f(-0.390180644f), f2f(-0.390180644f) + f2f( 1.501321110f));
+
+   // rounding biases of the column and row passes, see idct_block
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // dequantize. Products over 15 bits, which could overflow the 16-bit
+   // sums, only come from broken or extreme files, those blocks go through
+   // the scalar version
+   __m128i rows[8];
+   overflow = _mm_setzero_si128();
+   for (i=0; i < 8; ++i) {
+      __m128i d = _mm_load_si128((const __m128i *) (data + i*8));
+      __m128i q = _mm_loadu_si128((const __m128i *) (dequantize + i*8));
+      lo = _mm_mullo_epi16(d, q);
+      hi = _mm_mulhi_epi16(d, q);
+      tmp = _mm_srai_epi16(lo, 15);
+      overflow = _mm_or_si128(overflow, _mm_or_si128(_mm_xor_si128(hi, tmp), _mm_xor_si128(_mm_srai_epi16(lo, 14), tmp)));
+      rows[i] = lo;
+   }
+   if (_mm_movemask_epi8(_mm_cmpeq_epi8(overflow, _mm_setzero_si128())) != 0xffff) {
+      idct_block(out, out_stride, data, dequantize);
+      return;
+   }
+   row0 = rows[0]; row1 = rows[1]; row2 = rows[2]; row3 = rows[3];
+   row4 = rows[4]; row5 = rows[5]; row6 = rows[6]; row7 = rows[7];
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16-bit 8x8 transpose
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack with unsigned saturation, that is the 0..255 clamp
+      __m128i p0 = _mm_packus_epi16(row0, row1);
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8-bit 8x8 transpose
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+   #undef dct_const
+   #undef dct_rot
+   #undef dct_widen
+   #undef dct_wadd
+   #undef dct_wsub
+   #undef dct_bfly32o
+   #undef dct_interleave8
+   #undef dct_interleave16
+   #undef dct_pass
+}
+#endif // STBI_SSE2
+
 #ifdef STBI_SIMD
-static stbi_idct_8x8 stbi_idct_installed = idct_block;
+#ifdef STBI_SSE2
+#define STBI_IDCT_DEFAULT idct_block_sse2
+#else
+#define STBI_IDCT_DEFAULT idct_block
+#endif
+static stbi_idct_8x8 stbi_idct_installed = STBI_IDCT_DEFAULT;
 
 void stbi_install_idct(stbi_idct_8x8 func)
 {
-   stbi_idct_installed = func;
+   stbi_idct_installed = func ? func : STBI_IDCT_DEFAULT;
 }
 #endif
 
@@ -1352,15 +2049,21 @@ static void reset(jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// where the block at x,y of component n is decoded to
+stbi_inline static uint8 *jpeg_block(jpeg *z, int n, int x, int y)
+{
+   if (z->img_comp[n].ring) y %= z->img_comp[n].ring;
+   return z->img_comp[n].data + z->img_comp[n].w2*y + x;
+}
+
+static int jpeg_emit_rows(jpeg *z, int ready);
+
 static int parse_entropy_coded_data(jpeg *z)
 {
    reset(z);
    if (z->scan_n == 1) {
       int i,j;
-      #ifdef STBI_SIMD
-      __declspec(align(16))
-      #endif
-      short data[64];
+      STBI_SIMD_ALIGN(short, data[64]);
       int n = z->order[0];
       // non-interleaved data, we just need to process one block at a time,
       // in trivial scanline order
@@ -1372,9 +2075,9 @@ static int parse_entropy_coded_data(jpeg *z)
          for (i=0; i < w; ++i) {
             if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
             #ifdef STBI_SIMD
-            stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
+            stbi_idct_installed(jpeg_block(z, n, i*8, j*8), z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
             #else
-            idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+            idct_block(jpeg_block(z, n, i*8, j*8), z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
             #endif
             // every data block is an MCU, so countdown the restart interval
             if (--z->todo <= 0) {
@@ -1385,10 +2088,12 @@ static int parse_entropy_coded_data(jpeg *z)
                reset(z);
             }
          }
+         // a single component image is all in this scan
+         if (z->rows && z->s->img_n == 1 && !jpeg_emit_rows(z, (j+1)*8)) return 0;
       }
    } else { // interleaved!
       int i,j,k,x,y;
-      short data[64];
+      STBI_SIMD_ALIGN(short, data[64]);
       for (j=0; j < z->img_mcu_y; ++j) {
          for (i=0; i < z->img_mcu_x; ++i) {
             // scan an interleaved mcu... process scan_n components in order
@@ -1402,9 +2107,9 @@ static int parse_entropy_coded_data(jpeg *z)
                      int y2 = (j*z->img_comp[n].v + y)*8;
                      if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
                      #ifdef STBI_SIMD
-                     stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
+                     stbi_idct_installed(jpeg_block(z, n, x2, y2), z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
                      #else
-                     idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+                     idct_block(jpeg_block(z, n, x2, y2), z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
                      #endif
                   }
                }
@@ -1419,6 +2124,7 @@ static int parse_entropy_coded_data(jpeg *z)
                reset(z);
             }
          }
+         if (z->rows && z->scan_n == z->s->img_n && !jpeg_emit_rows(z, (j+1)*z->img_mcu_h)) return 0;
       }
    }
    return 1;
@@ -1518,6 +2224,45 @@ static int process_scan_header(jpeg *z)
    return 1;
 }
 
+// with ring set, the planes only keep two MCU rows, which is all that
+// decoding by rows needs
+static int jpeg_alloc_planes(jpeg *z, int ring)
+{
+   int i;
+   for (i=0; i < z->s->img_n; ++i) {
+      int h = z->img_comp[i].h2;
+      z->img_comp[i].ring = ring && 16 * z->img_comp[i].v < h ? 16 * z->img_comp[i].v : 0;
+      if (z->img_comp[i].ring) h = z->img_comp[i].ring;
+      z->img_comp[i].raw_data = stbi_malloc(z->img_comp[i].w2 * h+15);
+      if (z->img_comp[i].raw_data == NULL) {
+         for(--i; i >= 0; --i) {
+            stbi_free(z->img_comp[i].raw_data);
+            z->img_comp[i].data = NULL;
+         }
+         return e("outofmem", "Out of memory");
+      }
+      // align blocks for installable-idct using mmx/sse
+      z->img_comp[i].data = (uint8*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+      z->img_comp[i].linebuf = NULL;
+   }
+   return 1;
+}
+
+// components in separate scans are only resampled once the last one is in,
+// so they need whole planes; called before the first scan is decoded
+static int jpeg_whole_planes(jpeg *z)
+{
+   int i, ring = 0;
+   for (i=0; i < z->s->img_n; ++i)
+      ring |= z->img_comp[i].ring;
+   if (!ring) return 1;
+   for (i=0; i < z->s->img_n; ++i) {
+      stbi_free(z->img_comp[i].raw_data);
+      z->img_comp[i].data = NULL;
+   }
+   return jpeg_alloc_planes(z, 0);
+}
+
 static int process_frame_header(jpeg *z, int scan)
 {
    stbi *s = z->s;
@@ -1574,20 +2319,9 @@ static int process_frame_header(jpeg *z, int scan)
       // discard the extra data until colorspace conversion
       z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
       z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-      z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
-      if (z->img_comp[i].raw_data == NULL) {
-         for(--i; i >= 0; --i) {
-            free(z->img_comp[i].raw_data);
-            z->img_comp[i].data = NULL;
-         }
-         return e("outofmem", "Out of memory");
-      }
-      // align blocks for installable-idct using mmx/sse
-      z->img_comp[i].data = (uint8*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      z->img_comp[i].linebuf = NULL;
    }
 
-   return 1;
+   return jpeg_alloc_planes(z, z->rows != NULL);
 }
 
 // use comparisons since in some cases we handle more than one case (e.g. SOF)
@@ -1627,6 +2361,7 @@ static int decode_jpeg_image(jpeg *j)
    while (!EOI(m)) {
       if (SOS(m)) {
          if (!process_scan_header(j)) return 0;
+         if (j->rows && j->scan_n != j->s->img_n && !jpeg_whole_planes(j)) return 0;
          if (!parse_entropy_coded_data(j)) return 0;
          if (j->marker == MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
@@ -1651,9 +2386,6 @@ static int decode_jpeg_image(jpeg *j)
 
 // static jfif-centered resampling (across block boundaries)
 
-typedef uint8 *(*resample_row_func)(uint8 *out, uint8 *in0, uint8 *in1,
-                                    int w, int hs);
-
 #define div4(x) ((uint8) ((x) >> 2))
 
 static uint8 *resample_row_1(uint8 *out, uint8 *in_near, uint8 *in_far, int w, int hs)
@@ -1769,12 +2501,84 @@ static void YCbCr_to_RGB_row(uint8 *out, const uint8 *y, const uint8 *pcb, const
    }
 }
 
+#ifdef STBI_SSE2
+// SSE2 version of YCbCr_to_RGB_row with the same fixed point math. The
+// constants do not fit 16 bits, so each product is split into a 16-bit
+// multiply-add and a shift: c*x = (c - (k<<16))*x + (x<<16)*k.
+static void YCbCr_to_RGB_row_sse2(uint8 *out, const uint8 *y, const uint8 *pcb, const uint8 *pcr, int count, int step)
+{
+   int i = 0;
+   __m128i zero = _mm_setzero_si128();
+   __m128i bias = _mm_set1_epi16(128);
+   __m128i round = _mm_set1_epi32(32768);
+   __m128i alpha = _mm_set1_epi8((char) 255);
+   // madd pairs are (cr, cb)
+   __m128i cr_r = _mm_setr_epi16(float2fixed(1.40200f) - 65536, 0, float2fixed(1.40200f) - 65536, 0, float2fixed(1.40200f) - 65536, 0, float2fixed(1.40200f) - 65536, 0);
+   __m128i crcb_g = _mm_setr_epi16(65536 - float2fixed(0.71414f), -float2fixed(0.34414f), 65536 - float2fixed(0.71414f), -float2fixed(0.34414f),
+                                   65536 - float2fixed(0.71414f), -float2fixed(0.34414f), 65536 - float2fixed(0.71414f), -float2fixed(0.34414f));
+   __m128i cb_b = _mm_setr_epi16(0, float2fixed(1.77200f) - 131072, 0, float2fixed(1.77200f) - 131072, 0, float2fixed(1.77200f) - 131072, 0, float2fixed(1.77200f) - 131072);
+
+   for (; i + 8 <= count; i += 8) {
+      __m128i yw = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (y + i)), zero);
+      __m128i cbw = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcb + i)), zero), bias);
+      __m128i crw = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcr + i)), zero), bias);
+      __m128i rgb[3][2];
+      int h;
+      for (h=0; h < 2; ++h) {
+         __m128i y32 = h ? _mm_unpackhi_epi16(zero, yw) : _mm_unpacklo_epi16(zero, yw); // y << 16
+         __m128i crcb = h ? _mm_unpackhi_epi16(crw, cbw) : _mm_unpacklo_epi16(crw, cbw);
+         __m128i cr16 = h ? _mm_unpackhi_epi16(zero, crw) : _mm_unpacklo_epi16(zero, crw); // cr << 16
+         __m128i cb16 = h ? _mm_unpackhi_epi16(zero, cbw) : _mm_unpacklo_epi16(zero, cbw); // cb << 16
+         __m128i r, g, b;
+         y32 = _mm_add_epi32(y32, round);
+         r = _mm_add_epi32(_mm_add_epi32(y32, cr16), _mm_madd_epi16(crcb, cr_r));
+         g = _mm_sub_epi32(_mm_add_epi32(y32, _mm_madd_epi16(crcb, crcb_g)), cr16);
+         b = _mm_add_epi32(_mm_add_epi32(y32, _mm_slli_epi32(cb16, 1)), _mm_madd_epi16(crcb, cb_b));
+         rgb[0][h] = _mm_srai_epi32(r, 16);
+         rgb[1][h] = _mm_srai_epi32(g, 16);
+         rgb[2][h] = _mm_srai_epi32(b, 16);
+      }
+      {
+         // saturating packs do the 0..255 clamp
+         __m128i r = _mm_packs_epi32(rgb[0][0], rgb[0][1]);
+         __m128i g = _mm_packs_epi32(rgb[1][0], rgb[1][1]);
+         __m128i b = _mm_packs_epi32(rgb[2][0], rgb[2][1]);
+         __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+         __m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), alpha);
+         __m128i rgba0 = _mm_unpacklo_epi16(rg, ba);
+         __m128i rgba1 = _mm_unpackhi_epi16(rg, ba);
+         if (step == 4) {
+            _mm_storeu_si128((__m128i *) out, rgba0);
+            _mm_storeu_si128((__m128i *) (out + 16), rgba1);
+            out += 32;
+         } else {
+            STBI_SIMD_ALIGN(uint8, rgba[32]);
+            int j;
+            _mm_store_si128((__m128i *) rgba, rgba0);
+            _mm_store_si128((__m128i *) (rgba + 16), rgba1);
+            for (j=0; j < 8; ++j, out += step) {
+               out[0] = rgba[j*4+0];
+               out[1] = rgba[j*4+1];
+               out[2] = rgba[j*4+2];
+            }
+         }
+      }
+   }
+   YCbCr_to_RGB_row(out, y + i, pcb + i, pcr + i, count - i, step);
+}
+#endif // STBI_SSE2
+
 #ifdef STBI_SIMD
-static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed = YCbCr_to_RGB_row;
+#ifdef STBI_SSE2
+#define STBI_YCBCR_DEFAULT YCbCr_to_RGB_row_sse2
+#else
+#define STBI_YCBCR_DEFAULT YCbCr_to_RGB_row
+#endif
+static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed = STBI_YCBCR_DEFAULT;
 
 void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func)
 {
-   stbi_YCbCr_installed = func;
+   stbi_YCbCr_installed = func ? func : STBI_YCBCR_DEFAULT;
 }
 #endif
 
@@ -1785,124 +2589,140 @@ static void cleanup_jpeg(jpeg *j)
    int i;
    for (i=0; i < j->s->img_n; ++i) {
       if (j->img_comp[i].data) {
-         free(j->img_comp[i].raw_data);
+         stbi_free(j->img_comp[i].raw_data);
          j->img_comp[i].data = NULL;
       }
       if (j->img_comp[i].linebuf) {
-         free(j->img_comp[i].linebuf);
+         stbi_free(j->img_comp[i].linebuf);
          j->img_comp[i].linebuf = NULL;
       }
    }
 }
 
-typedef struct
+// set up resampling and color conversion to n components
+static int jpeg_output_begin(jpeg *z, int n)
 {
-   resample_row_func resample;
-   uint8 *line0,*line1;
-   int hs,vs;   // expansion factor in each axis
-   int w_lores; // horizontal pixels pre-expansion 
-   int ystep;   // how far through vertical expansion we are
-   int ypos;    // which pre-expansion row we're on
-} stbi_resample;
+   int k;
+   z->out_n = n;
+   if (z->s->img_n == 3 && n < 3)
+      z->decode_n = 1;
+   else
+      z->decode_n = z->s->img_n;
+
+   for (k=0; k < z->decode_n; ++k) {
+      stbi_resample *r = &z->res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (uint8 *) stbi_malloc(z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return e("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = resample_row_hv_2;
+      else                               r->resample = resample_row_generic;
+   }
+   return 1;
+}
+
+// resample and color-convert the next row into out
+static void jpeg_output_row(jpeg *z, uint8 *out)
+{
+   int k, n = z->out_n;
+   uint i;
+   uint8 *coutput[4];
+
+   for (k=0; k < z->decode_n; ++k) {
+      stbi_resample *r = &z->res_comp[k];
+      int y_bot = r->ystep >= (r->vs >> 1);
+      coutput[k] = r->resample(z->img_comp[k].linebuf,
+                               y_bot ? r->line1 : r->line0,
+                               y_bot ? r->line0 : r->line1,
+                               r->w_lores, r->hs);
+      if (++r->ystep >= r->vs) {
+         r->ystep = 0;
+         r->line0 = r->line1;
+         if (++r->ypos < z->img_comp[k].y)
+            r->line1 = jpeg_block(z, k, 0, r->ypos);
+      }
+   }
+   if (n >= 3) {
+      uint8 *y = coutput[0];
+      if (z->s->img_n == 3) {
+         #ifdef STBI_SIMD
+         stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s->img_x, n);
+         #else
+         YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s->img_x, n);
+         #endif
+      } else
+         for (i=0; i < z->s->img_x; ++i) {
+            out[0] = out[1] = out[2] = y[i];
+            out[3] = 255; // not used if n==3
+            out += n;
+         }
+   } else {
+      uint8 *y = coutput[0];
+      if (n == 1)
+         for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+      else
+         for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
+   }
+}
+
+// output the rows that the first ready rows' worth of planes make up
+static int jpeg_emit_rows(jpeg *z, int ready)
+{
+   // up to img_v_max rows above ready still resample from the plane row below
+   int end = ready >= (int) z->s->img_y ? (int) z->s->img_y : ready - z->img_v_max;
+   if (!z->rows->buffer) {
+      if (!jpeg_output_begin(z, z->rows->req_comp ? z->rows->req_comp : z->s->img_n)) return 0;
+      if (!rows_begin(z->rows, z->s->img_x, z->s->img_y, z->out_n, z->img_mcu_h)) return 0;
+   }
+   for (; z->rows_done < end; ++z->rows_done) {
+      uint8 *out = rows_next(z->rows);
+      if (!out) return 0;
+      jpeg_output_row(z, out);
+   }
+   return rows_flush(z->rows);
+}
 
 static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
-   int n, decode_n;
+   int n;
+   uint j;
+   uint8 *output;
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
    z->s->img_n = 0;
+   z->rows = NULL;
 
    // load a jpeg image from whichever source
    if (!decode_jpeg_image(z)) { cleanup_jpeg(z); return NULL; }
 
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n;
-
-   if (z->s->img_n == 3 && n < 3)
-      decode_n = 1;
-   else
-      decode_n = z->s->img_n;
-
-   // resample and color-convert
-   {
-      int k;
-      uint i,j;
-      uint8 *output;
-      uint8 *coutput[4];
-
-      stbi_resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi_resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (uint8 *) malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = resample_row_hv_2;
-         else                               r->resample = resample_row_generic;
-      }
-
-      // can't error after this so, this is safe
-      output = (uint8 *) malloc(n * z->s->img_x * z->s->img_y + 1);
-      if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         uint8 *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi_resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            uint8 *y = coutput[0];
-            if (z->s->img_n == 3) {
-               #ifdef STBI_SIMD
-               stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
-               #else
-               YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               #endif
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            uint8 *y = coutput[0];
-            if (n == 1)
-               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-            else
-               for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
-         }
-      }
-      cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp  = z->s->img_n; // report original components, not output
-      return output;
-   }
+   if (!jpeg_output_begin(z, n)) { cleanup_jpeg(z); return NULL; }
+
+   // can't error after this so, this is safe
+   output = (uint8 *) stbi_malloc_result(n * z->s->img_x * z->s->img_y + 1);
+   if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+
+   // now go ahead and resample
+   for (j=0; j < z->s->img_y; ++j)
+      jpeg_output_row(z, output + n * z->s->img_x * j);
+   cleanup_jpeg(z);
+   *out_x = z->s->img_x;
+   *out_y = z->s->img_y;
+   if (comp) *comp  = z->s->img_n; // report original components, not output
+   return output;
 }
 
 static unsigned char *stbi_jpeg_load(stbi *s, int *x, int *y, int *comp, int req_comp)
@@ -1912,6 +2732,25 @@ static unsigned char *stbi_jpeg_load(stbi *s, int *x, int *y, int *comp, int req
    return load_jpeg_image(&j, x,y,comp,req_comp);
 }
 
+static int stbi_jpeg_load_rows(stbi *s, stbi_rows *rows, int *x, int *y, int *comp)
+{
+   jpeg j;
+   int ok;
+   j.s = s;
+   j.rows = rows;
+   j.rows_done = 0;
+   s->img_n = 0;
+   // rows are handed over as the scan with all components goes, the ones
+   // left (or all of them, for components in separate scans) at the end
+   ok = decode_jpeg_image(&j) && jpeg_emit_rows(&j, s->img_y);
+   cleanup_jpeg(&j);
+   if (!ok) return 0;
+   *x = s->img_x;
+   *y = s->img_y;
+   if (comp) *comp = s->img_n;
+   return 1;
+}
+
 static int stbi_jpeg_test(stbi *s)
 {
    int r;
@@ -1946,17 +2785,20 @@ static int stbi_jpeg_info(stbi *s, int *x, int *y, int *comp)
 //      - all input must be provided in an upfront buffer
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
-//      - fast huffman
+//      - fast huffman, with two literals per lookup when both codes are short
+//      - 64-bit bit buffer refilled a word at a time
+//      - matches copied 8 bytes at a time when they don't overlap a word
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define ZFAST_BITS  9 // accelerate all cases in default tables
+#define ZFAST_BITS  11 // accelerate all cases in default tables, and most of the dynamic ones
 #define ZFAST_MASK  ((1 << ZFAST_BITS) - 1)
+#define ZFAST_SIZE_SHIFT 9
 
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   uint16 fast[1 << ZFAST_BITS];
+   uint16 fast[1 << ZFAST_BITS]; // (code size << ZFAST_SIZE_SHIFT) | symbol, 0 if the code is longer
    uint16 firstcode[16];
    int maxcode[17];
    uint16 firstsymbol[16];
@@ -1988,7 +2830,7 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
 
    // DEFLATE spec for generating codes
    memset(sizes, 0, sizeof(sizes));
-   memset(z->fast, 255, sizeof(z->fast));
+   memset(z->fast, 0, sizeof(z->fast));
    for (i=0; i < num; ++i) 
       ++sizes[sizelist[i]];
    sizes[0] = 0;
@@ -2015,8 +2857,9 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
          z->value[c] = (uint16)i;
          if (s <= ZFAST_BITS) {
             int k = bit_reverse(next_code[s],s);
+            uint16 fastv = (uint16) ((s << ZFAST_SIZE_SHIFT) | i);
             while (k < (1 << ZFAST_BITS)) {
-               z->fast[k] = (uint16) c;
+               z->fast[k] = fastv;
                k += (1 << s);
             }
          }
@@ -2036,7 +2879,7 @@ typedef struct
 {
    uint8 *zbuffer, *zbuffer_end;
    int num_bits;
-   uint32 code_buffer;
+   uint64 code_buffer; // bits above num_bits are either 0 or the next input bits
 
    char *zout;
    char *zout_start;
@@ -2044,6 +2887,15 @@ typedef struct
    int   z_expandable;
 
    zhuffman z_length, z_distance;
+   // two literals decoded by one lookup in z_length:
+   // lit0 | (lit1 << 8) | (total code size << 16), 0 if not a literal pair
+   uint32 zfast_pair[1 << ZFAST_BITS];
+
+   // when set, gets the output from zout_start+flushed on after each block
+   // and returns how much of it it used, or -1 to stop
+   int (*flush)(void *user, uint8 *data, int len);
+   void *flush_user;
+   int flushed;
 } zbuf;
 
 stbi_inline static int zget8(zbuf *z)
@@ -2052,20 +2904,41 @@ stbi_inline static int zget8(zbuf *z)
    return *z->zbuffer++;
 }
 
+stbi_inline static uint64 zload64(uint8 *p)
+{
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__) || \
+    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+   uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   return (uint64) p[0]       | ((uint64) p[1] <<  8) | ((uint64) p[2] << 16) | ((uint64) p[3] << 24) |
+         ((uint64) p[4] << 32) | ((uint64) p[5] << 40) | ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+#endif
+}
+
+// tops the bit buffer up to at least 56 bits
 static void fill_bits(zbuf *z)
 {
-   do {
-      assert(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= zget8(z) << z->num_bits;
-      z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      // load a whole word and keep the bytes that fit; the partial byte
+      // shifted in on top is the next input and gets or'ed in again later
+      z->code_buffer |= zload64(z->zbuffer) << z->num_bits;
+      z->zbuffer += (63 - z->num_bits) >> 3;
+      z->num_bits |= 56;
+   } else {
+      do {
+         z->code_buffer |= (uint64) zget8(z) << z->num_bits;
+         z->num_bits += 8;
+      } while (z->num_bits <= 56);
+   }
 }
 
 stbi_inline static unsigned int zreceive(zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;   
@@ -2076,16 +2949,16 @@ stbi_inline static int zhuffman_decode(zbuf *a, zhuffman *z)
    int b,s,k;
    if (a->num_bits < 16) fill_bits(a);
    b = z->fast[a->code_buffer & ZFAST_MASK];
-   if (b < 0xffff) {
-      s = z->size[b];
+   if (b) {
+      s = b >> ZFAST_SIZE_SHIFT;
       a->code_buffer >>= s;
       a->num_bits -= s;
-      return z->value[b];
+      return b & ((1 << ZFAST_SIZE_SHIFT) - 1);
    }
 
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = bit_reverse(a->code_buffer, 16);
+   k = bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -2101,13 +2974,13 @@ stbi_inline static int zhuffman_decode(zbuf *a, zhuffman *z)
 static int expand(zbuf *z, int n)  // need to make room for n bytes
 {
    char *q;
-   int cur, limit;
+   int cur, limit, old_limit;
    if (!z->z_expandable) return e("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
-   limit = (int) (z->zout_end - z->zout_start);
+   limit = old_limit = (int) (z->zout_end - z->zout_start);
    while (cur + n > limit)
       limit *= 2;
-   q = (char *) realloc(z->zout_start, limit);
+   q = (char *) stbi_realloc(z->zout_start, old_limit, limit);
    if (q == NULL) return e("outofmem", "Out of memory");
    z->zout_start = q;
    z->zout       = q + cur;
@@ -2129,34 +3002,143 @@ static int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
 static int dist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// fill zfast_pair from z_length: an index whose low bits are a short literal
+// code followed by another literal code that still fits in ZFAST_BITS
+static void zbuild_pairs(zbuf *a)
+{
+   int k;
+   for (k=0; k < (1 << ZFAST_BITS); ++k) {
+      int b0 = a->z_length.fast[k], b1, s0, s1;
+      a->zfast_pair[k] = 0;
+      if (!b0 || (b0 & ((1 << ZFAST_SIZE_SHIFT) - 1)) >= 256) continue;
+      s0 = b0 >> ZFAST_SIZE_SHIFT;
+      // fast[] repeats every entry for all the high bits it doesn't look at,
+      // so the entry for the remaining bits is right if its code fits in them
+      b1 = a->z_length.fast[k >> s0];
+      if (!b1 || (b1 & ((1 << ZFAST_SIZE_SHIFT) - 1)) >= 256) continue;
+      s1 = b1 >> ZFAST_SIZE_SHIFT;
+      if (s0 + s1 > ZFAST_BITS) continue;
+      a->zfast_pair[k] = (uint32) ((b0 & 255) | ((b1 & 255) << 8) | ((s0 + s1) << 16));
+   }
+}
+
+// the output pointer and bit buffer live in locals in here, since writes
+// through zout could otherwise alias them and force every access to memory
+#define ZSAVE()  (a->zout = zout, a->code_buffer = code_buffer, a->num_bits = num_bits)
+#define ZLOAD()  (zout = a->zout, code_buffer = a->code_buffer, num_bits = a->num_bits)
+
 static int parse_huffman_block(zbuf *a)
 {
+   char *zout = a->zout;
+   uint64 code_buffer = a->code_buffer;
+   int num_bits = a->num_bits;
    for(;;) {
-      int z = zhuffman_decode(a, &a->z_length);
+      int z,s;
+      uint32 pair;
+      // a literal/length code with its extra bits and a distance code with
+      // its extra bits take at most 15+5+15+13 bits, so one refill per symbol
+      if (num_bits < 48) {
+         ZSAVE();
+         fill_bits(a);
+         ZLOAD();
+      }
+      pair = a->zfast_pair[code_buffer & ZFAST_MASK];
+      if (pair) {
+         if (zout + 2 > a->zout_end) {
+            ZSAVE();
+            if (!expand(a, 2)) return 0;
+            ZLOAD();
+         }
+         zout[0] = (char) (pair & 255);
+         zout[1] = (char) ((pair >> 8) & 255);
+         zout += 2;
+         code_buffer >>= pair >> 16;
+         num_bits -= pair >> 16;
+         continue;
+      }
+      z = a->z_length.fast[code_buffer & ZFAST_MASK];
+      if (z) {
+         s = z >> ZFAST_SIZE_SHIFT;
+         code_buffer >>= s;
+         num_bits -= s;
+         z &= (1 << ZFAST_SIZE_SHIFT) - 1;
+      } else {
+         ZSAVE();
+         z = zhuffman_decode(a, &a->z_length);
+         ZLOAD();
+      }
       if (z < 256) {
          if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
-         *a->zout++ = (char) z;
+         if (zout >= a->zout_end) {
+            ZSAVE();
+            if (!expand(a, 1)) return 0;
+            ZLOAD();
+         }
+         *zout++ = (char) z;
       } else {
-         uint8 *p;
+         char *p;
          int len,dist;
-         if (z == 256) return 1;
+         if (z == 256) {
+            ZSAVE();
+            return 1;
+         }
          z -= 257;
+         if (z >= 29) return e("bad huffman code","Corrupt PNG");
          len = length_base[z];
-         if (length_extra[z]) len += zreceive(a, length_extra[z]);
-         z = zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return e("bad huffman code","Corrupt PNG");
+         if (length_extra[z]) {
+            len += (int) (code_buffer & ((1 << length_extra[z]) - 1));
+            code_buffer >>= length_extra[z];
+            num_bits -= length_extra[z];
+         }
+         z = a->z_distance.fast[code_buffer & ZFAST_MASK];
+         if (z) {
+            s = z >> ZFAST_SIZE_SHIFT;
+            code_buffer >>= s;
+            num_bits -= s;
+            z &= (1 << ZFAST_SIZE_SHIFT) - 1;
+         } else {
+            ZSAVE();
+            z = zhuffman_decode(a, &a->z_distance);
+            ZLOAD();
+         }
+         if (z < 0 || z >= 30) return e("bad huffman code","Corrupt PNG");
          dist = dist_base[z];
-         if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
-         if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
-         if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
-         p = (uint8 *) (a->zout - dist);
-         while (len--)
-            *a->zout++ = *p++;
+         if (dist_extra[z]) {
+            dist += (int) (code_buffer & ((1 << dist_extra[z]) - 1));
+            code_buffer >>= dist_extra[z];
+            num_bits -= dist_extra[z];
+         }
+         if (zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
+         if (zout + len > a->zout_end) {
+            ZSAVE();
+            if (!expand(a, len)) return 0;
+            ZLOAD();
+         }
+         p = zout - dist;
+         if (dist >= 8 && a->zout_end - zout >= len + 8) {
+            // whole words never overlap the bytes they read; the last one
+            // may spill up to 7 bytes past the match, inside the buffer
+            char *end = zout + len;
+            do {
+               memcpy(zout, p, 8);
+               zout += 8;
+               p += 8;
+            } while (zout < end);
+            zout = end;
+         } else if (dist == 1) {
+            memset(zout, *p, len);
+            zout += len;
+         } else {
+            while (len--)
+               *zout++ = *p++;
+         }
       }
    }
 }
 
+#undef ZSAVE
+#undef ZLOAD
+
 static int compute_huffman_codes(zbuf *a)
 {
    static uint8 length_dezigzag[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
@@ -2200,6 +3182,7 @@ static int compute_huffman_codes(zbuf *a)
    if (n != hlit+hdist) return e("bad codelengths","Corrupt PNG");
    if (!zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
    if (!zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   zbuild_pairs(a);
    return 1;
 }
 
@@ -2211,24 +3194,32 @@ static int parse_uncompressed_block(zbuf *a)
       zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (uint8) (a->code_buffer & 255); // wtf this warns?
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
-   assert(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
       header[k++] = (uint8) zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return e("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!expand(a, len)) return 0;
+   // the 64-bit buffer can still hold the first bytes of the block
+   while (a->num_bits > 0 && len > 0) {
+      *a->zout++ = (char) (a->code_buffer & 255);
+      a->code_buffer >>= 8;
+      a->num_bits -= 8;
+      --len;
+   }
+   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
    memcpy(a->zout, a->zbuffer, len);
    a->zbuffer += len;
    a->zout += len;
+   // lookahead bits above num_bits were loaded before the copy skipped ahead
+   a->code_buffer &= ((uint64) 1 << a->num_bits) - 1;
    return 1;
 }
 
@@ -2245,20 +3236,43 @@ static int parse_zlib_header(zbuf *a)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static uint8 default_length[288], default_distance[32];
-static void init_defaults(void)
+// fixed code lengths from the spec: 0-143 are 8 bits, 144-255 are 9,
+// 256-279 are 7 and 280-287 are 8; all distances are 5 bits
+static uint8 default_length[288] =
+{
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
+};
+static uint8 default_distance[32] =
 {
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     default_length[i]   = 8;
-   for (   ; i <= 255; ++i)     default_length[i]   = 9;
-   for (   ; i <= 279; ++i)     default_length[i]   = 7;
-   for (   ; i <= 287; ++i)     default_length[i]   = 8;
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+};
 
-   for (i=0; i <=  31; ++i)     default_distance[i] = 5;
+STBI_THREAD_LOCAL int stbi_png_partial; // a quick hack to only allow decoding some of a PNG... I should implement real streaming support instead
+// hand the new output to the flush callback, then drop what it used once
+// that is most of the buffer, keeping the 32k window matches reach back into
+static int zflush(zbuf *a)
+{
+   int len = (int) (a->zout - a->zout_start), drop;
+   int used = a->flush(a->flush_user, (uint8 *) a->zout_start + a->flushed, len - a->flushed);
+   if (used < 0) return 0;
+   a->flushed += used;
+   drop = len - 32768 < a->flushed ? len - 32768 : a->flushed;
+   if (drop > (a->zout_end - a->zout_start) / 2) {
+      memmove(a->zout_start, a->zout_start + drop, len - drop);
+      a->zout    -= drop;
+      a->flushed -= drop;
+   }
+   return 1;
 }
 
-int stbi_png_partial; // a quick hack to only allow decoding some of a PNG... I should implement real streaming support instead
 static int parse_zlib(zbuf *a, int parse_header)
 {
    int final, type;
@@ -2276,14 +3290,15 @@ static int parse_zlib(zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!default_distance[31]) init_defaults();
             if (!zbuild_huffman(&a->z_length  , default_length  , 288)) return 0;
             if (!zbuild_huffman(&a->z_distance, default_distance,  32)) return 0;
+            zbuild_pairs(a);
          } else {
             if (!compute_huffman_codes(a)) return 0;
          }
          if (!parse_huffman_block(a)) return 0;
       }
+      if (a->flush && !zflush(a)) return 0;
       if (stbi_png_partial && a->zout - a->zout_start > 65536)
          break;
    } while (!final);
@@ -2296,6 +3311,7 @@ static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->flush = NULL;
 
    return parse_zlib(a, parse_header);
 }
@@ -2303,7 +3319,7 @@ static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
 char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
 {
    zbuf a;
-   char *p = (char *) malloc(initial_size);
+   char *p = (char *) stbi_malloc(initial_size);
    if (p == NULL) return NULL;
    a.zbuffer = (uint8 *) buffer;
    a.zbuffer_end = (uint8 *) buffer + len;
@@ -2311,7 +3327,7 @@ char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      free(a.zout_start);
+      stbi_free(a.zout_start);
       return NULL;
    }
 }
@@ -2324,7 +3340,7 @@ char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
 char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
 {
    zbuf a;
-   char *p = (char *) malloc(initial_size);
+   char *p = (char *) stbi_malloc(initial_size);
    if (p == NULL) return NULL;
    a.zbuffer = (uint8 *) buffer;
    a.zbuffer_end = (uint8 *) buffer + len;
@@ -2332,7 +3348,7 @@ char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len,
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      free(a.zout_start);
+      stbi_free(a.zout_start);
       return NULL;
    }
 }
@@ -2351,7 +3367,7 @@ int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int il
 char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int *outlen)
 {
    zbuf a;
-   char *p = (char *) malloc(16384);
+   char *p = (char *) stbi_malloc(16384);
    if (p == NULL) return NULL;
    a.zbuffer = (uint8 *) buffer;
    a.zbuffer_end = (uint8 *) buffer+len;
@@ -2359,7 +3375,7 @@ char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int *outlen)
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      free(a.zout_start);
+      stbi_free(a.zout_start);
       return NULL;
    }
 }
@@ -2415,6 +3431,7 @@ typedef struct
 {
    stbi *s;
    uint8 *idata, *expanded, *out;
+   stbi_rows *rows;   // stbi_load_rows: rows go here instead of out
 } png;
 
 
@@ -2439,16 +3456,185 @@ static int paeth(int a, int b, int c)
    return c;
 }
 
+#ifdef STBI_SSE2
+// whole 32-bit moves, except for the last pixel of a row where the spare
+// byte may be past the end of raw or of the row being written
+stbi_inline static __m128i png_load_px(uint8 *p, int n)
+{
+   int v = 0;
+   if (n == 4) memcpy(&v, p, 4);
+   else        memcpy(&v, p, 3);
+   return _mm_cvtsi32_si128(v);
+}
+
+stbi_inline static void png_store_px(uint8 *p, __m128i v, int n)
+{
+   int i = _mm_cvtsi128_si32(v);
+   if (n == 4) memcpy(p, &i, 4);
+   else        memcpy(p, &i, 3);
+}
+
+// unfilter a whole row of 3 or 4 channel pixels. The filters depend on the
+// pixel to the left, so Sub/Avg/Paeth go a pixel at a time with all of its
+// channels in one register; Paeth works in 16-bit lanes. The spare lane of
+// 3 channel pixels is garbage that only affects itself, and is overwritten
+// by the next pixel or by the alpha of out_n == img_n+1. prior is only
+// read by the filters that use it.
+static void png_unfilter_row_sse2(int filter, uint8 *cur, uint8 *prior, uint8 *raw, uint32 x, int img_n, int out_n)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i one = _mm_set1_epi8(1);
+   __m128i alpha = _mm_cvtsi32_si128(img_n != out_n ? (int) 0xff000000 : 0);
+   __m128i a = zero, b, c = zero, d;
+   uint32 i = 0;
+   int ln = 4, sn = 4; // load and store sizes
+
+   if (img_n == out_n && (filter == F_none || filter == F_up)) {
+      uint32 n = x * img_n;
+      if (filter == F_none) {
+         memcpy(cur, raw, n);
+         return;
+      }
+      for (; i + 16 <= n; i += 16)
+         _mm_storeu_si128((__m128i *) (cur + i), _mm_add_epi8(_mm_loadu_si128((__m128i const *) (raw + i)),
+                                                              _mm_loadu_si128((__m128i const *) (prior + i))));
+      for (; i < n; ++i)
+         cur[i] = raw[i] + prior[i];
+      return;
+   }
+
+   #define PIXELS  for (; i < x; ++i, raw += img_n, cur += out_n, prior += out_n, \
+                        ln = i + 1 < x ? 4 : img_n, sn = i + 1 < x ? 4 : out_n)
+   if (x == 1) ln = img_n, sn = out_n;
+   switch (filter) {
+      case F_none:
+         PIXELS {
+            png_store_px(cur, _mm_or_si128(png_load_px(raw, ln), alpha), sn);
+         }
+         break;
+      case F_sub:
+      case F_paeth_first: // paeth(a,0,0) is a
+         PIXELS {
+            a = _mm_add_epi8(png_load_px(raw, ln), a);
+            png_store_px(cur, _mm_or_si128(a, alpha), sn);
+         }
+         break;
+      case F_up:
+         PIXELS {
+            d = _mm_add_epi8(png_load_px(raw, ln), png_load_px(prior, 4));
+            png_store_px(cur, _mm_or_si128(d, alpha), sn);
+         }
+         break;
+      case F_avg:
+      case F_avg_first:
+         PIXELS {
+            b = filter == F_avg ? png_load_px(prior, 4) : zero;
+            // avg_epu8 rounds up, (a+b)>>1 doesn't
+            d = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            a = _mm_add_epi8(png_load_px(raw, ln), d);
+            png_store_px(cur, _mm_or_si128(a, alpha), sn);
+         }
+         break;
+      case F_paeth:
+         // a and c are kept widened
+         PIXELS {
+            __m128i pa, pb, pc, smallest, pick;
+            b = _mm_unpacklo_epi8(png_load_px(prior, 4), zero);
+            pa = _mm_sub_epi16(b, c);          // p-a = b-c
+            pb = _mm_sub_epi16(a, c);          // p-b = a-c
+            pc = _mm_add_epi16(pa, pb);        // p-c = a+b-2c
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            // a if pa is smallest, else b if pb is, else c
+            pick = _mm_cmpeq_epi16(pb, smallest);
+            d = _mm_or_si128(_mm_and_si128(pick, b), _mm_andnot_si128(pick, c));
+            pick = _mm_cmpeq_epi16(pa, smallest);
+            d = _mm_or_si128(_mm_and_si128(pick, a), _mm_andnot_si128(pick, d));
+            d = _mm_add_epi8(png_load_px(raw, ln), _mm_packus_epi16(d, d));
+            png_store_px(cur, _mm_or_si128(d, alpha), sn);
+            a = _mm_unpacklo_epi8(d, zero);
+            c = b;
+         }
+         break;
+   }
+   #undef PIXELS
+}
+#endif
+
+// unfilter one row of x pixels from raw into cur, prior is the row above
+static void png_unfilter_row(int filter, uint8 *cur, uint8 *prior, uint8 *raw, uint32 x, int img_n, int out_n)
+{
+   uint32 i;
+   int k;
+#ifdef STBI_SSE2
+   if (img_n >= 3) {
+      png_unfilter_row_sse2(filter, cur, prior, raw, x, img_n, out_n);
+      return;
+   }
+#endif
+   // handle first pixel explicitly
+   for (k=0; k < img_n; ++k) {
+      switch (filter) {
+         case F_none       : cur[k] = raw[k]; break;
+         case F_sub        : cur[k] = raw[k]; break;
+         case F_up         : cur[k] = raw[k] + prior[k]; break;
+         case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
+         case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
+         case F_avg_first  : cur[k] = raw[k]; break;
+         case F_paeth_first: cur[k] = raw[k]; break;
+      }
+   }
+   if (img_n != out_n) cur[img_n] = 255;
+   raw += img_n;
+   cur += out_n;
+   prior += out_n;
+   // this is a little gross, so that we don't switch per-pixel or per-component
+   if (img_n == out_n) {
+      #define CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
+                for (k=0; k < img_n; ++k)
+      switch (filter) {
+         CASE(F_none)  cur[k] = raw[k]; break;
+         CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
+         CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
+         CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
+         CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
+         CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
+         CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
+      }
+      #undef CASE
+   } else {
+      assert(img_n+1 == out_n);
+      #define CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
+                for (k=0; k < img_n; ++k)
+      switch (filter) {
+         CASE(F_none)  cur[k] = raw[k]; break;
+         CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
+         CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
+         CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
+         CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
+         CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
+         CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
+      }
+      #undef CASE
+   }
+}
+
 // create the png data from post-deflated data
-static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y)
+// is_result: a->out is returned without conversion (see stbi_malloc_result)
+static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y, int is_result)
 {
    stbi *s = a->s;
-   uint32 i,j,stride = x*out_n;
-   int k;
+   uint32 j,stride = x*out_n;
    int img_n = s->img_n; // copy it into a local for later
    assert(out_n == s->img_n || out_n == s->img_n+1);
    if (stbi_png_partial) y = 1;
-   a->out = (uint8 *) malloc(x * y * out_n);
+   a->out = (uint8 *) (is_result ? stbi_malloc_result(x * y * out_n) : stbi_malloc(x * y * out_n));
    if (!a->out) return e("outofmem", "Out of memory");
    if (!stbi_png_partial) {
       if (s->img_x == x && s->img_y == y) {
@@ -2459,76 +3645,28 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
    }
    for (j=0; j < y; ++j) {
       uint8 *cur = a->out + stride*j;
-      uint8 *prior = cur - stride;
       int filter = *raw++;
       if (filter > 4) return e("invalid filter","Corrupt PNG");
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
-      // handle first pixel explicitly
-      for (k=0; k < img_n; ++k) {
-         switch (filter) {
-            case F_none       : cur[k] = raw[k]; break;
-            case F_sub        : cur[k] = raw[k]; break;
-            case F_up         : cur[k] = raw[k] + prior[k]; break;
-            case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
-            case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
-            case F_avg_first  : cur[k] = raw[k]; break;
-            case F_paeth_first: cur[k] = raw[k]; break;
-         }
-      }
-      if (img_n != out_n) cur[img_n] = 255;
-      raw += img_n;
-      cur += out_n;
-      prior += out_n;
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (img_n == out_n) {
-         #define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
-                   for (k=0; k < img_n; ++k)
-         switch (filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
-         }
-         #undef CASE
-      } else {
-         assert(img_n+1 == out_n);
-         #define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
-                   for (k=0; k < img_n; ++k)
-         switch (filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
-         }
-         #undef CASE
-      }
+      png_unfilter_row(filter, cur, cur - stride, raw, x, img_n, out_n);
+      raw += x * img_n;
    }
    return 1;
 }
 
-static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced)
+static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced, int is_result)
 {
    uint8 *final;
    int p;
    int save;
    if (!interlaced)
-      return create_png_image_raw(a, raw, raw_len, out_n, a->s->img_x, a->s->img_y);
+      return create_png_image_raw(a, raw, raw_len, out_n, a->s->img_x, a->s->img_y, is_result && !stbi_png_partial);
    save = stbi_png_partial;
    stbi_png_partial = 0;
 
    // de-interlacing
-   final = (uint8 *) malloc(a->s->img_x * a->s->img_y * out_n);
+   final = (uint8 *) (is_result ? stbi_malloc_result(a->s->img_x * a->s->img_y * out_n) : stbi_malloc(a->s->img_x * a->s->img_y * out_n));
    for (p=0; p < 7; ++p) {
       int xorig[] = { 0,4,0,2,0,1,0 };
       int yorig[] = { 0,0,4,0,2,0,1 };
@@ -2539,15 +3677,15 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
       x = (a->s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
-         if (!create_png_image_raw(a, raw, raw_len, out_n, x, y)) {
-            free(final);
+         if (!create_png_image_raw(a, raw, raw_len, out_n, x, y, 0)) {
+            stbi_free(final);
             return 0;
          }
          for (j=0; j < y; ++j)
             for (i=0; i < x; ++i)
                memcpy(final + (j*yspc[p]+yorig[p])*a->s->img_x*out_n + (i*xspc[p]+xorig[p])*out_n,
                       a->out + (j*x+i)*out_n, out_n);
-         free(a->out);
+         stbi_free(a->out);
          raw += (x*out_n+1)*y;
          raw_len -= (x*out_n+1)*y;
       }
@@ -2558,11 +3696,9 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
    return 1;
 }
 
-static int compute_transparency(png *z, uint8 tc[3], int out_n)
+static int compute_transparency(uint8 *p, uint32 pixel_count, uint8 tc[3], int out_n)
 {
-   stbi *s = z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
+   uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -2583,17 +3719,9 @@ static int compute_transparency(png *z, uint8 tc[3], int out_n)
    return 1;
 }
 
-static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+static void expand_palette_pixels(uint8 *p, uint8 *orig, uint32 pixel_count, uint8 *palette, int pal_img_n)
 {
-   uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   uint8 *p, *temp_out, *orig = a->out;
-
-   p = (uint8 *) malloc(pixel_count * pal_img_n);
-   if (p == NULL) return e("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
+   uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -2612,8 +3740,19 @@ static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
          p += 4;
       }
    }
-   free(a->out);
-   a->out = temp_out;
+}
+
+static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n, int is_result)
+{
+   uint32 pixel_count = a->s->img_x * a->s->img_y;
+   uint8 *p, *orig = a->out;
+
+   p = (uint8 *) (is_result ? stbi_malloc_result(pixel_count * pal_img_n) : stbi_malloc(pixel_count * pal_img_n));
+   if (p == NULL) return e("outofmem", "Out of memory");
+
+   expand_palette_pixels(p, orig, pixel_count, palette, pal_img_n);
+   stbi_free(a->out);
+   a->out = p;
 
    STBI_NOTUSED(len);
 
@@ -2632,13 +3771,11 @@ void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
    stbi_de_iphone_flag = flag_true_if_should_convert;
 }
 
-static void stbi_de_iphone(png *z)
+static void stbi_de_iphone(uint8 *p, uint32 pixel_count, int out_n)
 {
-   stbi *s = z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
+   uint32 i;
 
-   if (s->img_out_n == 3) {  // convert bgr to rgb
+   if (out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          uint8 t = p[0];
          p[0] = p[2];
@@ -2646,7 +3783,7 @@ static void stbi_de_iphone(png *z)
          p += 3;
       }
    } else {
-      assert(s->img_out_n == 4);
+      assert(out_n == 4);
       if (stbi_unpremultiply_on_load) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
@@ -2674,6 +3811,92 @@ static void stbi_de_iphone(png *z)
    }
 }
 
+// stbi_load_rows: rows are unfiltered and handed over while the image
+// inflates, so only the row above the current one is kept
+typedef struct
+{
+   png *a;
+   uint8 *line;       // the row being unfiltered and the one above it
+   uint8 *pixels;     // one row of palette colors that get converted
+   uint8 *palette, *tc;
+   int pal_img_n, has_trans, iphone;
+   int n;             // components after palette expansion
+   uint32 row;
+} png_rows;
+
+static int png_flush_rows(void *user, uint8 *raw, int len)
+{
+   png_rows *p = (png_rows *) user;
+   stbi *s = p->a->s;
+   stbi_rows *rows = p->a->rows;
+   uint32 x = s->img_x, stride = x * s->img_out_n;
+   int raw_stride = x * s->img_n + 1, used = 0;
+   for (; used + raw_stride <= len && p->row < s->img_y; used += raw_stride, ++p->row) {
+      uint8 *cur   = p->line + ( p->row & 1) * stride;
+      uint8 *prior = p->line + (~p->row & 1) * stride;
+      uint8 *src = cur, *dest;
+      int filter = raw[used];
+      if (filter > 4) { e("invalid filter","Corrupt PNG"); return -1; }
+      // if first row, use special filter that doesn't sample previous row
+      if (p->row == 0) filter = first_row_filter[filter];
+      png_unfilter_row(filter, cur, prior, raw + used + 1, x, s->img_n, s->img_out_n);
+      if (p->has_trans)
+         compute_transparency(cur, x, p->tc, s->img_out_n);
+      if (p->iphone && s->img_out_n > 2)
+         stbi_de_iphone(cur, x, s->img_out_n);
+
+      dest = rows_next(rows);
+      if (!dest) return -1;
+      if (p->pal_img_n) {
+         src = p->n == rows->n ? dest : p->pixels;
+         expand_palette_pixels(src, cur, x, p->palette, p->n);
+      }
+      if (p->n != rows->n)
+         convert_pixels(dest, src, p->n, rows->n, x, 1);
+      else if (src != dest)
+         memcpy(dest, src, x * p->n);
+   }
+   return rows_flush(rows) ? used : -1;
+}
+
+static int png_load_rows(png *z, uint32 len, uint8 *palette, int pal_img_n, uint8 *tc, int has_trans, int iphone, int req_comp)
+{
+   stbi *s = z->s;
+   png_rows p;
+   zbuf a;
+   int size = 65536 + 2 * (s->img_x * s->img_n + 1), ok;
+
+   p.a = z;
+   p.palette = palette;
+   p.tc = tc;
+   p.pal_img_n = pal_img_n;
+   p.has_trans = has_trans;
+   p.iphone = iphone;
+   p.row = 0;
+   // palettes expand to 3 or 4 components like expand_palette
+   p.n = pal_img_n ? (req_comp >= 3 ? req_comp : pal_img_n) : s->img_out_n;
+   if (!rows_begin(z->rows, s->img_x, s->img_y, req_comp ? req_comp : p.n, 16)) return 0;
+   p.line = (uint8 *) stbi_malloc(s->img_x * (2 * s->img_out_n + 4));
+   if (!p.line) return e("outofmem", "Out of memory");
+   p.pixels = p.line + 2 * s->img_x * s->img_out_n;
+
+   a.zbuffer = z->idata;
+   a.zbuffer_end = z->idata + len;
+   a.zout_start = a.zout = (char *) stbi_malloc(size);
+   a.zout_end = a.zout_start + size;
+   a.z_expandable = 1;
+   a.flush = png_flush_rows;
+   a.flush_user = &p;
+   a.flushed = 0;
+   ok = a.zout_start ? parse_zlib(&a, !iphone) : e("outofmem", "Out of memory");
+   if (ok && (p.row != s->img_y || a.zout - a.zout_start != a.flushed))
+      ok = e("not enough pixels","Corrupt PNG");
+   stbi_free(a.zout_start);
+   stbi_free(p.line);
+   if (pal_img_n) s->img_n = pal_img_n; // record the actual colors we had
+   return ok;
+}
+
 static int parse_png_file(png *z, int scan, int req_comp)
 {
    uint8 palette[1024], pal_img_n=0;
@@ -2765,10 +3988,11 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if (scan == SCAN_header) { s->img_n = pal_img_n; return 1; }
             if (ioff + c.length > idata_limit) {
                uint8 *p;
+               uint32 old_limit = idata_limit;
                if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
-               p = (uint8 *) realloc(z->idata, idata_limit); if (p == NULL) return e("outofmem", "Out of memory");
+               p = (uint8 *) stbi_realloc(z->idata, old_limit, idata_limit); if (p == NULL) return e("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!getn(s, z->idata+ioff,c.length)) return e("outofdata","Corrupt PNG");
@@ -2781,27 +4005,31 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (scan != SCAN_load) return 1;
             if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, 16384, (int *) &raw_len, !iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            free(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace)) return 0;
+            if (z->rows && !interlace && !stbi_png_partial)
+               return png_load_rows(z, ioff, palette, pal_img_n, tc, has_trans, iphone, req_comp);
+            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, 16384, (int *) &raw_len, !iphone);
+            if (z->expanded == NULL) return 0; // zlib should set error
+            stbi_free(z->idata); z->idata = NULL;
+            // do_png converts when req_comp differs from what is decoded
+            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace,
+                                  !pal_img_n && (!req_comp || req_comp == s->img_out_n))) return 0;
             if (has_trans)
-               if (!compute_transparency(z, tc, s->img_out_n)) return 0;
+               if (!compute_transparency(z->out, s->img_x * s->img_y, tc, s->img_out_n)) return 0;
             if (iphone && s->img_out_n > 2)
-               stbi_de_iphone(z);
+               stbi_de_iphone(z->out, s->img_x * s->img_y, s->img_out_n);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!expand_palette(z, palette, pal_len, s->img_out_n))
+               if (!expand_palette(z, palette, pal_len, s->img_out_n, !req_comp || req_comp == s->img_out_n))
                   return 0;
             }
-            free(z->expanded); z->expanded = NULL;
+            stbi_free(z->expanded); z->expanded = NULL;
             return 1;
          }
 
@@ -2810,8 +4038,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if (first) return e("first not IHDR", "Corrupt PNG");
             if ((c.type & (1 << 29)) == 0) {
                #ifndef STBI_NO_FAILURE_STRINGS
-               // not threadsafe
-               static char invalid_chunk[] = "XXXX chunk not known";
+               static STBI_THREAD_LOCAL char invalid_chunk[] = "XXXX chunk not known";
                invalid_chunk[0] = (uint8) (c.type >> 24);
                invalid_chunk[1] = (uint8) (c.type >> 16);
                invalid_chunk[2] = (uint8) (c.type >>  8);
@@ -2843,9 +4070,9 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   free(p->out);      p->out      = NULL;
-   free(p->expanded); p->expanded = NULL;
-   free(p->idata);    p->idata    = NULL;
+   stbi_free(p->out);      p->out      = NULL;
+   stbi_free(p->expanded); p->expanded = NULL;
+   stbi_free(p->idata);    p->idata    = NULL;
 
    return result;
 }
@@ -2854,9 +4081,37 @@ static unsigned char *stbi_png_load(stbi *s, int *x, int *y, int *comp, int req_
 {
    png p;
    p.s = s;
+   p.rows = NULL;
    return do_png(&p, x,y,comp,req_comp);
 }
 
+static int stbi_png_load_rows(stbi *s, stbi_rows *rows, int *x, int *y, int *comp)
+{
+   png p;
+   int ok;
+   p.s = s;
+   p.rows = rows;
+   ok = parse_png_file(&p, SCAN_load, rows->req_comp);
+   if (ok && p.out) {
+      // interlaced images are decoded whole and handed over in one go
+      int n = rows->req_comp ? rows->req_comp : s->img_out_n;
+      stbi_uc *data = p.out;
+      p.out = NULL;
+      data = convert_format(data, s->img_out_n, n, s->img_x, s->img_y);
+      ok = data && (rows->callback(rows->user, data, 0, s->img_y, s->img_x, s->img_y, n) || e("aborted", "Row callback stopped decoding"));
+      stbi_free(data);
+   }
+   stbi_free(p.out);
+   stbi_free(p.expanded);
+   stbi_free(p.idata);
+   if (ok) {
+      *x = s->img_x;
+      *y = s->img_y;
+      if (comp) *comp = s->img_n;
+   }
+   return ok;
+}
+
 static int stbi_png_test(stbi *s)
 {
    int r;
@@ -2881,6 +4136,7 @@ static int      stbi_png_info(stbi *s, int *x, int *y, int *comp)
 {
    png p;
    p.s = s;
+   p.rows = NULL;
    return stbi_png_info_raw(&p, x, y, comp);
 }
 
@@ -3036,11 +4292,14 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       target = req_comp;
    else
       target = s->img_n; // if they want monochrome, we'll post-convert
-   out = (stbi_uc *) malloc(target * s->img_x * s->img_y);
+   if (!req_comp || req_comp == target)
+      out = (stbi_uc *) stbi_malloc_result(target * s->img_x * s->img_y);
+   else
+      out = (stbi_uc *) stbi_malloc(target * s->img_x * s->img_y);
    if (!out) return epuc("outofmem", "Out of memory");
    if (bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { free(out); return epuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi_free(out); return epuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = get8u(s);
          pal[i][1] = get8u(s);
@@ -3051,7 +4310,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       skip(s, offset - 14 - hsz - psize * (hsz == 12 ? 3 : 4));
       if (bpp == 4) width = (s->img_x + 1) >> 1;
       else if (bpp == 8) width = s->img_x;
-      else { free(out); return epuc("bad bpp", "Corrupt BMP"); }
+      else { stbi_free(out); return epuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       for (j=0; j < (int) s->img_y; ++j) {
          for (i=0; i < (int) s->img_x; i += 2) {
@@ -3089,7 +4348,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { free(out); return epuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi_free(out); return epuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = high_bit(mr)-7; rcount = bitcount(mr);
          gshift = high_bit(mg)-7; gcount = bitcount(mr);
@@ -3221,6 +4480,90 @@ static int stbi_tga_test(stbi *s)
    return res;
 }
 
+// converts n grey or BGR(A) TGA pixels to req_comp components
+static void tga_convert_row(uint8 *dest, uint8 const *src, int n, int bytes, int req_comp)
+{
+   int i;
+   if (bytes == req_comp && bytes == 1) {
+      memcpy(dest, src, n);
+      return;
+   }
+   // switch per row rather than per pixel
+   switch (bytes*8 + req_comp) {
+      case 1*8+2: for (i=0; i < n; ++i, src += 1, dest += 2) { dest[0]=src[0]; dest[1]=255; } break;
+      case 1*8+3: for (i=0; i < n; ++i, src += 1, dest += 3) { dest[0]=dest[1]=dest[2]=src[0]; } break;
+      case 1*8+4: for (i=0; i < n; ++i, src += 1, dest += 4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255; } break;
+      case 3*8+1: for (i=0; i < n; ++i, src += 3, dest += 1) { dest[0]=compute_y(src[2],src[1],src[0]); } break;
+      case 3*8+2: for (i=0; i < n; ++i, src += 3, dest += 2) { dest[0]=compute_y(src[2],src[1],src[0]); dest[1]=255; } break;
+      case 3*8+3: for (i=0; i < n; ++i, src += 3, dest += 3) { dest[0]=src[2]; dest[1]=src[1]; dest[2]=src[0]; } break;
+      case 3*8+4: for (i=0; i < n; ++i, src += 3, dest += 4) { dest[0]=src[2]; dest[1]=src[1]; dest[2]=src[0]; dest[3]=255; } break;
+      case 4*8+1: for (i=0; i < n; ++i, src += 4, dest += 1) { dest[0]=compute_y(src[2],src[1],src[0]); } break;
+      case 4*8+2: for (i=0; i < n; ++i, src += 4, dest += 2) { dest[0]=compute_y(src[2],src[1],src[0]); dest[1]=src[3]; } break;
+      case 4*8+3: for (i=0; i < n; ++i, src += 4, dest += 3) { dest[0]=src[2]; dest[1]=src[1]; dest[2]=src[0]; } break;
+      case 4*8+4: for (i=0; i < n; ++i, src += 4, dest += 4) { dest[0]=src[2]; dest[1]=src[1]; dest[2]=src[0]; dest[3]=src[3]; } break;
+      default: assert(0);
+   }
+}
+
+// the formats tga_decode_into handles: 8-bit grey and 24/32-bit color
+static int tga_bulk_format(int image_type, int bits_per_pixel)
+{
+   return (image_type == 2 && (bits_per_pixel == 24 || bits_per_pixel == 32)) ||
+          (image_type == 3 && bits_per_pixel == 8);
+}
+
+// decodes the pixels at p in bulk, a row or an RLE packet at a time, into
+// out with req_comp components; flip reverses the row order. Returns 0 if
+// the data is truncated, without setting a failure reason.
+static int tga_decode_into(uint8 const *p, uint8 const *end, int w, int h, int bytes, int rle, int flip, uint8 *out, int req_comp)
+{
+   int row, col = 0;
+   int row_size = w * req_comp;
+   uint8 *dest = out + (flip ? (h-1) * row_size : 0);
+   int step = flip ? -row_size : row_size;
+   if (p > end) return 0;
+   if (!rle) {
+      for (row=0; row < h; ++row, p += w * bytes, dest += step) {
+         if (end - p < w * bytes) return 0;
+         tga_convert_row(dest, p, w, bytes, req_comp);
+      }
+      return 1;
+   }
+   // packets may run across rows
+   row = 0;
+   while (row < h) {
+      int count, n, i, repeat;
+      uint8 pixel[4];
+      if (p >= end) return 0;
+      count = (*p & 127) + 1;
+      repeat = *p++ >> 7;
+      if (end - p < (repeat ? 1 : count) * bytes) return 0;
+      if (repeat) {
+         tga_convert_row(pixel, p, 1, bytes, req_comp);
+         p += bytes;
+      }
+      while (count > 0 && row < h) {
+         n = count < w - col ? count : w - col;
+         if (repeat) {
+            uint8 *d = dest + col * req_comp;
+            for (i=0; i < n; ++i, d += req_comp)
+               memcpy(d, pixel, req_comp);
+         } else {
+            tga_convert_row(dest + col * req_comp, p, n, bytes, req_comp);
+            p += n * bytes;
+         }
+         count -= n;
+         col += n;
+         if (col == w) {
+            col = 0;
+            ++row;
+            dest += step;
+         }
+      }
+   }
+   return 1;
+}
+
 static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
    //   read in the TGA header stuff
@@ -3286,9 +4629,18 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       //   force a new number of components
       *comp = tga_bits_per_pixel/8;
    }
-   tga_data = (unsigned char*)malloc( tga_width * tga_height * req_comp );
+   tga_data = (unsigned char*)stbi_malloc_result( tga_width * tga_height * req_comp );
    if (!tga_data) return epuc("outofmem", "Out of memory");
 
+   //   when the whole file is in memory, common formats are decoded in bulk;
+   //   truncated files go through the loop below, which reads zeros
+   if ( !s->read_from_callbacks && !tga_indexed && tga_bulk_format(tga_image_type, tga_bits_per_pixel) &&
+        tga_decode_into(s->img_buffer + tga_offset, s->img_buffer_end, tga_width, tga_height,
+                        tga_bits_per_pixel / 8, tga_is_RLE, tga_inverted, tga_data, req_comp) )
+   {
+      return tga_data;
+   }
+
    //   skip to the data's starting position (offset usually = 0)
    skip(s, tga_offset );
    //   do I need to load a palette?
@@ -3297,11 +4649,11 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       //   any data to skip? (offset usually = 0)
       skip(s, tga_palette_start );
       //   load the palette
-      tga_palette = (unsigned char*)malloc( tga_palette_len * tga_palette_bits / 8 );
+      tga_palette = (unsigned char*)stbi_malloc( tga_palette_len * tga_palette_bits / 8 );
       if (!tga_palette) return epuc("outofmem", "Out of memory");
       if (!getn(s, tga_palette, tga_palette_len * tga_palette_bits / 8 )) {
-         free(tga_data);
-         free(tga_palette);
+         stbi_free(tga_data);
+         stbi_free(tga_palette);
          return epuc("bad palette", "Corrupt TGA");
       }
    }
@@ -3437,7 +4789,7 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    //   clear my palette, if I had one
    if ( tga_palette != NULL )
    {
-      free( tga_palette );
+      stbi_free( tga_palette );
    }
    //   the things I do to get rid of an error message, and yet keep
    //   Microsoft's C compilers happy... [8^(
@@ -3452,6 +4804,41 @@ static stbi_uc *stbi_tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    return tga_load(s,x,y,comp,req_comp);
 }
 
+int stbi_tga_load_into(stbi_uc const *buffer, int len, stbi_uc *out, int out_size,
+                       int *x, int *y, int *comp, int req_comp, int flip_vertically)
+{
+   stbi s;
+   int offset, indexed, image_type, w, h, bits_per_pixel, bottom_up;
+   if (len < 18) return e("not TGA", "Corrupt TGA");
+   start_mem(&s, buffer, len);
+   offset = get8u(&s);
+   indexed = get8u(&s);
+   image_type = get8u(&s);
+   skip(&s, 9);
+   w = get16le(&s);
+   h = get16le(&s);
+   bits_per_pixel = get8u(&s);
+   bottom_up = !(get8u(&s) & 32);
+   if (indexed || !tga_bulk_format(image_type & 7, bits_per_pixel) || (image_type & ~8) > 3 || w < 1 || h < 1)
+      return e("unsupported TGA", "TGA not supported by the bulk decoder");
+   if (req_comp == 0) req_comp = bits_per_pixel / 8;
+   if (req_comp < 1 || req_comp > 4) return e("bad req_comp", "Internal error");
+   if (!out) {
+      *x = w;
+      *y = h;
+      if (comp) *comp = bits_per_pixel / 8;
+      return 1;
+   }
+   if ((double) w * h * req_comp > out_size) return e("output too small", "Output buffer too small");
+   if (!tga_decode_into(s.img_buffer + offset, s.img_buffer_end, w, h, bits_per_pixel / 8,
+                        image_type >= 8, bottom_up != (flip_vertically != 0), out, req_comp))
+      return e("truncated", "Corrupt TGA");
+   *x = w;
+   *y = h;
+   if (comp) *comp = bits_per_pixel / 8;
+   return 1;
+}
+
 
 // *************************************************************************************************
 // Photoshop PSD loader -- PD by Thatcher Ulrich, integration by Nicolas Schulz, tweaked by STB
@@ -3532,7 +4919,10 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       return epuc("bad compression", "PSD has an unknown compression format");
 
    // Create the destination image.
-   out = (stbi_uc *) malloc(4 * w*h);
+   if (!req_comp || req_comp == 4)
+      out = (stbi_uc *) stbi_malloc_result(4 * w*h);
+   else
+      out = (stbi_uc *) stbi_malloc(4 * w*h);
    if (!out) return epuc("outofmem", "Out of memory");
    pixelCount = w*h;
 
@@ -3822,11 +5212,11 @@ static stbi_uc *pic_load(stbi *s,int *px,int *py,int *comp,int req_comp)
    get16(s); //skip `pad'
 
    // intermediate buffer is RGBA
-   result = (stbi_uc *) malloc(x*y*4);
+   result = (stbi_uc *) (req_comp == 4 ? stbi_malloc_result(x*y*4) : stbi_malloc(x*y*4));
    memset(result, 0xff, x*y*4);
 
    if (!pic_load2(s,x,y,comp, result)) {
-      free(result);
+      stbi_free(result);
       result=0;
    }
    *px = x;
@@ -4077,14 +5467,14 @@ static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g, int *comp, int req_comp)
 
    if (g->out == 0) {
       if (!stbi_gif_header(s, g, comp,0))     return 0; // failure_reason set by stbi_gif_header
-      g->out = (uint8 *) malloc(4 * g->w * g->h);
+      g->out = (uint8 *) stbi_malloc(4 * g->w * g->h);
       if (g->out == 0)                      return epuc("outofmem", "Out of memory");
       stbi_fill_gif_background(g);
    } else {
       // animated-gif-only path
       if (((g->eflags & 0x1C) >> 2) == 3) {
          old_out = g->out;
-         g->out = (uint8 *) malloc(4 * g->w * g->h);
+         g->out = (uint8 *) stbi_malloc(4 * g->w * g->h);
          if (g->out == 0)                   return epuc("outofmem", "Out of memory");
          memcpy(g->out, old_out, g->w*g->h*4);
       }
@@ -4262,17 +5652,117 @@ static void hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
-static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
+// hdr_convert to half floats for a row of RGBE pixels
+static void hdr_convert_half_row(uint16 *output, stbi_uc *input, int width, int req_comp)
+{
+   float f[4];
+   int i = 0, k;
+   #ifdef STBI_SSE2
+   // 4 pixels a step, the same float math as hdr_convert; with 3 components
+   // the last 8-byte store runs into the next pixel, so that one is left to
+   // the scalar loop
+   for (; i + 4 + (req_comp == 3) <= width; i += 4) {
+      __m128i p = _mm_loadu_si128((__m128i *) (input + i*4));
+      __m128i mask = _mm_set1_epi32(255);
+      __m128i one = _mm_set1_epi32(0x3c00 << 16);
+      __m128i e = _mm_srli_epi32(p, 24);
+      // ldexp(1, e-136) as float bits, 0 where that would be a denormal
+      __m128 scale = _mm_and_ps(_mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(e, _mm_set1_epi32(9)), 23)),
+                                _mm_castsi128_ps(_mm_cmpgt_epi32(e, _mm_set1_epi32(9))));
+      __m128 r = _mm_cvtepi32_ps(_mm_and_si128(p, mask));
+      __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 8), mask));
+      __m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), mask));
+      uint16 *o = output + i*req_comp;
+      if (req_comp <= 2) {
+         __m128i grey = float_to_half_sse2(_mm_div_ps(_mm_mul_ps(_mm_add_ps(_mm_add_ps(r, g), b), scale), _mm_set1_ps(3.0f)));
+         if (req_comp == 1)
+            _mm_storel_epi64((__m128i *) o, _mm_packs_epi32(grey, grey));
+         else
+            _mm_storeu_si128((__m128i *) o, _mm_or_si128(grey, one));
+      } else {
+         __m128i rg = _mm_or_si128(float_to_half_sse2(_mm_mul_ps(r, scale)), _mm_slli_epi32(float_to_half_sse2(_mm_mul_ps(g, scale)), 16));
+         __m128i ba = _mm_or_si128(float_to_half_sse2(_mm_mul_ps(b, scale)), one);
+         __m128i p01 = _mm_unpacklo_epi32(rg, ba);
+         __m128i p23 = _mm_unpackhi_epi32(rg, ba);
+         if (req_comp == 4) {
+            _mm_storeu_si128((__m128i *) o, p01);
+            _mm_storeu_si128((__m128i *) (o + 8), p23);
+         } else {
+            _mm_storel_epi64((__m128i *) o, p01);
+            _mm_storel_epi64((__m128i *) (o + 3), _mm_srli_si128(p01, 8));
+            _mm_storel_epi64((__m128i *) (o + 6), p23);
+            _mm_storel_epi64((__m128i *) (o + 9), _mm_srli_si128(p23, 8));
+         }
+      }
+   }
+   #endif
+   for (; i < width; ++i) {
+      hdr_convert(f, input + i*4, req_comp);
+      for (k=0; k < req_comp; ++k)
+         output[i*req_comp + k] = float_to_half(f[k]);
+   }
+}
+
+// one scanline of RGBE pixels into 'scanline'. Once a scanline turns out
+// not to be run-length encoded, the rest of the image is read flat.
+static int hdr_read_scanline(stbi *s, stbi_uc *scanline, int width, int *flat)
+{
+   int i, k, c1, c2, len, count;
+   stbi_uc value;
+   if (*flat) {
+      getn(s, scanline, width * 4);
+      return 1;
+   }
+   c1 = get8(s);
+   c2 = get8(s);
+   len = get8(s);
+   if (c1 != 2 || c2 != 2 || (len & 0x80)) {
+      // not run-length encoded, so we have to actually use THIS data as a decoded
+      // pixel (note this can't be a valid pixel--one of RGB must be >= 128)
+      scanline[0] = (uint8) c1;
+      scanline[1] = (uint8) c2;
+      scanline[2] = (uint8) len;
+      scanline[3] = get8u(s);
+      getn(s, scanline + 4, (width - 1) * 4);
+      *flat = 1;
+      return 1;
+   }
+   len <<= 8;
+   len |= get8(s);
+   if (len != width) return e("invalid decoded scanline length", "corrupt HDR");
+
+   for (k = 0; k < 4; ++k) {
+      i = 0;
+      while (i < width) {
+         count = get8u(s);
+         if (count > 128) {
+            // Run
+            value = get8u(s);
+            count -= 128;
+            if (count > width - i) return e("bad run", "corrupt HDR");
+            while (count--)
+               scanline[i++ * 4 + k] = value;
+         } else {
+            // Dump
+            if (count == 0 || count > width - i) return e("bad dump", "corrupt HDR");
+            while (count--)
+               scanline[i++ * 4 + k] = get8u(s);
+         }
+      }
+   }
+   return 1;
+}
+
+// the image as floats, or as half floats if 'half'
+static void *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp, int half)
 {
    char buffer[HDR_BUFLEN];
    char *token;
    int valid = 0;
    int width, height;
    stbi_uc *scanline;
-   float *hdr_data;
-   int len;
-   unsigned char count, value;
-   int i, j, k, c1,c2, z;
+   void *hdr_data;
+   int i, j, flat;
 
 
    // Check identifier
@@ -4298,6 +5788,7 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    if (strncmp(token, "+X ", 3))  return epf("unsupported data layout", "Unsupported HDR format");
    token += 3;
    width = strtol(token, NULL, 10);
+   if (width <= 0 || height <= 0) return epf("bad dimensions", "Corrupt HDR image");
 
    *x = width;
    *y = height;
@@ -4306,76 +5797,42 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    if (req_comp == 0) req_comp = 3;
 
    // Read data
-   hdr_data = (float *) malloc(height * width * req_comp * sizeof(float));
-
-   // Load image data
-   // image data is stored as some number of sca
-   if ( width < 8 || width >= 32768) {
-      // Read flat data
-      for (j=0; j < height; ++j) {
-         for (i=0; i < width; ++i) {
-            stbi_uc rgbe[4];
-           main_decode_loop:
-            getn(s, rgbe, 4);
-            hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
-         }
+   hdr_data = stbi_malloc(height * width * req_comp * (half ? sizeof(uint16) : sizeof(float)));
+   scanline = (stbi_uc *) stbi_malloc(width * 4);
+   if (hdr_data == NULL || scanline == NULL) {
+      stbi_free(hdr_data);
+      stbi_free(scanline);
+      return epf("outofmem", "Out of memory");
+   }
+
+   // Load image data, a scanline at a time; very narrow or wide images can't
+   // be run-length encoded
+   flat = width < 8 || width >= 32768;
+   for (j=0; j < height; ++j) {
+      if (!hdr_read_scanline(s, scanline, width, &flat)) {
+         stbi_free(hdr_data);
+         stbi_free(scanline);
+         return NULL;
       }
-   } else {
-      // Read RLE-encoded data
-      scanline = NULL;
-
-      for (j = 0; j < height; ++j) {
-         c1 = get8(s);
-         c2 = get8(s);
-         len = get8(s);
-         if (c1 != 2 || c2 != 2 || (len & 0x80)) {
-            // not run-length encoded, so we have to actually use THIS data as a decoded
-            // pixel (note this can't be a valid pixel--one of RGB must be >= 128)
-            uint8 rgbe[4];
-            rgbe[0] = (uint8) c1;
-            rgbe[1] = (uint8) c2;
-            rgbe[2] = (uint8) len;
-            rgbe[3] = (uint8) get8u(s);
-            hdr_convert(hdr_data, rgbe, req_comp);
-            i = 1;
-            j = 0;
-            free(scanline);
-            goto main_decode_loop; // yes, this makes no sense
-         }
-         len <<= 8;
-         len |= get8(s);
-         if (len != width) { free(hdr_data); free(scanline); return epf("invalid decoded scanline length", "corrupt HDR"); }
-         if (scanline == NULL) scanline = (stbi_uc *) malloc(width * 4);
-            
-         for (k = 0; k < 4; ++k) {
-            i = 0;
-            while (i < width) {
-               count = get8u(s);
-               if (count > 128) {
-                  // Run
-                  value = get8u(s);
-                  count -= 128;
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = value;
-               } else {
-                  // Dump
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = get8u(s);
-               }
-            }
-         }
+      if (half)
+         hdr_convert_half_row((uint16 *) hdr_data + j * width * req_comp, scanline, width, req_comp);
+      else
          for (i=0; i < width; ++i)
-            hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
-      }
-      free(scanline);
+            hdr_convert((float *) hdr_data + (j*width + i)*req_comp, scanline + i*4, req_comp);
    }
+   stbi_free(scanline);
 
    return hdr_data;
 }
 
 static float *stbi_hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
-   return hdr_load(s,x,y,comp,req_comp);
+   return (float *) hdr_load(s,x,y,comp,req_comp,0);
+}
+
+static uint16 *stbi_hdr_loadh(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   return (uint16 *) hdr_load(s,x,y,comp,req_comp,1);
 }
 
 static int stbi_hdr_info(stbi *s, int *x, int *y, int *comp)
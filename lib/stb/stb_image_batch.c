@@ -0,0 +1,78 @@
+/* stb_image_batch - see stb_image_batch.h */
+
+#include "../deps/tinycthread.h"
+#include "stb_image_batch.h"
+
+#define STBI_BATCH_MAX_THREADS 64
+
+typedef struct
+{
+   stbi_batch_item const *items;
+   int count;
+   stbi_batch_callback done;
+
+   mtx_t mutex;
+   int next;   // next item to hand out
+   int loaded;
+} stbi_batch;
+
+static int stbi_batch_worker(void *arg)
+{
+   stbi_batch *b = (stbi_batch *) arg;
+   for (;;) {
+      stbi_batch_item const *item;
+      stbi_batch_result result;
+      int i;
+
+      mtx_lock(&b->mutex);
+      i = b->next < b->count ? b->next++ : -1;
+      mtx_unlock(&b->mutex);
+      if (i < 0) break;
+
+      item = &b->items[i];
+      result.x = result.y = result.comp = 0;
+      #ifndef STBI_NO_STDIO
+      if (item->filename)
+         result.data = stbi_load(item->filename, &result.x, &result.y, &result.comp, item->req_comp);
+      else
+      #endif
+         result.data = stbi_load_from_memory(item->buffer, item->len, &result.x, &result.y, &result.comp, item->req_comp);
+      // the failure reason is per thread, so it is the one for this item
+      result.failure_reason = result.data ? NULL : stbi_failure_reason();
+
+      if (result.data) {
+         mtx_lock(&b->mutex);
+         ++b->loaded;
+         mtx_unlock(&b->mutex);
+      }
+      b->done(item, i, &result);
+   }
+   return 0;
+}
+
+int stbi_load_batch(stbi_batch_item const *items, int count, int num_threads, stbi_batch_callback done)
+{
+   thrd_t threads[STBI_BATCH_MAX_THREADS];
+   stbi_batch b;
+   int i, started = 0;
+
+   b.items = items;
+   b.count = count;
+   b.done = done;
+   b.next = 0;
+   b.loaded = 0;
+   if (mtx_init(&b.mutex, mtx_plain) != thrd_success) return 0;
+
+   // no more threads than items; the calling thread is one of them
+   if (num_threads > count) num_threads = count;
+   if (num_threads > STBI_BATCH_MAX_THREADS) num_threads = STBI_BATCH_MAX_THREADS;
+   for (i=1; i < num_threads; ++i)
+      if (thrd_create(&threads[started], stbi_batch_worker, &b) == thrd_success)
+         ++started;
+   stbi_batch_worker(&b);
+   for (i=0; i < started; ++i)
+      thrd_join(threads[i], NULL);
+
+   mtx_destroy(&b.mutex);
+   return b.loaded;
+}
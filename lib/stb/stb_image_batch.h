@@ -0,0 +1,52 @@
+/* stb_image_batch - decodes a list of images on a pool of threads
+
+   Each item is a file name or a memory buffer. Items are handed out to the
+   threads in order, and the callback is called on the thread that decoded
+   the item, as soon as it is done: calls can run concurrently and in any
+   order. The callback owns result->data and frees it with stbi_image_free.
+   On failure data is NULL and failure_reason says why.
+
+      static void loaded(stbi_batch_item const *item, int index, stbi_batch_result *result)
+      {
+         ...
+         stbi_image_free(result->data);
+      }
+
+      stbi_batch_item items[2] = { { "a.png", NULL, 0, 4, NULL }, { "b.tga", NULL, 0, 4, NULL } };
+      int loaded_count = stbi_load_batch(items, 2, 4, loaded);
+
+   The calling thread decodes too, so num_threads 1 decodes everything on
+   it. stbi_load_batch returns once every callback has returned.
+*/
+
+#pragma once
+#include "stb_image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct
+{
+   char const    *filename;    // file to decode, or NULL to decode buffer
+   stbi_uc const *buffer;
+   int            len;
+   int            req_comp;
+   void          *user;
+} stbi_batch_item;
+
+typedef struct
+{
+   stbi_uc    *data;           // NULL on failure
+   int         x, y, comp;
+   char const *failure_reason;
+} stbi_batch_result;
+
+typedef void (*stbi_batch_callback)(stbi_batch_item const *item, int index, stbi_batch_result *result);
+
+// returns the number of images that decoded
+extern int stbi_load_batch(stbi_batch_item const *items, int count, int num_threads, stbi_batch_callback done);
+
+#ifdef __cplusplus
+}
+#endif
@@ -5,7 +5,8 @@ solution "aogl"
    project "aogl"
       kind "ConsoleApp"
       language "C++"
-      files { "aogl.cpp"}
+      files { "aogl.cpp", "common/*.cpp" }
+      excludes { "common/streambuffer.cpp" } -- Built into imgui
       includedirs { "lib/glfw/include", "src", "common", "lib/" }
       links {"glfw", "glew", "stb", "imgui"}
       defines { "GLEW_STATIC" }
@@ -29,6 +30,47 @@ solution "aogl"
          defines { "NDEBUG" }
          flags { "Optimize"}    
 
+   -- Offline texture compressor
+   project "aotex"
+      kind "ConsoleApp"
+      language "C++"
+      files { "aotex.cpp", "common/mipmap.cpp", "common/bc.cpp" }
+      includedirs { "common", "lib/" }
+      links {"stb"}
+
+      configuration { "linux" }
+         links {"pthread"}
+
+      configuration "Debug"
+         defines { "DEBUG" }
+         flags {"ExtraWarnings", "Symbols" }
+         targetsuffix "_d"
+
+      configuration "Release"
+         defines { "NDEBUG" }
+         flags { "Optimize"}    
+
+   -- Benchmarks of the texture pipeline
+   project "bench"
+      kind "ConsoleApp"
+      language "C++"
+      files { "bench.cpp", "common/mipmap.cpp" }
+      includedirs { "common", "lib/" }
+      links {"stb"}
+
+      configuration { "linux" }
+         links {"pthread"}
+         buildoptions { "-std=c++11" }
+
+      configuration "Debug"
+         defines { "DEBUG" }
+         flags {"ExtraWarnings", "Symbols" }
+         targetsuffix "_d"
+
+      configuration "Release"
+         defines { "NDEBUG" }
+         flags { "Optimize"}    
+
    -- GLFW Library
    project "glfw"
       kind "StaticLib"
@@ -87,8 +129,8 @@ solution "aogl"
    project "imgui"
       kind "StaticLib"
       language "C"
-      files {"lib/imgui/*.cpp", "lib/imgui/*.h"}
-      includedirs { "lib/" }
+      files {"lib/imgui/*.cpp", "lib/imgui/*.h", "common/streambuffer.cpp"}
+      includedirs { "lib/", "common" }
 
       configuration "Debug"
          defines { "DEBUG" }
@@ -104,7 +146,7 @@ solution "aogl"
    project "stb"
       kind "StaticLib"
       language "C"
-      files {"lib/stb/*.c", "lib/stb/*.h"}
+      files {"lib/stb/*.c", "lib/stb/*.h", "lib/deps/tinycthread.c"}
 
       configuration "Debug"
          defines { "DEBUG" }
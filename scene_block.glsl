@@ -0,0 +1,7 @@
+// Members of the block passed from aogl.vert through aogl.geom to aogl.frag,
+// included inside each stage's declaration of it
+vec2 TexCoord;
+vec3 Normal;
+vec3 Position;
+vec4 ClipPosition;
+vec4 PrevClipPosition;
@@ -0,0 +1,72 @@
+#version 410 core
+
+#define FRAG_COLOR	0
+#define MAX_SAMPLES	64
+
+precision highp float;
+precision highp int;
+
+uniform sampler2D LinearDepth;
+uniform mat4 Projection;
+uniform vec3 Kernel[MAX_SAMPLES];
+uniform int SampleCount;
+uniform float Radius;
+uniform float Far;
+
+layout(location = FRAG_COLOR, index = 0) out float Occlusion;
+
+in block
+{
+	vec2 TexCoord;
+} In;
+
+vec3 view_position(vec2 uv, float linearDepth)
+{
+	vec2 ndc = uv * 2.0 - 1.0;
+	return vec3(ndc.x * linearDepth / Projection[0][0], ndc.y * linearDepth / Projection[1][1], -linearDepth);
+}
+
+vec3 fetch_position(ivec2 pixel, ivec2 size)
+{
+	pixel = clamp(pixel, ivec2(0), size - 1);
+	return view_position((vec2(pixel) + 0.5) / vec2(size), texelFetch(LinearDepth, pixel, 0).r);
+}
+
+void main()
+{
+	ivec2 size = textureSize(LinearDepth, 0);
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	vec3 p = fetch_position(pixel, size);
+	if (-p.z >= Far * 0.999)
+	{
+		Occlusion = 1.0;
+		return;
+	}
+
+	// Reconstruct the normal from the neighbour with the smallest depth step
+	vec3 dx0 = p - fetch_position(pixel - ivec2(1, 0), size);
+	vec3 dx1 = fetch_position(pixel + ivec2(1, 0), size) - p;
+	vec3 dy0 = p - fetch_position(pixel - ivec2(0, 1), size);
+	vec3 dy1 = fetch_position(pixel + ivec2(0, 1), size) - p;
+	vec3 dx = abs(dx0.z) < abs(dx1.z) ? dx0 : dx1;
+	vec3 dy = abs(dy0.z) < abs(dy1.z) ? dy0 : dy1;
+	vec3 n = normalize(cross(dx, dy));
+
+	// Per pixel rotation of the kernel using interleaved gradient noise
+	float angle = 6.2831853 * fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+	vec3 r = vec3(cos(angle), sin(angle), 0.0);
+	vec3 t = normalize(r - n * dot(r, n));
+	mat3 tbn = mat3(t, cross(n, t), n);
+
+	float occlusion = 0.0;
+	for (int i = 0; i < SampleCount; ++i)
+	{
+		vec3 s = p + tbn * Kernel[i] * Radius;
+		vec4 clip = Projection * vec4(s, 1.0);
+		vec2 uv = clip.xy / clip.w * 0.5 + 0.5;
+		float sceneDepth = texture(LinearDepth, uv).r;
+		float rangeCheck = smoothstep(0.0, 1.0, Radius / abs(-p.z - sceneDepth));
+		occlusion += (sceneDepth <= -s.z - 0.02 ? 1.0 : 0.0) * rangeCheck;
+	}
+	Occlusion = 1.0 - occlusion / float(SampleCount);
+}
@@ -0,0 +1,38 @@
+#version 410 core
+
+#define FRAG_COLOR	0
+#define BLUR_RADIUS	4
+
+precision highp float;
+precision highp int;
+
+uniform sampler2D Occlusion;
+uniform sampler2D LinearDepth;
+uniform ivec2 Direction;
+
+layout(location = FRAG_COLOR, index = 0) out float BlurredOcclusion;
+
+in block
+{
+	vec2 TexCoord;
+} In;
+
+void main()
+{
+	// Separable gaussian that ignores samples across depth discontinuities
+	ivec2 size = textureSize(Occlusion, 0);
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(LinearDepth, pixel, 0).r;
+
+	float sum = 0.0;
+	float weightSum = 0.0;
+	for (int i = -BLUR_RADIUS; i <= BLUR_RADIUS; ++i)
+	{
+		ivec2 p = clamp(pixel + Direction * i, ivec2(0), size - 1);
+		float d = texelFetch(LinearDepth, p, 0).r;
+		float w = exp(-float(i * i) / 8.0) * max(0.0, 1.0 - abs(d - depth) / (0.05 * depth));
+		sum += texelFetch(Occlusion, p, 0).r * w;
+		weightSum += w;
+	}
+	BlurredOcclusion = weightSum > 0.0 ? sum / weightSum : texelFetch(Occlusion, pixel, 0).r;
+}
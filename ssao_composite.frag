@@ -0,0 +1,52 @@
+#version 410 core
+
+#define FRAG_COLOR	0
+
+precision highp float;
+precision highp int;
+
+uniform sampler2D Color;
+uniform sampler2D Depth;
+uniform sampler2D Occlusion;
+uniform sampler2D LinearDepth;
+uniform vec2 NearFar;
+
+layout(location = FRAG_COLOR, index = 0) out vec4 FragColor;
+
+in block
+{
+	vec2 TexCoord;
+} In;
+
+float linearize(float d)
+{
+	float z = d * 2.0 - 1.0;
+	return 2.0 * NearFar.x * NearFar.y / (NearFar.y + NearFar.x - z * (NearFar.y - NearFar.x));
+}
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = linearize(texelFetch(Depth, pixel, 0).r);
+
+	// Joint bilateral upsample : bilinear weights of the 4 closest low
+	// resolution texels, scaled down by their depth difference
+	ivec2 lowSize = textureSize(Occlusion, 0);
+	vec2 lowPixel = In.TexCoord * vec2(lowSize) - 0.5;
+	ivec2 base = ivec2(floor(lowPixel));
+	vec2 f = lowPixel - vec2(base);
+
+	float sum = 0.0;
+	float weightSum = 0.0;
+	for (int i = 0; i < 4; ++i)
+	{
+		ivec2 offset = ivec2(i & 1, i >> 1);
+		ivec2 p = clamp(base + offset, ivec2(0), lowSize - 1);
+		float bilinear = (offset.x == 1 ? f.x : 1.0 - f.x) * (offset.y == 1 ? f.y : 1.0 - f.y);
+		float w = (bilinear + 1e-3) / (1e-3 + abs(texelFetch(LinearDepth, p, 0).r - depth));
+		sum += texelFetch(Occlusion, p, 0).r * w;
+		weightSum += w;
+	}
+
+	FragColor = vec4(texelFetch(Color, pixel, 0).rgb * (sum / weightSum), 1.0);
+}
@@ -0,0 +1,42 @@
+#version 410 core
+
+#define FRAG_COLOR	0
+
+precision highp float;
+precision highp int;
+
+uniform sampler2D Depth;
+uniform int Scale;
+uniform vec2 NearFar;
+
+layout(location = FRAG_COLOR, index = 0) out float LinearDepth;
+
+in block
+{
+	vec2 TexCoord;
+} In;
+
+float linearize(float d)
+{
+	float z = d * 2.0 - 1.0;
+	return 2.0 * NearFar.x * NearFar.y / (NearFar.y + NearFar.x - z * (NearFar.y - NearFar.x));
+}
+
+void main()
+{
+	// Alternate min and max depth in a checkerboard so that both sides of
+	// depth discontinuities survive the downsampling
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(Depth, 0);
+	bool takeMax = ((pixel.x + pixel.y) & 1) != 0;
+	float depth = takeMax ? 0.0 : 1.0;
+	for (int y = 0; y < Scale; ++y)
+	{
+		for (int x = 0; x < Scale; ++x)
+		{
+			float d = texelFetch(Depth, min(pixel * Scale + ivec2(x, y), size - 1), 0).r;
+			depth = takeMax ? max(depth, d) : min(depth, d);
+		}
+	}
+	LinearDepth = linearize(depth);
+}
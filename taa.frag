@@ -0,0 +1,93 @@
+#version 410 core
+
+#define FRAG_COLOR	0
+
+precision highp float;
+precision highp int;
+
+uniform sampler2D Color;
+uniform sampler2D History;
+uniform sampler2D Velocity;
+uniform sampler2D Depth;
+uniform float Feedback;
+uniform int Reset;
+
+layout(location = FRAG_COLOR, index = 0) out vec4 FragColor;
+
+in block
+{
+	vec2 TexCoord;
+} In;
+
+vec3 rgb_to_ycocg(vec3 c)
+{
+	return vec3( 0.25 * c.r + 0.5 * c.g + 0.25 * c.b,
+	             0.5  * c.r             - 0.5  * c.b,
+	            -0.25 * c.r + 0.5 * c.g - 0.25 * c.b);
+}
+
+vec3 ycocg_to_rgb(vec3 c)
+{
+	return vec3(c.x + c.y - c.z, c.x + c.z, c.x - c.y - c.z);
+}
+
+void main()
+{
+	ivec2 size = textureSize(Color, 0);
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+
+	vec3 current = texelFetch(Color, pixel, 0).rgb;
+	if (Reset != 0)
+	{
+		FragColor = vec4(current, 1.0);
+		return;
+	}
+
+	// Neighbourhood bounds in YCoCg and closest depth for velocity dilation
+	vec3 cmin = vec3(1e9);
+	vec3 cmax = vec3(-1e9);
+	float closestDepth = 1.0;
+	ivec2 closestPixel = pixel;
+	for (int y = -1; y <= 1; ++y)
+	{
+		for (int x = -1; x <= 1; ++x)
+		{
+			ivec2 p = clamp(pixel + ivec2(x, y), ivec2(0), size - 1);
+			vec3 c = rgb_to_ycocg(texelFetch(Color, p, 0).rgb);
+			cmin = min(cmin, c);
+			cmax = max(cmax, c);
+			float d = texelFetch(Depth, p, 0).r;
+			if (d < closestDepth)
+			{
+				closestDepth = d;
+				closestPixel = p;
+			}
+		}
+	}
+
+	// Reproject history
+	vec2 velocity = texelFetch(Velocity, closestPixel, 0).rg;
+	vec2 previousUV = In.TexCoord - velocity;
+	if (any(lessThan(previousUV, vec2(0.0))) || any(greaterThan(previousUV, vec2(1.0))))
+	{
+		FragColor = vec4(current, 1.0);
+		return;
+	}
+	vec3 history = rgb_to_ycocg(texture(History, previousUV).rgb);
+
+	// Clip history towards the center of the neighbourhood box
+	vec3 center = 0.5 * (cmax + cmin);
+	vec3 extents = 0.5 * (cmax - cmin) + 1e-4;
+	vec3 offset = history - center;
+	vec3 ts = abs(offset / extents);
+	float t = max(ts.x, max(ts.y, ts.z));
+	if (t > 1.0)
+		history = center + offset / t;
+
+	// Less history when things move fast, to limit ghosting
+	float speed = length(velocity * vec2(size));
+	float feedback = mix(Feedback, Feedback * 0.8, clamp(speed / 8.0, 0.0, 1.0));
+
+	vec3 color = mix(rgb_to_ycocg(current), history, feedback);
+	FragColor = vec4(ycocg_to_rgb(color), 1.0);
+}